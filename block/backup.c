@@ -42,6 +42,7 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -89,6 +90,20 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Whether the whole range of the source is known to read as zeroes */
+static bool coroutine_fn backup_cluster_is_zero(BackupBlockJob *job,
+                                                int64_t sector_num,
+                                                int nb_sectors)
+{
+    BlockDriverState *file;
+    int64_t ret;
+    int n;
+
+    ret = bdrv_get_block_status_above(blk_bs(job->common.blk), NULL,
+                                      sector_num, nb_sectors, &n, &file);
+    return ret >= 0 && (ret & BDRV_BLOCK_ZERO) && n == nb_sectors;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -126,38 +141,73 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        ret = -ENOTSUP;
+        if (job->use_copy_range &&
+            backup_cluster_is_zero(job, start * sectors_per_cluster, n)) {
+            /* The offloaded copy has no buffer_is_zero() check, so keep
+             * clusters known to read as zeroes unallocated in the target */
+            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
+                                       n * BDRV_SECTOR_SIZE,
+                                       BDRV_REQ_MAY_UNMAP);
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
+            }
+        } else if (job->use_copy_range) {
+            ret = blk_co_copy_range(blk, start * job->cluster_size,
+                                    job->target, start * job->cluster_size,
+                                    n * BDRV_SECTOR_SIZE,
+                                    is_write_notifier ?
+                                    BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                /* Copy the cluster through the bounce buffer instead, which
+                 * also reports errors properly, and don't try again */
+                trace_backup_do_cow_copy_range_fail(job, start, ret);
+                job->use_copy_range = false;
+            }
         }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
         if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+            if (!bounce_buffer) {
+                bounce_buffer = blk_blockalign(blk, job->cluster_size);
+            }
+            iov.iov_base = bounce_buffer;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = blk_co_preadv(blk, start * job->cluster_size,
+                                bounce_qiov.size, &bounce_qiov,
+                                is_write_notifier ?
+                                BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                trace_backup_do_cow_read_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
             }
-            goto out;
-        }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+                ret = blk_co_pwrite_zeroes(job->target,
+                                           start * job->cluster_size,
+                                           bounce_qiov.size,
+                                           BDRV_REQ_MAY_UNMAP);
+            } else {
+                ret = blk_co_pwritev(job->target, start * job->cluster_size,
+                                     bounce_qiov.size, &bounce_qiov,
+                                     job->compress ?
+                                     BDRV_REQ_WRITE_COMPRESSED : 0);
+            }
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
             }
-            goto out;
         }
 
         set_bit(start, job->done_bitmap);
@@ -633,6 +683,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
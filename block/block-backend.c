@@ -1589,6 +1589,47 @@ int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                           flags | BDRV_REQ_ZERO_WRITE);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    BlockDriverState *bs_in = blk_bs(blk_in);
+    BlockDriverState *bs_out = blk_bs(blk_out);
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs_in);
+    bdrv_inc_in_flight(bs_out);
+
+    /* throttling disk I/O */
+    if (blk_in->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_in, bytes, false);
+    }
+    if (blk_out->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_out, bytes, true);
+    }
+
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, flags);
+
+    /* There is no FUA for copy offloading, so emulate it by a flush */
+    if (ret == 0 && !blk_out->enable_write_cache) {
+        ret = bdrv_co_flush(bs_out);
+    }
+
+    bdrv_dec_in_flight(bs_out);
+    bdrv_dec_in_flight(bs_in);
+    return ret;
+}
+
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count)
 {
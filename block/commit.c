@@ -42,11 +42,12 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+    bool use_copy_range;
 } CommitBlockJob;
 
 static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
                                         int64_t sector_num, int nb_sectors,
-                                        void *buf)
+                                        void *buf, bool *use_copy_range)
 {
     int ret = 0;
     QEMUIOVector qiov;
@@ -55,6 +56,17 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
         .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
     };
 
+    if (*use_copy_range) {
+        ret = blk_co_copy_range(bs, sector_num * BDRV_SECTOR_SIZE,
+                                base, sector_num * BDRV_SECTOR_SIZE,
+                                nb_sectors * BDRV_SECTOR_SIZE, 0);
+        if (ret == 0) {
+            return 0;
+        }
+        /* Fall back to a buffered copy for good */
+        *use_copy_range = false;
+    }
+
     qemu_iovec_init_external(&qiov, &iov, 1);
 
     ret = blk_co_preadv(bs, sector_num * BDRV_SECTOR_SIZE,
@@ -159,7 +171,8 @@ static void coroutine_fn commit_run(void *opaque)
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
         if (copy) {
-            ret = commit_populate(s->top, s->base, sector_num, n, buf);
+            ret = commit_populate(s->top, s->base, sector_num, n, buf,
+                                  &s->use_copy_range);
             bytes_written += n * BDRV_SECTOR_SIZE;
         }
         if (ret < 0) {
@@ -289,6 +302,7 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->backing_file_str = g_strdup(backing_file_str);
 
     s->on_error = on_error;
+    s->use_copy_range = true;
 
     trace_commit_start(bs, base, top, s);
     block_job_start(&s->common);
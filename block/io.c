@@ -1653,6 +1653,154 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    BlockDriverState *src_bs, *dst_bs;
+    int64_t start_sector, end_sector;
+    int ret;
+
+    if (!dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    dst_bs = dst->bs;
+
+    ret = bdrv_check_byte_request(dst_bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Drivers pass this flag (and no @src) for ranges that read as zeroes */
+    if (flags & BDRV_REQ_ZERO_WRITE) {
+        return bdrv_co_pwrite_zeroes(dst, dst_offset, bytes,
+                                     flags & ~BDRV_REQ_NO_SERIALISING);
+    }
+
+    if (!src || !src->bs || !src->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    src_bs = src->bs;
+
+    ret = bdrv_check_byte_request(src_bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (dst_bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst_bs->open_flags & BDRV_O_INACTIVE));
+
+    /* Drivers copy the data as it is, so don't bother with encryption,
+     * copy-on-read or requests that would need a read-modify-write cycle */
+    if (!src_bs->drv->bdrv_co_copy_range_from ||
+        !dst_bs->drv->bdrv_co_copy_range_to ||
+        src_bs->encrypted || dst_bs->encrypted ||
+        src_bs->copy_on_read ||
+        !QEMU_IS_ALIGNED(src_offset | bytes, src_bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst_bs->bl.request_alignment))
+    {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bdrv_inc_in_flight(src_bs);
+        tracked_request_begin(&req, src_bs, src_offset, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = src_bs->drv->bdrv_co_copy_range_from(src_bs, src, src_offset,
+                                                   dst, dst_offset, bytes,
+                                                   flags);
+
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(src_bs);
+        return ret;
+    }
+
+    /* Account for the write like bdrv_aligned_pwritev() does, so that write
+     * notifiers (e.g. of backup jobs) and dirty bitmaps see it */
+    bdrv_inc_in_flight(dst_bs);
+    tracked_request_begin(&req, dst_bs, dst_offset, bytes, BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+
+    ret = notifier_with_return_list_notify(&dst_bs->before_write_notifiers,
+                                           &req);
+    if (ret == 0) {
+        ret = dst_bs->drv->bdrv_co_copy_range_to(dst_bs, src, src_offset,
+                                                 dst, dst_offset, bytes,
+                                                 flags);
+    }
+
+    start_sector = dst_offset >> BDRV_SECTOR_BITS;
+    end_sector = DIV_ROUND_UP(dst_offset + bytes, BDRV_SECTOR_SIZE);
+
+    ++dst_bs->write_gen;
+    bdrv_set_dirty(dst_bs, start_sector, end_sector - start_sector);
+
+    if (dst_bs->wr_highest_offset < dst_offset + bytes) {
+        dst_bs->wr_highest_offset = dst_offset + bytes;
+    }
+    if (ret >= 0) {
+        dst_bs->total_sectors = MAX(dst_bs->total_sectors, end_sector);
+    }
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(dst_bs);
+    return ret;
+}
+
+/*
+ * Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/*
+ * Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics.
+ */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset,
+                                   dst, dst_offset,
+                                   bytes, flags);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
@@ -0,0 +1,457 @@
+/*
+ * Compressed clusters for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+
+/*
+ * Compression functions
+ *
+ * They run in the thread pool and must not touch any block layer state. The
+ * compression functions return the compressed size, -ENOSPC if the result
+ * doesn't fit into @dest_size bytes, or another negative errno value. The
+ * decompression functions must fill all of @dest and return 0 on success.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+        ret = -ENOSPC;
+    } else {
+        ret = -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    /* The compressed data is padded to a sector, so don't expect to consume
+     * all of the input */
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.avail_out == 0) {
+        ret = 0;
+    } else {
+        ret = -EIO;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+/* zstd's own default level */
+#define QCOW2_ZSTD_LEVEL 3
+
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, QCOW2_ZSTD_LEVEL);
+    if (ZSTD_isError(ret)) {
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) {
+            return -ENOSPC;
+        }
+        return -EIO;
+    }
+
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input = {
+        .src    = src,
+        .size   = src_size,
+    };
+    ZSTD_outBuffer output = {
+        .dst    = dest,
+        .size   = dest_size,
+    };
+    ssize_t ret = 0;
+    size_t zstd_ret;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /* Use the streaming interface because the frame is followed by sector
+     * padding; it stops at the end of the frame */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret) || zstd_ret == 0) {
+            break;
+        }
+        if (input.pos == last_in_pos && output.pos == last_out_pos) {
+            /* Truncated frame */
+            break;
+        }
+    }
+
+    if (output.pos != output.size) {
+        ret = -EIO;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#ifdef CONFIG_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+typedef struct Qcow2CompressData {
+    Qcow2CompressFunc *func;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/* Runs @func in the thread pool, but never more than QCOW2_MAX_THREADS jobs of
+ * this image at once so that a single image can't occupy the whole pool */
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, Qcow2CompressFunc *func,
+                     void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .func       = func,
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    while (s->nb_compress_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait(&s->compress_wait_queue);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait_queue);
+
+    return data.ret;
+}
+
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, func, dest, dest_size, src, src_size);
+}
+
+static ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                                void *dest, size_t dest_size,
+                                                const void *src,
+                                                size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, func, dest, dest_size, src, src_size);
+}
+
+/*
+ * Cache of decompressed clusters
+ *
+ * Entries are keyed by the host offset of the compressed data. Writes may free
+ * compressed clusters and reuse their space, so they invalidate the whole
+ * cache; the generation number keeps requests that were in flight at that time
+ * from adding stale data afterwards.
+ */
+typedef struct Qcow2DecompressedCluster {
+    uint64_t offset;
+    uint8_t *data;
+    uint64_t lru_counter;
+} Qcow2DecompressedCluster;
+
+struct Qcow2DecompressCache {
+    Qcow2DecompressedCluster *entries;
+    int size;
+    uint64_t lru_counter;
+    uint64_t generation;
+};
+
+Qcow2DecompressCache *qcow2_decompress_cache_create(int num_clusters)
+{
+    Qcow2DecompressCache *c;
+    int i;
+
+    c = g_new0(Qcow2DecompressCache, 1);
+    c->size = num_clusters;
+    c->entries = g_new0(Qcow2DecompressedCluster, num_clusters);
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = -1;
+    }
+
+    return c;
+}
+
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        g_free(c->entries[i].data);
+    }
+
+    g_free(c->entries);
+    g_free(c);
+}
+
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = -1;
+        c->entries[i].lru_counter = 0;
+    }
+
+    c->generation++;
+}
+
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_lookup(Qcow2DecompressCache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == offset) {
+            c->entries[i].lru_counter = ++c->lru_counter;
+            return &c->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Takes ownership of @data */
+static void qcow2_decompress_cache_insert(Qcow2DecompressCache *c,
+                                          uint64_t offset, uint8_t *data)
+{
+    Qcow2DecompressedCluster *entry;
+    int i, victim = 0;
+
+    /* Another request may have decompressed the same cluster meanwhile */
+    if (qcow2_decompress_cache_lookup(c, offset)) {
+        g_free(data);
+        return;
+    }
+
+    for (i = 1; i < c->size; i++) {
+        if (c->entries[i].lru_counter < c->entries[victim].lru_counter) {
+            victim = i;
+        }
+    }
+
+    entry = &c->entries[victim];
+    g_free(entry->data);
+    entry->offset = offset;
+    entry->data = data;
+    entry->lru_counter = ++c->lru_counter;
+}
+
+/*
+ * Reads @bytes bytes at guest offset @offset from the compressed cluster
+ * described by @cluster_descriptor (an L2 entry) into @qiov.
+ *
+ * Must be called without s->lock held, so that reading and decompressing
+ * several clusters can happen in parallel.
+ */
+int coroutine_fn qcow2_co_preadv_compressed(BlockDriverState *bs,
+                                            uint64_t cluster_descriptor,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2DecompressedCluster *entry;
+    int ret, csize, nb_csectors, offset_in_cluster;
+    uint64_t coffset, generation;
+    uint8_t *buf = NULL, *out_buf = NULL;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    assert(offset_in_cluster + bytes <= s->cluster_size);
+
+    coffset = cluster_descriptor & s->cluster_offset_mask;
+    entry = qcow2_decompress_cache_lookup(c, coffset);
+    if (entry) {
+        qemu_iovec_from_buf(qiov, 0, entry->data + offset_in_cluster, bytes);
+        return 0;
+    }
+
+    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * 512 - (coffset & 511);
+
+    buf = g_try_malloc(csize);
+    out_buf = g_try_malloc(s->cluster_size);
+    if (buf == NULL || out_buf == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    generation = c->generation;
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = csize,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+    if (generation == c->generation) {
+        qcow2_decompress_cache_insert(c, coffset, out_buf);
+        out_buf = NULL;
+    }
+
+    ret = 0;
+fail:
+    g_free(buf);
+    g_free(out_buf);
+    return ret;
+}
@@ -34,6 +34,8 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length, uint64_t addend,
                             bool decrease, enum qcow2_discard_type type);
+static void update_free_cluster_map(BDRVQcow2State *s, uint64_t cluster_index,
+                                    uint64_t nb_clusters, bool is_free);
 
 static uint64_t get_refcount_ro0(const void *refcount_array, uint64_t index);
 static uint64_t get_refcount_ro1(const void *refcount_array, uint64_t index);
@@ -121,6 +123,8 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_drop_free_cluster_map(bs);
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_ALL);
 }
 
 
@@ -394,6 +398,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        update_free_cluster_map(s, new_block >> s->cluster_bits, 1, false);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -439,6 +444,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        qcow2_add_metadata_cluster(bs, QCOW2_OL_REFCOUNT_BLOCK, new_block);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -580,6 +586,10 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table = new_table;
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_REFCOUNT_BLOCK);
+
+    update_free_cluster_map(s, meta_offset >> s->cluster_bits,
+                            table_clusters + blocks_clusters, false);
 
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -749,6 +759,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        update_free_cluster_map(s, cluster_index, 1, refcount == 0);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
             update_refcount_discard(bs, cluster_offset, s->cluster_size);
@@ -810,13 +821,175 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 /*********************************************************/
 /* cluster allocation functions */
 
+/*
+ * Scans all refcount blocks once and records which host clusters are free, so
+ * that alloc_clusters_noref() doesn't have to read refcount blocks any more.
+ *
+ * The map only covers the clusters described by refcount blocks that are
+ * actually in use; everything behind it is free and the map is grown on
+ * demand by update_free_cluster_map().
+ */
+static int build_free_cluster_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t map_size, refblock_offset, first, i, j, run_start;
+    uint64_t nb_refblocks;
+    void *refcount_block;
+    HBitmap *map;
+    int ret;
+
+    for (nb_refblocks = s->refcount_table_size; nb_refblocks > 0;
+         nb_refblocks--)
+    {
+        if (s->refcount_table[nb_refblocks - 1] & REFT_OFFSET_MASK) {
+            break;
+        }
+    }
+
+    map_size = nb_refblocks << s->refcount_block_bits;
+    map = hbitmap_alloc(map_size, 0);
+
+    for (i = 0; i < nb_refblocks; i++) {
+        first = i << s->refcount_block_bits;
+        refblock_offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+        if (!refblock_offset) {
+            hbitmap_set(map, first, s->refcount_block_size);
+            continue;
+        }
+
+        if (offset_into_cluster(s, refblock_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#"
+                                    PRIx64 " unaligned (reftable index: %#"
+                                    PRIx64 ")", refblock_offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_cache_get(bs, s->refcount_block_cache, refblock_offset,
+                              &refcount_block);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Set whole runs of free clusters at once */
+        run_start = s->refcount_block_size;
+        for (j = 0; j < s->refcount_block_size; j++) {
+            if (s->get_refcount(refcount_block, j) == 0) {
+                if (run_start == s->refcount_block_size) {
+                    run_start = j;
+                }
+            } else if (run_start < j) {
+                hbitmap_set(map, first + run_start, j - run_start);
+                run_start = s->refcount_block_size;
+            }
+        }
+        if (run_start < s->refcount_block_size) {
+            hbitmap_set(map, first + run_start,
+                        s->refcount_block_size - run_start);
+        }
+
+        qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+    }
+
+    s->free_cluster_map = map;
+    s->free_cluster_map_size = map_size;
+    return 0;
+
+fail:
+    hbitmap_free(map);
+    return ret;
+}
+
+/*
+ * Keeps the free cluster map in sync after the refcounts of @nb_clusters
+ * clusters starting at @cluster_index have dropped to zero (@is_free is true)
+ * or have become non-zero (@is_free is false).
+ */
+static void update_free_cluster_map(BDRVQcow2State *s, uint64_t cluster_index,
+                                    uint64_t nb_clusters, bool is_free)
+{
+    uint64_t end = cluster_index + nb_clusters;
+    uint64_t new_size;
+
+    if (!s->free_cluster_map) {
+        return;
+    }
+
+    if (!is_free && end > s->free_cluster_map_size) {
+        /* Everything not covered by the map yet is free. Grow in units of
+         * whole refcount blocks so that appending to the image doesn't
+         * resize the map on every allocation. */
+        new_size = QEMU_ALIGN_UP(end, s->refcount_block_size);
+        hbitmap_truncate(s->free_cluster_map, new_size);
+        hbitmap_set(s->free_cluster_map, s->free_cluster_map_size,
+                    new_size - s->free_cluster_map_size);
+        s->free_cluster_map_size = new_size;
+    }
+
+    end = MIN(end, s->free_cluster_map_size);
+    if (cluster_index >= end) {
+        return;
+    }
+
+    if (is_free) {
+        hbitmap_set(s->free_cluster_map, cluster_index, end - cluster_index);
+    } else {
+        hbitmap_reset(s->free_cluster_map, cluster_index, end - cluster_index);
+    }
+}
+
+/*
+ * Forgets the free cluster map. This must be called whenever the refcount
+ * structures are replaced as a whole; the map is rebuilt on the next cluster
+ * allocation.
+ */
+void qcow2_drop_free_cluster_map(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->free_cluster_map) {
+        hbitmap_free(s->free_cluster_map);
+        s->free_cluster_map = NULL;
+        s->free_cluster_map_size = 0;
+    }
+}
+
+/*
+ * Returns the index of the first cluster of a run of @nb_clusters free
+ * clusters that starts at or after @start.
+ */
+static uint64_t find_free_clusters(BDRVQcow2State *s, uint64_t start,
+                                   uint64_t nb_clusters)
+{
+    HBitmap *map = s->free_cluster_map;
+    HBitmapIter hbi;
+    int64_t next, used;
+
+    if (start >= s->free_cluster_map_size) {
+        return start;
+    }
+
+    hbitmap_iter_init(&hbi, map, start);
+    while ((next = hbitmap_iter_next(&hbi)) >= 0) {
+        /* A run reaching the end of the map continues beyond it, so
+         * hbitmap_next_zero() clamping the range is fine here */
+        used = hbitmap_next_zero(map, next, nb_clusters);
+        if (used < 0) {
+            return next;
+        }
+
+        /* Cluster @used is in use, continue the search behind it */
+        hbitmap_iter_init(&hbi, map, used);
+    }
 
+    return MAX(start, s->free_cluster_map_size);
+}
 
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -824,19 +997,17 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
         qcow2_process_discards(bs, 0);
     }
 
-    nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
+    if (!s->free_cluster_map) {
+        ret = build_free_cluster_map(bs);
         if (ret < 0) {
             return ret;
-        } else if (refcount != 0) {
-            goto retry;
         }
     }
 
+    nb_clusters = size_to_clusters(s, size);
+    s->free_cluster_index = find_free_clusters(s, s->free_cluster_index,
+                                               nb_clusters) + nb_clusters;
+
     /* Make sure that all offsets in the "allocated" range are representable
      * in an int64_t */
     if (s->free_cluster_index > 0 &&
@@ -881,6 +1052,7 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     uint64_t cluster_index, refcount;
     uint64_t i;
+    int64_t used;
     int ret;
 
     assert(nb_clusters >= 0);
@@ -891,12 +1063,21 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
-        for(i = 0; i < nb_clusters; i++) {
-            ret = qcow2_get_refcount(bs, cluster_index++, &refcount);
-            if (ret < 0) {
-                return ret;
-            } else if (refcount != 0) {
-                break;
+        if (s->free_cluster_map) {
+            used = -1;
+            if (cluster_index < s->free_cluster_map_size) {
+                used = hbitmap_next_zero(s->free_cluster_map, cluster_index,
+                                         nb_clusters);
+            }
+            i = used < 0 ? nb_clusters : used - cluster_index;
+        } else {
+            for (i = 0; i < nb_clusters; i++, cluster_index++) {
+                ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+                if (ret < 0) {
+                    return ret;
+                } else if (refcount != 0) {
+                    break;
+                }
             }
         }
 
@@ -1000,7 +1181,7 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 {
     BDRVQcow2State *s = bs->opaque;
 
-    switch (qcow2_get_cluster_type(l2_entry)) {
+    switch (qcow2_get_cluster_type(s, l2_entry)) {
     case QCOW2_CLUSTER_COMPRESSED:
         {
             int nb_csectors;
@@ -1013,6 +1194,10 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
         break;
     case QCOW2_CLUSTER_NORMAL:
     case QCOW2_CLUSTER_ZERO:
+        /* Clusters in an external data file have no refcounts */
+        if (has_data_file(s)) {
+            break;
+        }
         if (l2_entry & L2E_OFFSET_MASK) {
             if (offset_into_cluster(s, l2_entry & L2E_OFFSET_MASK)) {
                 qcow2_signal_corruption(bs, false, -1, -1,
@@ -1038,20 +1223,401 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 
 
 
+/*
+ * Maximum number of L2 table reads that are kept in flight while walking an
+ * L1 table. This also bounds the memory used for L2 table buffers to this
+ * number of clusters.
+ */
+#define QCOW2_WALK_L2_READS 16
+
+/*
+ * Callback for walk_l2_tables(). @l2_table contains the L2 table referenced by
+ * L1 entry @l1_index if @read_ret is not negative; otherwise, reading it
+ * failed and its contents are undefined.
+ */
+typedef int Qcow2L2WalkFunc(BlockDriverState *bs, int l1_index,
+                            uint64_t *l2_table, int read_ret, void *opaque);
+
+typedef struct Qcow2L2Read {
+    struct Qcow2L2Walk *walk;
+    int l1_index;       /* -1 if the slot is unused */
+    uint64_t *l2_table;
+    int ret;
+    bool done;
+} Qcow2L2Read;
+
+typedef struct Qcow2L2Walk {
+    BlockDriverState *bs;
+    const uint64_t *l1_table;
+    int l1_size;
+    Qcow2L2WalkFunc *func;
+    void *opaque;
+
+    /* Next L1 index for which the L2 table has not been requested yet */
+    int next_index;
+    /* Ring of reads in L1 order, starting with the oldest one at head */
+    Qcow2L2Read reads[QCOW2_WALK_L2_READS];
+    int head;
+    CoQueue read_done;
+
+    int ret;
+} Qcow2L2Walk;
+
+static void coroutine_fn walk_l2_read_entry(void *opaque)
+{
+    Qcow2L2Read *r = opaque;
+    Qcow2L2Walk *walk = r->walk;
+    BDRVQcow2State *s = walk->bs->opaque;
+    uint64_t l2_offset = walk->l1_table[r->l1_index] & L1E_OFFSET_MASK;
+
+    r->ret = bdrv_pread(walk->bs->file, l2_offset, r->l2_table,
+                        s->cluster_size);
+    r->done = true;
+    qemu_co_queue_restart_all(&walk->read_done);
+}
+
+/*
+ * Issues the read of the next L2 table into the (unused) slot @r. If there are
+ * no L2 tables left, the slot stays unused.
+ */
+static void coroutine_fn walk_l2_start_read(Qcow2L2Walk *walk, Qcow2L2Read *r)
+{
+    Coroutine *co;
+
+    while (walk->next_index < walk->l1_size &&
+           !(walk->l1_table[walk->next_index] & L1E_OFFSET_MASK))
+    {
+        walk->next_index++;
+    }
+
+    if (walk->next_index >= walk->l1_size) {
+        r->l1_index = -1;
+        return;
+    }
+
+    r->l1_index = walk->next_index++;
+    r->done = false;
+    co = qemu_coroutine_create(walk_l2_read_entry, r);
+    qemu_coroutine_enter(co);
+}
+
+static void coroutine_fn walk_l2_tables_entry(void *opaque)
+{
+    Qcow2L2Walk *walk = opaque;
+    BlockDriverState *bs = walk->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2L2Read *r;
+    int i, ret = 0;
+
+    qemu_co_queue_init(&walk->read_done);
+
+    for (i = 0; i < QCOW2_WALK_L2_READS; i++) {
+        walk->reads[i].walk = walk;
+        walk->reads[i].l1_index = -1;
+    }
+
+    for (i = 0; i < QCOW2_WALK_L2_READS; i++) {
+        r = &walk->reads[i];
+        r->l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        if (r->l2_table == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < QCOW2_WALK_L2_READS; i++) {
+        walk_l2_start_read(walk, &walk->reads[i]);
+    }
+
+    /* The L2 tables are read in parallel, but processed in L1 order so that
+     * the results (and any messages printed) do not depend on the order in
+     * which the reads complete */
+    for (i = 0; i < walk->l1_size; i++) {
+        if (!(walk->l1_table[i] & L1E_OFFSET_MASK)) {
+            continue;
+        }
+
+        r = &walk->reads[walk->head];
+        assert(r->l1_index == i);
+        while (!r->done) {
+            qemu_co_queue_wait(&walk->read_done);
+        }
+
+        ret = walk->func(bs, i, r->l2_table, r->ret, walk->opaque);
+        if (ret < 0) {
+            goto out;
+        }
+
+        walk_l2_start_read(walk, r);
+        walk->head = (walk->head + 1) % QCOW2_WALK_L2_READS;
+    }
+
+out:
+    /* Reads may still be in flight if we are bailing out early */
+    for (i = 0; i < QCOW2_WALK_L2_READS; i++) {
+        r = &walk->reads[i];
+        while (r->l1_index >= 0 && !r->done) {
+            qemu_co_queue_wait(&walk->read_done);
+        }
+        qemu_vfree(r->l2_table);
+    }
+
+    walk->ret = ret;
+}
+
+/*
+ * Calls @func for every L2 table referenced by @l1_table (which must be in
+ * host byte order), in L1 order. Up to QCOW2_WALK_L2_READS L2 tables are read
+ * ahead concurrently, so the latency of the metadata reads is not paid once
+ * per L2 table.
+ *
+ * Returns 0 on success, or the first negative value returned by @func or
+ * -errno if an internal error occurred.
+ */
+static int walk_l2_tables(BlockDriverState *bs, const uint64_t *l1_table,
+                          int l1_size, Qcow2L2WalkFunc *func, void *opaque)
+{
+    Coroutine *co;
+    Qcow2L2Walk walk = {
+        .bs         = bs,
+        .l1_table   = l1_table,
+        .l1_size    = l1_size,
+        .func       = func,
+        .opaque     = opaque,
+        .ret        = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        walk_l2_tables_entry(&walk);
+    } else {
+        co = qemu_coroutine_create(walk_l2_tables_entry, &walk);
+        qemu_coroutine_enter(co);
+        BDRV_POLL_WHILE(bs->file->bs, walk.ret == -EINPROGRESS);
+    }
+
+    return walk.ret;
+}
+
+typedef struct UpdateSnapshotRefcountState {
+    uint64_t *l1_table;
+    int addend;
+    bool l1_modified;
+    /* Cluster indices of the L2 tables that have been processed so far */
+    GHashTable *l2_tables;
+} UpdateSnapshotRefcountState;
+
+static int update_snapshot_refcount_l2(BlockDriverState *bs, int l1_index,
+                                       uint64_t *l2_table, int read_ret,
+                                       void *opaque)
+{
+    BDRVQcow2State *s = bs->opaque;
+    UpdateSnapshotRefcountState *state = opaque;
+    int addend = state->addend;
+    uint64_t old_l2_offset = state->l1_table[l1_index];
+    uint64_t l2_offset = old_l2_offset & L1E_OFFSET_MASK;
+    uint64_t *l2_slice = NULL;
+    uint64_t refcount;
+    gpointer key = GSIZE_TO_POINTER(l2_offset >> s->cluster_bits);
+    unsigned slice, slice_size2, n_slices;
+    bool use_prefetched;
+    int j, nb_csectors;
+    int ret;
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
+                                PRIx64 " unaligned (L1 index: %#x)",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    /* The copy that was read ahead is stale if this L2 table has already
+     * been modified through another L1 entry and then evicted from the cache,
+     * so only use it for the first reference. (Key collisions on 32-bit hosts
+     * only cost an additional read.) */
+    use_prefetched = read_ret >= 0 &&
+                     !g_hash_table_lookup_extended(state->l2_tables, key,
+                                                   NULL, NULL);
+    g_hash_table_add(state->l2_tables, key);
+
+    for (slice = 0; slice < n_slices; slice++) {
+        uint64_t slice_offset = l2_offset + slice * slice_size2;
+        int64_t run_offset = 0, run_length = 0;
+
+        if (use_prefetched) {
+            ret = qcow2_cache_get_prefetched(bs, s->l2_table_cache,
+                                             slice_offset,
+                                             (uint8_t *) l2_table +
+                                             slice * slice_size2,
+                                             (void **) &l2_slice);
+        } else {
+            ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                  (void **) &l2_slice);
+        }
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Update the refcounts first. Runs of contiguous data clusters are
+         * passed to update_refcount() at once, so every refcount block is
+         * looked up only once per run instead of once per cluster. */
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t offset = get_l2_entry(s, l2_slice, j) &
+                              ~QCOW_OFLAG_COPIED;
+            uint64_t data_offset;
+
+            switch (qcow2_get_cluster_type(s, offset)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                if (addend != 0) {
+                    nb_csectors = ((offset >> s->csize_shift) &
+                                   s->csize_mask) + 1;
+                    ret = update_refcount(bs,
+                        (offset & s->cluster_offset_mask) & ~511,
+                        nb_csectors * 512, abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+                break;
+
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_ZERO:
+                data_offset = offset & L2E_OFFSET_MASK;
+                if (offset_into_cluster(s, data_offset)) {
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(bs, true, -1, -1,
+                            "Data cluster offset %#" PRIx64 " unaligned "
+                            "(L2 offset: %#" PRIx64 ", L2 index: %#x)",
+                            data_offset, l2_offset, l2_index);
+                    ret = -EIO;
+                    goto fail;
+                }
+
+                if (!data_offset || addend == 0) {
+                    break;
+                }
+                if (run_length && data_offset == run_offset + run_length) {
+                    run_length += s->cluster_size;
+                    break;
+                }
+
+                ret = update_refcount(bs, run_offset, run_length,
+                                      abs(addend), addend < 0,
+                                      QCOW2_DISCARD_SNAPSHOT);
+                if (ret < 0) {
+                    goto fail;
+                }
+                run_offset = data_offset;
+                run_length = s->cluster_size;
+                break;
+
+            case QCOW2_CLUSTER_UNALLOCATED:
+                break;
+
+            default:
+                abort();
+            }
+        }
+
+        ret = update_refcount(bs, run_offset, run_length, abs(addend),
+                              addend < 0, QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Then set the copied flag according to the new refcounts */
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t old_offset = get_l2_entry(s, l2_slice, j);
+            uint64_t offset = old_offset & ~QCOW_OFLAG_COPIED;
+            uint64_t cluster_index;
+
+            switch (qcow2_get_cluster_type(s, offset)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                /* compressed clusters are never modified */
+                refcount = 2;
+                break;
+
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_ZERO:
+                cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                if (!cluster_index) {
+                    /* unallocated */
+                    refcount = 0;
+                    break;
+                }
+                ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+                if (ret < 0) {
+                    goto fail;
+                }
+                break;
+
+            default:
+                refcount = 0;
+                break;
+            }
+
+            if (refcount == 1) {
+                offset |= QCOW_OFLAG_COPIED;
+            }
+            if (offset != old_offset) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                        s->refcount_block_cache);
+                }
+                set_l2_entry(s, l2_slice, j, offset);
+                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+            }
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    if (addend != 0) {
+        ret = qcow2_update_cluster_refcount(bs, l2_offset >> s->cluster_bits,
+                                            abs(addend), addend < 0,
+                                            QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    } else if (refcount == 1) {
+        l2_offset |= QCOW_OFLAG_COPIED;
+    }
+    if (l2_offset != old_l2_offset) {
+        state->l1_table[l1_index] = l2_offset;
+        state->l1_modified = true;
+    }
+
+    return 0;
+
+fail:
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    }
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
+    UpdateSnapshotRefcountState state = {
+        .addend = addend,
+    };
+    uint64_t *l1_table, l1_size2;
     bool l1_allocated = false;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors;
+    int i;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1081,142 +1647,29 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
         l1_allocated = false;
     }
 
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            if (offset_into_cluster(s, l2_offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
-                                        PRIx64 " unaligned (L1 index: %#x)",
-                                        l2_offset, i);
-                ret = -EIO;
-                goto fail;
-            }
-
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
-
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
-                }
-
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
-                    }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
-                }
-            }
-
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    /* The L2 tables are read ahead from the image file, bypassing the cache,
+     * so any dirty L2 tables must be written back first */
+    ret = qcow2_cache_write(bs, s->l2_table_cache);
+    if (ret < 0) {
+        goto fail;
+    }
 
-            if (addend != 0) {
-                ret = qcow2_update_cluster_refcount(bs, l2_offset >>
-                                                        s->cluster_bits,
-                                                    abs(addend), addend < 0,
-                                                    QCOW2_DISCARD_SNAPSHOT);
-                if (ret < 0) {
-                    goto fail;
-                }
-            }
-            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                     &refcount);
-            if (ret < 0) {
-                goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
-            }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
-                l1_modified = 1;
-            }
-        }
+    state.l1_table = l1_table;
+    state.l2_tables = g_hash_table_new(NULL, NULL);
+    ret = walk_l2_tables(bs, l1_table, l1_size, update_snapshot_refcount_l2,
+                         &state);
+    g_hash_table_destroy(state.l2_tables);
+    if (ret < 0) {
+        goto fail;
     }
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
-    if (ret == 0 && addend >= 0 && l1_modified) {
+    if (ret == 0 && addend >= 0 && state.l1_modified) {
         for (i = 0; i < l1_size; i++) {
             cpu_to_be64s(&l1_table[i]);
         }
@@ -1240,6 +1693,39 @@ fail:
 /* refcount checking functions */
 
 
+/*
+ * Size in bytes above which the in-memory refcount table used for checking an
+ * image without repairing it is split into windows of whole refcount blocks.
+ * The L1 and L2 tables are still walked only once: the references found are
+ * sorted into one bucket per window, from which the refcount table of each
+ * window is built in turn.
+ */
+#define QCOW2_CHECK_WINDOW_SIZE (16 * 1024 * 1024)
+
+/*
+ * count references to consecutive clusters, the first one being cluster start
+ * of the window whose bucket holds the run. References to contiguously
+ * allocated clusters are merged into a single run, so a bucket usually takes
+ * much less memory than the refcount table of its window.
+ */
+typedef struct RefcountRun {
+    uint32_t start;
+    uint32_t count;
+} RefcountRun;
+
+/*
+ * References collected while walking the metadata of an image that is checked
+ * in windows of window_clusters clusters. The last window also takes all
+ * references beyond the end of the image. Functions taking buckets accept
+ * NULL for counting the references directly in a refcount table of the whole
+ * image.
+ */
+typedef struct RefcountBuckets {
+    int64_t window_clusters;
+    int nb_windows;
+    GArray **runs;          /* RefcountRun array of each window */
+} RefcountBuckets;
+
 static uint64_t refcount_array_byte_size(BDRVQcow2State *s, uint64_t entries)
 {
     /* This assertion holds because there is no way we can address more than
@@ -1303,31 +1789,65 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
 }
 
 /*
- * Increases the refcount for a range of clusters in a given refcount table.
- * This is used to construct a temporary refcount table out of L1 and L2 tables
- * which can be compared to the refcount table saved in the image.
+ * Adds references to clusters first to last to the buckets of the windows
+ * they are in.
+ */
+static int add_refcount_runs(RefcountBuckets *buckets,
+                             uint64_t first, uint64_t last)
+{
+    while (first <= last) {
+        int window = MIN(first / buckets->window_clusters,
+                         buckets->nb_windows - 1);
+        uint64_t window_start = window * buckets->window_clusters;
+        uint64_t end = last;
+        GArray *runs = buckets->runs[window];
+        RefcountRun *prev = NULL;
+
+        if (window < buckets->nb_windows - 1) {
+            end = MIN(end, window_start + buckets->window_clusters - 1);
+        }
+
+        /* A refcount table this large could not be allocated anyway */
+        if (end - window_start >= UINT32_MAX) {
+            return -EFBIG;
+        }
+
+        if (runs->len) {
+            prev = &g_array_index(runs, RefcountRun, runs->len - 1);
+        }
+        if (prev && prev->start + prev->count == first - window_start) {
+            prev->count += end - first + 1;
+        } else {
+            RefcountRun run = {
+                .start  = first - window_start,
+                .count  = end - first + 1,
+            };
+            g_array_append_val(runs, run);
+        }
+
+        first = end + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Increases the refcount of clusters first to last in a refcount table whose
+ * entry 0 is cluster table_start.
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+static int inc_refcount_range(BDRVQcow2State *s, BdrvCheckResult *res,
+                              void **refcount_table,
+                              int64_t *refcount_table_size,
+                              int64_t table_start,
+                              uint64_t first, uint64_t last)
 {
-    BDRVQcow2State *s = bs->opaque;
-    uint64_t start, last, cluster_offset, k, refcount;
+    uint64_t cluster, k, refcount;
     int ret;
 
-    if (size <= 0) {
-        return 0;
-    }
-
-    start = start_of_cluster(s, offset);
-    last = start_of_cluster(s, offset + size - 1);
-    for(cluster_offset = start; cluster_offset <= last;
-        cluster_offset += s->cluster_size) {
-        k = cluster_offset >> s->cluster_bits;
+    for (cluster = first; cluster <= last; cluster++) {
+        k = cluster - table_start;
         if (k >= *refcount_table_size) {
             ret = realloc_refcount_array(s, refcount_table,
                                          refcount_table_size, k + 1);
@@ -1340,7 +1860,7 @@ static int inc_refcounts(BlockDriverState *bs,
         refcount = s->get_refcount(*refcount_table, k);
         if (refcount == s->refcount_max) {
             fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
-                    "\n", cluster_offset);
+                    "\n", cluster << s->cluster_bits);
             fprintf(stderr, "Use qemu-img amend to increase the refcount entry "
                     "width or qemu-img convert to create a clean copy if the "
                     "image cannot be opened for writing\n");
@@ -1353,6 +1873,43 @@ static int inc_refcounts(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Increases the refcount for a range of clusters in a given refcount table.
+ * This is used to construct a temporary refcount table out of L1 and L2 tables
+ * which can be compared to the refcount table saved in the image. If @buckets
+ * is not NULL, the references are added to it instead.
+ *
+ * Modifies the number of errors in res.
+ */
+static int inc_refcounts(BlockDriverState *bs,
+                         BdrvCheckResult *res,
+                         RefcountBuckets *buckets,
+                         void **refcount_table,
+                         int64_t *refcount_table_size,
+                         int64_t offset, int64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t first, last;
+    int ret;
+
+    if (size <= 0) {
+        return 0;
+    }
+
+    first = offset >> s->cluster_bits;
+    last = (offset + size - 1) >> s->cluster_bits;
+    if (!buckets) {
+        return inc_refcount_range(s, res, refcount_table, refcount_table_size,
+                                  0, first, last);
+    }
+
+    ret = add_refcount_runs(buckets, first, last);
+    if (ret < 0) {
+        res->check_errors++;
+    }
+    return ret;
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1367,31 +1924,36 @@ enum {
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
+                              RefcountBuckets *buckets,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+            uint64_t alloc_bits = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+
+            if (((l2_entry & QCOW_OFLAG_COMPRESSED) && l2_bitmap) ||
+                (alloc_bits & (l2_bitmap >> 32)) ||
+                (alloc_bits && !qcow2_data_offset_valid(s, l2_entry)))
+            {
+                fprintf(stderr, "ERROR: L2 entry %#x of table %#" PRIx64
+                        " has an invalid subcluster bitmap %#" PRIx64 "\n",
+                        i, l2_offset, l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
-        switch (qcow2_get_cluster_type(l2_entry)) {
+        switch (qcow2_get_cluster_type(s, l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
             /* Compressed clusters don't have QCOW_OFLAG_COPIED */
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -1406,10 +1968,11 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = inc_refcounts(bs, res, buckets, refcount_table,
+                                refcount_table_size, l2_entry & ~511,
+                                nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1444,11 +2007,15 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 next_contiguous_offset = offset + s->cluster_size;
             }
 
-            /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
+            /* Mark cluster as used; clusters in an external data file have
+             * no refcounts */
+            if (!has_data_file(s)) {
+                ret = inc_refcounts(bs, res, buckets, refcount_table,
+                                    refcount_table_size, offset,
+                                    s->cluster_size);
+                if (ret < 0) {
+                    return ret;
+                }
             }
 
             /* Correct offsets are cluster aligned */
@@ -1468,12 +2035,53 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+typedef struct CheckRefcountsL1State {
+    BdrvCheckResult *res;
+    RefcountBuckets *buckets;
+    void **refcount_table;
+    int64_t *refcount_table_size;
+    const uint64_t *l1_table;
+    int flags;
+} CheckRefcountsL1State;
+
+static int check_refcounts_l1_entry(BlockDriverState *bs, int l1_index,
+                                    uint64_t *l2_table, int read_ret,
+                                    void *opaque)
+{
+    BDRVQcow2State *s = bs->opaque;
+    CheckRefcountsL1State *state = opaque;
+    BdrvCheckResult *res = state->res;
+    uint64_t l2_offset = state->l1_table[l1_index] & L1E_OFFSET_MASK;
+    int ret;
+
+    /* Mark L2 table as used */
+    ret = inc_refcounts(bs, res, state->buckets, state->refcount_table,
+                        state->refcount_table_size, l2_offset,
+                        s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* L2 tables are cluster aligned */
+    if (offset_into_cluster(s, l2_offset)) {
+        fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+            "cluster aligned; L1 entry corrupted\n", l2_offset);
+        res->corruptions++;
+    }
+
+    if (read_ret < 0) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+        res->check_errors++;
+        return read_ret;
+    }
+
+    /* Process and check L2 entries */
+    return check_refcounts_l2(bs, res, state->buckets, state->refcount_table,
+                              state->refcount_table_size, l2_offset,
+                              l2_table, state->flags);
 }
 
 /*
@@ -1486,19 +2094,26 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
+                              RefcountBuckets *buckets,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
                               int flags)
 {
-    BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table = NULL, l2_offset, l1_size2;
+    uint64_t *l1_table = NULL, l1_size2;
+    CheckRefcountsL1State state = {
+        .res                    = res,
+        .buckets                = buckets,
+        .refcount_table         = refcount_table,
+        .refcount_table_size    = refcount_table_size,
+        .flags                  = flags,
+    };
     int i, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+    ret = inc_refcounts(bs, res, buckets, refcount_table, refcount_table_size,
                         l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
@@ -1523,31 +2138,11 @@ static int check_refcounts_l1(BlockDriverState *bs,
     }
 
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
-
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
-        }
+    state.l1_table = l1_table;
+    ret = walk_l2_tables(bs, l1_table, l1_size, check_refcounts_l1_entry,
+                         &state);
+    if (ret < 0) {
+        goto fail;
     }
     g_free(l1_table);
     return 0;
@@ -1557,141 +2152,172 @@ fail:
     return ret;
 }
 
-/*
- * Checks the OFLAG_COPIED flag for all L1 and L2 entries.
- *
- * This function does not print an error message nor does it increment
- * check_errors if qcow2_get_refcount fails (this is because such an error will
- * have been already detected and sufficiently signaled by the calling function
- * (qcow2_check_refcounts) by the time this function is called).
- */
-static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
-                              BdrvCheckMode fix)
+typedef struct CheckOflagCopiedState {
+    BdrvCheckResult *res;
+    BdrvCheckMode fix;
+} CheckOflagCopiedState;
+
+static int check_oflag_copied_l1_entry(BlockDriverState *bs, int l1_index,
+                                       uint64_t *l2_table, int read_ret,
+                                       void *opaque)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    CheckOflagCopiedState *state = opaque;
+    BdrvCheckResult *res = state->res;
+    BdrvCheckMode fix = state->fix;
+    uint64_t l1_entry = s->l1_table[l1_index];
+    uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
+    bool l2_dirty = false;
     uint64_t refcount;
-    int i, j;
-
-    for (i = 0; i < s->l1_size; i++) {
-        uint64_t l1_entry = s->l1_table[i];
-        uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
-
-        if (!l2_offset) {
-            continue;
-        }
+    int ret;
+    int j;
 
-        ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                 &refcount);
-        if (ret < 0) {
-            /* don't print message nor increment check_errors */
-            continue;
-        }
-        if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
-            fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
-                    "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                    fix & BDRV_FIX_ERRORS ? "Repairing" :
-                                            "ERROR",
-                    i, l1_entry, refcount);
-            if (fix & BDRV_FIX_ERRORS) {
-                s->l1_table[i] = refcount == 1
-                               ? l1_entry |  QCOW_OFLAG_COPIED
-                               : l1_entry & ~QCOW_OFLAG_COPIED;
-                ret = qcow2_write_l1_entry(bs, i);
-                if (ret < 0) {
-                    res->check_errors++;
-                    goto fail;
-                }
-                res->corruptions_fixed++;
-            } else {
-                res->corruptions++;
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        /* don't print message nor increment check_errors */
+        return 0;
+    }
+    if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
+        fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
+                "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                fix & BDRV_FIX_ERRORS ? "Repairing" :
+                                        "ERROR",
+                l1_index, l1_entry, refcount);
+        if (fix & BDRV_FIX_ERRORS) {
+            s->l1_table[l1_index] = refcount == 1
+                                  ? l1_entry |  QCOW_OFLAG_COPIED
+                                  : l1_entry & ~QCOW_OFLAG_COPIED;
+            ret = qcow2_write_l1_entry(bs, l1_index);
+            if (ret < 0) {
+                res->check_errors++;
+                return ret;
             }
+            res->corruptions_fixed++;
+        } else {
+            res->corruptions++;
         }
+    }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
-            fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
-                    strerror(-ret));
-            res->check_errors++;
-            goto fail;
-        }
+    if (read_ret < 0) {
+        fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
+                strerror(-read_ret));
+        res->check_errors++;
+        return read_ret;
+    }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
+    for (j = 0; j < s->l2_size; j++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+        uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
+        int cluster_type = qcow2_get_cluster_type(s, l2_entry);
 
-            if ((cluster_type == QCOW2_CLUSTER_NORMAL) ||
-                ((cluster_type == QCOW2_CLUSTER_ZERO) && (data_offset != 0))) {
-                ret = qcow2_get_refcount(bs,
-                                         data_offset >> s->cluster_bits,
-                                         &refcount);
-                if (ret < 0) {
-                    /* don't print message nor increment check_errors */
-                    continue;
-                }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
-                    fprintf(stderr, "%s OFLAG_COPIED data cluster: "
-                            "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                            fix & BDRV_FIX_ERRORS ? "Repairing" :
-                                                    "ERROR",
-                            l2_entry, refcount);
-                    if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
-                        l2_dirty = true;
-                        res->corruptions_fixed++;
-                    } else {
-                        res->corruptions++;
-                    }
-                }
-            }
+        /* Clusters in an external data file have no refcounts */
+        if (has_data_file(s)) {
+            continue;
         }
 
-        if (l2_dirty) {
-            ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                                                l2_offset, s->cluster_size);
+        if ((cluster_type == QCOW2_CLUSTER_NORMAL) ||
+            ((cluster_type == QCOW2_CLUSTER_ZERO) && (data_offset != 0))) {
+            ret = qcow2_get_refcount(bs,
+                                     data_offset >> s->cluster_bits,
+                                     &refcount);
             if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table; metadata "
-                        "overlap check failed: %s\n", strerror(-ret));
-                res->check_errors++;
-                goto fail;
+                /* don't print message nor increment check_errors */
+                continue;
+            }
+            if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                fprintf(stderr, "%s OFLAG_COPIED data cluster: "
+                        "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                        fix & BDRV_FIX_ERRORS ? "Repairing" :
+                                                "ERROR",
+                        l2_entry, refcount);
+                if (fix & BDRV_FIX_ERRORS) {
+                    set_l2_entry(s, l2_table, j, refcount == 1
+                                 ? l2_entry |  QCOW_OFLAG_COPIED
+                                 : l2_entry & ~QCOW_OFLAG_COPIED);
+                    l2_dirty = true;
+                    res->corruptions_fixed++;
+                } else {
+                    res->corruptions++;
+                }
             }
+        }
+    }
 
-            ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
-                              s->cluster_size);
-            if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
-                        strerror(-ret));
-                res->check_errors++;
-                goto fail;
-            }
+    if (l2_dirty) {
+        ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
+                                            l2_offset, s->cluster_size);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table; metadata "
+                    "overlap check failed: %s\n", strerror(-ret));
+            res->check_errors++;
+            return ret;
+        }
+
+        ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
+                          s->cluster_size);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
+                    strerror(-ret));
+            res->check_errors++;
+            return ret;
         }
     }
 
-    ret = 0;
+    return 0;
+}
 
-fail:
-    qemu_vfree(l2_table);
-    return ret;
+/*
+ * Checks the OFLAG_COPIED flag for all L1 and L2 entries.
+ *
+ * This function does not print an error message nor does it increment
+ * check_errors if qcow2_get_refcount fails (this is because such an error will
+ * have been already detected and sufficiently signaled by the calling function
+ * (qcow2_check_refcounts) by the time this function is called).
+ */
+static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
+                              BdrvCheckMode fix)
+{
+    BDRVQcow2State *s = bs->opaque;
+    CheckOflagCopiedState state = {
+        .res    = res,
+        .fix    = fix,
+    };
+
+    return walk_l2_tables(bs, s->l1_table, s->l1_size,
+                          check_oflag_copied_l1_entry, &state);
+}
+
+/*
+ * Reports a refcount block whose cluster is not referenced exactly once.
+ */
+static void check_refblock_refcount(BdrvCheckResult *res, bool *rebuild,
+                                    int64_t i, uint64_t refcount)
+{
+    if (refcount != 1) {
+        fprintf(stderr, "ERROR refcount block %" PRId64
+                " refcount=%" PRIu64 "\n", i, refcount);
+        res->corruptions++;
+        *rebuild = true;
+    }
 }
 
 /*
  * Checks consistency of refblocks and accounts for each refblock in
- * *refcount_table.
+ * *refcount_table, or in @buckets if it is not NULL. In the latter case, the
+ * refcounts of the refblocks are checked by calculate_window_refcounts().
  */
 static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                            BdrvCheckMode fix, bool *rebuild,
+                           RefcountBuckets *buckets,
                            void **refcount_table, int64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i, size;
     int ret;
 
+    /* Only the check of a whole image can repair it */
+    assert(!buckets || !fix);
+
     for(i = 0; i < s->refcount_table_size; i++) {
         uint64_t offset, cluster;
         offset = s->refcount_table[i];
@@ -1744,7 +2370,7 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                ret = inc_refcounts(bs, res, NULL, refcount_table, nb_clusters,
                                     offset, s->cluster_size);
                 if (ret < 0) {
                     return ret;
@@ -1766,17 +2392,15 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+            ret = inc_refcounts(bs, res, buckets, refcount_table, nb_clusters,
                                 offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
-            if (s->get_refcount(*refcount_table, cluster) != 1) {
-                fprintf(stderr, "ERROR refcount block %" PRId64
-                        " refcount=%" PRIu64 "\n", i,
-                        s->get_refcount(*refcount_table, cluster));
-                res->corruptions++;
-                *rebuild = true;
+            if (!buckets) {
+                check_refblock_refcount(res, rebuild, i,
+                                        s->get_refcount(*refcount_table,
+                                                        cluster));
             }
         }
     }
@@ -1785,10 +2409,12 @@ resize_fail:
 }
 
 /*
- * Calculates an in-memory refcount table.
+ * Calculates an in-memory refcount table, or collects the references into
+ * @buckets if it is not NULL.
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
+                               RefcountBuckets *buckets,
                                void **refcount_table, int64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1796,7 +2422,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     QCowSnapshot *sn;
     int ret;
 
-    if (!*refcount_table) {
+    if (!buckets && !*refcount_table) {
         int64_t old_size = 0;
         ret = realloc_refcount_array(s, refcount_table,
                                      &old_size, *nb_clusters);
@@ -1807,14 +2433,14 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+    ret = inc_refcounts(bs, res, buckets, refcount_table, nb_clusters,
                         0, s->cluster_size);
     if (ret < 0) {
         return ret;
     }
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+    ret = check_refcounts_l1(bs, res, buckets, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
     if (ret < 0) {
         return ret;
@@ -1823,36 +2449,93 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for (i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                                 sn->l1_table_offset, sn->l1_size, 0);
+        ret = check_refcounts_l1(bs, res, buckets, refcount_table,
+                                 nb_clusters, sn->l1_table_offset,
+                                 sn->l1_size, 0);
         if (ret < 0) {
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+    ret = inc_refcounts(bs, res, buckets, refcount_table, nb_clusters,
                         s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+    ret = inc_refcounts(bs, res, buckets, refcount_table, nb_clusters,
                         s->refcount_table_offset,
                         s->refcount_table_size * sizeof(uint64_t));
     if (ret < 0) {
         return ret;
     }
 
-    return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
+    return check_refblocks(bs, res, fix, rebuild, buckets, refcount_table,
+                           nb_clusters);
+}
+
+/*
+ * Calculates the in-memory refcount table of the window that starts at
+ * cluster start from the references in its bucket, and checks the refcounts
+ * of the refblocks in that window. *nb_clusters is the size of the window;
+ * image_clusters is the number of clusters in the image.
+ */
+static int calculate_window_refcounts(BlockDriverState *bs,
+                                      BdrvCheckResult *res, bool *rebuild,
+                                      GArray *runs, int64_t start,
+                                      int64_t image_clusters,
+                                      void **refcount_table,
+                                      int64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t old_size = 0, i;
+    int ret;
+
+    ret = realloc_refcount_array(s, refcount_table, &old_size, *nb_clusters);
+    if (ret < 0) {
+        res->check_errors++;
+        return ret;
+    }
+
+    for (i = 0; i < runs->len; i++) {
+        RefcountRun *run = &g_array_index(runs, RefcountRun, i);
+
+        ret = inc_refcount_range(s, res, refcount_table, nb_clusters, start,
+                                 start + run->start,
+                                 start + run->start + run->count - 1);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* check_refblocks() has already reported the other refblocks */
+    for (i = 0; i < s->refcount_table_size; i++) {
+        uint64_t offset = s->refcount_table[i];
+        int64_t cluster = offset >> s->cluster_bits;
+
+        if (offset == 0 || offset_into_cluster(s, offset) ||
+            cluster >= image_clusters ||
+            cluster < start || cluster >= start + *nb_clusters)
+        {
+            continue;
+        }
+        check_refblock_refcount(res, rebuild, i,
+                                s->get_refcount(*refcount_table,
+                                                cluster - start));
+    }
+
+    return 0;
 }
 
 /*
  * Compares the actual reference count for each cluster in the image against the
- * refcount as reported by the refcount structures on-disk.
+ * refcount as reported by the refcount structures on-disk. Entry 0 of
+ * refcount_table is cluster start; *highest_cluster is only reset if start is
+ * 0, so that it is kept across the windows of an image.
  */
 static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix, bool *rebuild,
-                              int64_t *highest_cluster,
+                              int64_t *highest_cluster, int64_t start,
                               void *refcount_table, int64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1860,7 +2543,11 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     uint64_t refcount1, refcount2;
     int ret;
 
-    for (i = 0, *highest_cluster = 0; i < nb_clusters; i++) {
+    if (start == 0) {
+        *highest_cluster = 0;
+    }
+
+    for (i = start; i < start + nb_clusters; i++) {
         ret = qcow2_get_refcount(bs, i, &refcount1);
         if (ret < 0) {
             fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
@@ -1869,7 +2556,7 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = s->get_refcount(refcount_table, i);
+        refcount2 = s->get_refcount(refcount_table, i - start);
 
         if (refcount1 > 0 || refcount2 > 0) {
             *highest_cluster = i;
@@ -2171,6 +2858,8 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_drop_free_cluster_map(bs);
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_REFCOUNT_BLOCK);
 
     return 0;
 
@@ -2179,6 +2868,79 @@ fail:
     return ret;
 }
 
+/*
+ * Checks the refcounts of an image without repairing it, one window of
+ * clusters at a time, so that the in-memory refcount table does not grow
+ * beyond QCOW2_CHECK_WINDOW_SIZE for images with valid metadata.
+ *
+ * The metadata is walked once to collect the references into the bucket of
+ * each window, so every error in it is found and reported only once.
+ */
+static int check_refcounts_windowed(BlockDriverState *bs, BdrvCheckResult *res,
+                                    int64_t nb_clusters,
+                                    int64_t window_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    RefcountBuckets buckets = {
+        .window_clusters    = window_clusters,
+        .nb_windows         = DIV_ROUND_UP(nb_clusters, window_clusters),
+    };
+    int64_t highest_cluster = 0, start, size;
+    void *refcount_table = NULL;
+    bool rebuild = false;
+    int i, ret;
+
+    buckets.runs = g_new(GArray *, buckets.nb_windows);
+    for (i = 0; i < buckets.nb_windows; i++) {
+        buckets.runs[i] = g_array_new(false, false, sizeof(RefcountRun));
+    }
+
+    size = nb_clusters;
+    ret = calculate_refcounts(bs, res, 0, &rebuild, &buckets, &refcount_table,
+                              &size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < buckets.nb_windows; i++) {
+        start = i * window_clusters;
+        size = MIN(window_clusters, nb_clusters - start);
+
+        g_free(refcount_table);
+        refcount_table = NULL;
+        ret = calculate_window_refcounts(bs, res, &rebuild, buckets.runs[i],
+                                         start, nb_clusters, &refcount_table,
+                                         &size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        g_array_free(buckets.runs[i], true);
+        buckets.runs[i] = NULL;
+
+        compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, start,
+                          refcount_table, size);
+    }
+
+    ret = check_oflag_copied(bs, res, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    res->image_end_offset = (highest_cluster + 1) * s->cluster_size;
+    ret = 0;
+
+fail:
+    for (i = 0; i < buckets.nb_windows; i++) {
+        if (buckets.runs[i]) {
+            g_array_free(buckets.runs[i], true);
+        }
+    }
+    g_free(buckets.runs);
+    g_free(refcount_table);
+    return ret;
+}
+
 /*
  * Checks an image for refcount consistency.
  *
@@ -2190,7 +2952,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
-    int64_t size, highest_cluster, nb_clusters;
+    int64_t size, highest_cluster, nb_clusters, window_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
     int ret;
@@ -2210,7 +2972,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
-    ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
+    /* A refcount block takes a cluster, both on disk and in memory, so the
+     * table is split at refcount block boundaries. Repairing may need to
+     * rebuild the refcount structure from a table of the whole image. */
+    window_clusters = MAX(QCOW2_CHECK_WINDOW_SIZE >> s->cluster_bits, 1) *
+                      s->refcount_block_size;
+    if (!fix && nb_clusters > window_clusters) {
+        return check_refcounts_windowed(bs, res, nb_clusters, window_clusters);
+    }
+
+    ret = calculate_refcounts(bs, res, fix, &rebuild, NULL, &refcount_table,
                               &nb_clusters);
     if (ret < 0) {
         goto fail;
@@ -2220,8 +2991,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
      * something), this function is immediately called again, in which case the
      * result should be ignored */
     pre_compare_res = *res;
-    compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, refcount_table,
-                      nb_clusters);
+    compare_refcounts(bs, res, 0, &rebuild, &highest_cluster, 0,
+                      refcount_table, nb_clusters);
 
     if (rebuild && (fix & BDRV_FIX_ERRORS)) {
         BdrvCheckResult old_res = *res;
@@ -2241,7 +3012,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
          * references have to be recalculated */
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
-        ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
+        ret = calculate_refcounts(bs, res, 0, &rebuild, NULL, &refcount_table,
                                   &nb_clusters);
         if (ret < 0) {
             goto fail;
@@ -2255,7 +3026,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             *res = (BdrvCheckResult){ 0 };
 
             compare_refcounts(bs, res, BDRV_FIX_LEAKS, &rebuild,
-                              &highest_cluster, refcount_table, nb_clusters);
+                              &highest_cluster, 0, refcount_table,
+                              nb_clusters);
             if (rebuild) {
                 fprintf(stderr, "ERROR rebuilt refcount structure is still "
                         "broken\n");
@@ -2285,7 +3057,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
         if (res->leaks || res->corruptions) {
             *res = pre_compare_res;
-            compare_refcounts(bs, res, fix, &rebuild, &highest_cluster,
+            compare_refcounts(bs, res, fix, &rebuild, &highest_cluster, 0,
                               refcount_table, nb_clusters);
         }
     }
@@ -2308,6 +3080,248 @@ fail:
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
+/*
+ * L2 tables, refcount blocks and inactive L1 tables may be located anywhere in
+ * the image. The clusters they occupy are kept in one balanced tree per kind
+ * of metadata so that checking a write against them doesn't require walking
+ * the L1 table, the refcount table or all snapshot L1 tables.
+ *
+ * The same cluster may be referenced more than once (e.g. an L2 table shared
+ * by several snapshots), so each node counts its references.
+ */
+typedef struct Qcow2MetadataCluster {
+    uint64_t offset;
+    unsigned int refs;
+} Qcow2MetadataCluster;
+
+typedef struct Qcow2MetadataRange {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t cluster_size;
+} Qcow2MetadataRange;
+
+static GTree **metadata_clusters_tree(BDRVQcow2State *s, int ol)
+{
+    switch (ol) {
+    case QCOW2_OL_ACTIVE_L2:
+        return &s->ol_active_l2;
+    case QCOW2_OL_REFCOUNT_BLOCK:
+        return &s->ol_refcount_blocks;
+    case QCOW2_OL_INACTIVE_L1:
+        return &s->ol_inactive_l1;
+    case QCOW2_OL_INACTIVE_L2:
+        return &s->ol_inactive_l2;
+    default:
+        abort();
+    }
+}
+
+static gint metadata_cluster_cmp(gconstpointer a, gconstpointer b,
+                                 gpointer opaque)
+{
+    const Qcow2MetadataCluster *ma = a, *mb = b;
+
+    return (ma->offset > mb->offset) - (ma->offset < mb->offset);
+}
+
+/* Directs g_tree_search() towards a cluster overlapping the given range */
+static gint metadata_cluster_search(gconstpointer key, gconstpointer opaque)
+{
+    const Qcow2MetadataCluster *m = key;
+    const Qcow2MetadataRange *r = opaque;
+
+    if (m->offset >= r->offset + r->size) {
+        return -1;
+    } else if (m->offset + r->cluster_size <= r->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static void add_metadata_cluster(GTree *tree, uint64_t offset)
+{
+    Qcow2MetadataCluster key = { .offset = offset };
+    Qcow2MetadataCluster *m;
+
+    if (!offset) {
+        return;
+    }
+
+    m = g_tree_lookup(tree, &key);
+    if (!m) {
+        m = g_new(Qcow2MetadataCluster, 1);
+        *m = key;
+        g_tree_insert(tree, m, m);
+    }
+    m->refs++;
+}
+
+/*
+ * Records that the cluster at @offset is used for the kind of metadata given
+ * by the QCow2MetadataOverlap value @ol. Nothing needs to be done if the
+ * respective tree has not been built yet.
+ */
+void qcow2_add_metadata_cluster(BlockDriverState *bs, int ol, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GTree *tree = *metadata_clusters_tree(s, ol);
+
+    if (tree) {
+        add_metadata_cluster(tree, offset);
+    }
+}
+
+/*
+ * Drops one reference to the cluster at @offset from the tree of the kind of
+ * metadata given by @ol.
+ */
+void qcow2_remove_metadata_cluster(BlockDriverState *bs, int ol,
+                                   uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GTree *tree = *metadata_clusters_tree(s, ol);
+    Qcow2MetadataCluster key = { .offset = offset };
+    Qcow2MetadataCluster *m;
+
+    if (!tree || !offset) {
+        return;
+    }
+
+    m = g_tree_lookup(tree, &key);
+    if (m && --m->refs == 0) {
+        g_tree_remove(tree, m);
+    }
+}
+
+/*
+ * Frees the trees for all kinds of metadata in the QCow2MetadataOverlap
+ * bitmask @ol. This must be called whenever the corresponding tables are
+ * replaced or changed as a whole; the trees are rebuilt when needed next.
+ */
+void qcow2_drop_metadata_clusters(BlockDriverState *bs, int ol)
+{
+    BDRVQcow2State *s = bs->opaque;
+    static const int ol_trees[] = {
+        QCOW2_OL_ACTIVE_L2, QCOW2_OL_REFCOUNT_BLOCK,
+        QCOW2_OL_INACTIVE_L1, QCOW2_OL_INACTIVE_L2,
+    };
+    GTree **tree;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ol_trees); i++) {
+        tree = metadata_clusters_tree(s, ol_trees[i]);
+        if ((ol & ol_trees[i]) && *tree) {
+            g_tree_destroy(*tree);
+            *tree = NULL;
+        }
+    }
+}
+
+static int build_metadata_clusters(BlockDriverState *bs, int ol)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GTree *tree;
+    uint64_t *l1;
+    uint64_t l1_sz2;
+    int i, j, ret;
+
+    tree = g_tree_new_full(metadata_cluster_cmp, NULL, g_free, NULL);
+
+    switch (ol) {
+    case QCOW2_OL_ACTIVE_L2:
+        for (i = 0; i < s->l1_size; i++) {
+            add_metadata_cluster(tree, s->l1_table[i] & L1E_OFFSET_MASK);
+        }
+        break;
+
+    case QCOW2_OL_REFCOUNT_BLOCK:
+        for (i = 0; i < s->refcount_table_size; i++) {
+            add_metadata_cluster(tree,
+                                 s->refcount_table[i] & REFT_OFFSET_MASK);
+        }
+        break;
+
+    case QCOW2_OL_INACTIVE_L1:
+        for (i = 0; i < s->nb_snapshots; i++) {
+            l1_sz2 = s->snapshots[i].l1_size * sizeof(uint64_t);
+            for (j = 0; j < size_to_clusters(s, l1_sz2); j++) {
+                add_metadata_cluster(tree, s->snapshots[i].l1_table_offset +
+                                           j * s->cluster_size);
+            }
+        }
+        break;
+
+    case QCOW2_OL_INACTIVE_L2:
+        for (i = 0; i < s->nb_snapshots; i++) {
+            l1_sz2 = s->snapshots[i].l1_size * sizeof(uint64_t);
+            l1 = g_try_malloc(l1_sz2);
+
+            if (l1_sz2 && l1 == NULL) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+
+            ret = bdrv_pread(bs->file, s->snapshots[i].l1_table_offset, l1,
+                             l1_sz2);
+            if (ret < 0) {
+                g_free(l1);
+                goto fail;
+            }
+
+            for (j = 0; j < s->snapshots[i].l1_size; j++) {
+                add_metadata_cluster(tree,
+                                     be64_to_cpu(l1[j]) & L1E_OFFSET_MASK);
+            }
+
+            g_free(l1);
+        }
+        break;
+
+    default:
+        abort();
+    }
+
+    /* Someone else may have built the tree while we were reading */
+    if (*metadata_clusters_tree(s, ol)) {
+        g_tree_destroy(tree);
+    } else {
+        *metadata_clusters_tree(s, ol) = tree;
+    }
+    return 0;
+
+fail:
+    g_tree_destroy(tree);
+    return ret;
+}
+
+/*
+ * Returns @ol if any cluster of the kind of metadata given by @ol overlaps
+ * with the given range, 0 if none does and -errno on error.
+ */
+static int check_metadata_clusters_overlap(BlockDriverState *bs, int ol,
+                                           int64_t offset, int64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2MetadataRange range = {
+        .offset         = offset,
+        .size           = size,
+        .cluster_size   = s->cluster_size,
+    };
+    GTree *tree;
+    int ret;
+
+    tree = *metadata_clusters_tree(s, ol);
+    if (!tree) {
+        ret = build_metadata_clusters(bs, ol);
+        if (ret < 0) {
+            return ret;
+        }
+        tree = *metadata_clusters_tree(s, ol);
+    }
+
+    return g_tree_search(tree, metadata_cluster_search, &range) ? ol : 0;
+}
+
 /*
  * Checks if the given offset into the image file is actually free to use by
  * looking for overlaps with important metadata sections (L1/L2 tables etc.),
@@ -2327,7 +3341,7 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int chk = s->overlap_check & ~ign;
-    int i, j;
+    int ret;
 
     if (!size) {
         return 0;
@@ -2363,62 +3377,34 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
     }
 
     if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            if (s->snapshots[i].l1_size &&
-                overlaps_with(s->snapshots[i].l1_table_offset,
-                s->snapshots[i].l1_size * sizeof(uint64_t))) {
-                return QCOW2_OL_INACTIVE_L1;
-            }
+        ret = check_metadata_clusters_overlap(bs, QCOW2_OL_INACTIVE_L1,
+                                              offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
     if ((chk & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
-        for (i = 0; i < s->l1_size; i++) {
-            if ((s->l1_table[i] & L1E_OFFSET_MASK) &&
-                overlaps_with(s->l1_table[i] & L1E_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_ACTIVE_L2;
-            }
+        ret = check_metadata_clusters_overlap(bs, QCOW2_OL_ACTIVE_L2,
+                                              offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
     if ((chk & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
-        for (i = 0; i < s->refcount_table_size; i++) {
-            if ((s->refcount_table[i] & REFT_OFFSET_MASK) &&
-                overlaps_with(s->refcount_table[i] & REFT_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_REFCOUNT_BLOCK;
-            }
+        ret = check_metadata_clusters_overlap(bs, QCOW2_OL_REFCOUNT_BLOCK,
+                                              offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
     if ((chk & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
-            uint32_t l1_sz  = s->snapshots[i].l1_size;
-            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
-            uint64_t *l1 = g_try_malloc(l1_sz2);
-            int ret;
-
-            if (l1_sz2 && l1 == NULL) {
-                return -ENOMEM;
-            }
-
-            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
-            if (ret < 0) {
-                g_free(l1);
-                return ret;
-            }
-
-            for (j = 0; j < l1_sz; j++) {
-                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
-                if (l2_ofs && overlaps_with(l2_ofs, s->cluster_size)) {
-                    g_free(l1);
-                    return QCOW2_OL_INACTIVE_L2;
-                }
-            }
-
-            g_free(l1);
+        ret = check_metadata_clusters_overlap(bs, QCOW2_OL_INACTIVE_L2,
+                                              offset, size);
+        if (ret) {
+            return ret;
         }
     }
 
@@ -2871,6 +3857,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     /* Now update the rest of the in-memory information */
     old_reftable = s->refcount_table;
     s->refcount_table = new_reftable;
+    qcow2_drop_free_cluster_map(bs);
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_REFCOUNT_BLOCK);
 
     s->refcount_bits = 1 << refcount_order;
     s->refcount_max = UINT64_C(1) << (s->refcount_bits - 1);
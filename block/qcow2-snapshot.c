@@ -42,6 +42,8 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_INACTIVE_L1 |
+                                     QCOW2_OL_INACTIVE_L2);
 }
 
 int qcow2_read_snapshots(BlockDriverState *bs)
@@ -353,6 +355,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -EFBIG;
     }
 
+    /* Guest data in an external data file is always overwritten in place, so
+     * it can't be shared with a snapshot */
+    if (has_data_file(s)) {
+        return -ENOTSUP;
+    }
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
@@ -427,12 +435,16 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     }
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_INACTIVE_L1 |
+                                     QCOW2_OL_INACTIVE_L2);
 
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
         s->nb_snapshots--;
+        qcow2_drop_metadata_clusters(bs, QCOW2_OL_INACTIVE_L1 |
+                                         QCOW2_OL_INACTIVE_L2);
         goto fail;
     }
 
@@ -556,6 +568,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_ACTIVE_L2);
 
     if (ret < 0) {
         goto fail;
@@ -608,6 +621,8 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_INACTIVE_L1 |
+                                     QCOW2_OL_INACTIVE_L2);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
@@ -734,6 +749,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_drop_metadata_clusters(bs, QCOW2_OL_ACTIVE_L2);
 
     return 0;
 }
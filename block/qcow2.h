@@ -27,6 +27,7 @@
 
 #include "crypto/cipher.h"
 #include "qemu/coroutine.h"
+#include "qemu/hbitmap.h"
 
 //#define DEBUG_ALLOC
 //#define DEBUG_ALLOC2
@@ -59,11 +60,22 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Number of subclusters per cluster with extended L2 entries */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+
+/* Subcluster allocation bitmap of extended L2 entries: the low 32 bits say
+ * which subclusters are allocated, the high 32 bits which ones read as zero */
+#define QCOW_L2_BITMAP_ALL_ALLOC  0x00000000ffffffffULL
+#define QCOW_L2_BITMAP_ALL_ZEROES 0xffffffff00000000ULL
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Subclusters must not be smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* cache entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -78,6 +90,14 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Memory used for decompressed clusters, but no more than this many clusters */
+#define DEFAULT_DECOMPRESS_CACHE_BYTE_SIZE 1048576 /* bytes */
+#define MAX_DECOMPRESS_CACHE_SIZE 16 /* clusters */
+
+/* Compression and decompression jobs that may run in the thread pool at the
+ * same time */
+#define QCOW2_MAX_THREADS 4
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -95,6 +115,7 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
 
@@ -163,6 +184,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+struct Qcow2DecompressCache;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -178,13 +202,22 @@ enum {
 
 /* Incompatible feature bits */
 enum {
-    QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
-    QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
-    QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
-    QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
-
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+    QCOW2_INCOMPAT_DIRTY_BITNR       = 0,
+    QCOW2_INCOMPAT_CORRUPT_BITNR     = 1,
+    QCOW2_INCOMPAT_DATA_FILE_BITNR   = 2,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR       = 4,
+    QCOW2_INCOMPAT_DIRTY             = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_CORRUPT           = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_DATA_FILE         = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION       = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2             = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+
+    QCOW2_INCOMPAT_MASK              = QCOW2_INCOMPAT_DIRTY
+                                     | QCOW2_INCOMPAT_CORRUPT
+                                     | QCOW2_INCOMPAT_DATA_FILE
+                                     | QCOW2_INCOMPAT_COMPRESSION
+                                     | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -228,6 +261,10 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* entries per L2 cache entry, at most l2_size */
+    int subcluster_bits;
+    int subcluster_size;
+    int subclusters_per_cluster; /* 1 without extended L2 entries */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -243,10 +280,13 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2DecompressCache *decompress_cache;
+    Qcow2CompressionType compression_type;
+    int nb_compress_threads;
+    CoQueue compress_wait_queue;
+
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
+    QLIST_HEAD(QCowL2TableAlloc, QCowL2Alloc) l2_allocs;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -254,6 +294,11 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* One bit per host cluster, set if its refcount is 0. Built on the first
+     * cluster allocation; clusters beyond free_cluster_map_size are free. */
+    HBitmap *free_cluster_map;
+    uint64_t free_cluster_map_size;
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
@@ -276,6 +321,13 @@ typedef struct BDRVQcow2State {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
+    /* Clusters occupied by metadata that may be spread all over the image,
+     * sorted by offset; each tree is built when an overlap check first needs
+     * it (see qcow2_check_metadata_overlap) */
+    GTree *ol_active_l2;
+    GTree *ol_refcount_blocks;
+    GTree *ol_inactive_l1;
+    GTree *ol_inactive_l2;
     bool signaled_corruption;
 
     uint64_t incompatible_features;
@@ -293,6 +345,12 @@ typedef struct BDRVQcow2State {
      * override) */
     char *image_backing_file;
     char *image_backing_format;
+
+    /* Name of the external data file as stored in the image, and the child
+     * that guest data is read from and written to. Without an external data
+     * file, data_file is the same as bs->file. */
+    char *image_data_file;
+    BdrvChild *data_file;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -339,12 +397,35 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * The clusters are already allocated and referenced by the L2 table, but
+     * some of their subclusters are not. Only the allocation bitmap needs to
+     * be updated and no old cluster is freed.
+     */
+    bool keep_old_clusters;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
+/**
+ * Describes an empty L2 table that is being written while s->lock is
+ * dropped. Requests that need the same L2 table wait until it has been
+ * hooked up in the L1 table.
+ */
+typedef struct QCowL2Alloc
+{
+    /** Index of the L1 entry that will point to the new L2 table */
+    int l1_index;
+
+    /** Requests waiting for the L2 table to be hooked up */
+    CoQueue dependent_requests;
+
+    QLIST_ENTRY(QCowL2Alloc) next_in_flight;
+} QCowL2Alloc;
+
 enum {
     QCOW2_CLUSTER_UNALLOCATED,
     QCOW2_CLUSTER_NORMAL,
@@ -397,6 +478,10 @@ typedef enum QCow2MetadataOverlap {
 
 #define REFT_OFFSET_MASK 0xfffffffffffffe00ULL
 
+/* Marks a host offset as not yet determined. 0 can't be used for this because
+ * it is a valid data offset in an external data file. */
+#define INV_OFFSET (-1ULL)
+
 static inline int64_t start_of_cluster(BDRVQcow2State *s, int64_t offset)
 {
     return offset & ~(s->cluster_size - 1);
@@ -423,6 +508,84 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline bool has_data_file(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int64_t start_of_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & ~(s->subcluster_size - 1);
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+/* Returns the allocation bits of the subclusters that intersect with the byte
+ * range [start, end) of a cluster */
+static inline uint64_t qcow2_subcluster_mask(BDRVQcow2State *s,
+                                             int start, int end)
+{
+    int first_sc = start >> s->subcluster_bits;
+    int nb_sc = DIV_ROUND_UP(end, s->subcluster_size) - first_sc;
+
+    assert(0 <= start && start < end && end <= s->cluster_size);
+    if (nb_sc == QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER) {
+        return QCOW_L2_BITMAP_ALL_ALLOC;
+    }
+    return ((1ULL << nb_sc) - 1) << first_sc;
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -439,19 +602,57 @@ static inline uint64_t qcow2_max_refcount_clusters(BDRVQcow2State *s)
     return QCOW_MAX_REFTABLE_SIZE >> s->cluster_bits;
 }
 
-static inline int qcow2_get_cluster_type(uint64_t l2_entry)
+/*
+ * Offset 0 usually means that a cluster is unallocated, but it is a valid
+ * offset in an external data file. Clusters in external data files always
+ * have QCOW_OFLAG_COPIED set, which tells the two cases apart.
+ */
+static inline bool qcow2_data_offset_valid(BDRVQcow2State *s,
+                                           uint64_t l2_entry)
+{
+    return (l2_entry & L2E_OFFSET_MASK) ||
+           (has_data_file(s) && (l2_entry & QCOW_OFLAG_COPIED));
+}
+
+static inline int qcow2_get_cluster_type(BDRVQcow2State *s, uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
         return QCOW2_CLUSTER_COMPRESSED;
     } else if (l2_entry & QCOW_OFLAG_ZERO) {
         return QCOW2_CLUSTER_ZERO;
-    } else if (!(l2_entry & L2E_OFFSET_MASK)) {
+    } else if (!qcow2_data_offset_valid(s, l2_entry)) {
         return QCOW2_CLUSTER_UNALLOCATED;
     } else {
         return QCOW2_CLUSTER_NORMAL;
     }
 }
 
+/*
+ * Returns the type of subcluster @sc_index of a cluster with extended L2
+ * entries, or -EIO if the combination of entry and bitmap is invalid.
+ */
+static inline int qcow2_get_subcluster_type(BDRVQcow2State *s,
+                                            uint64_t l2_entry,
+                                            uint64_t l2_bitmap,
+                                            unsigned sc_index)
+{
+    uint64_t alloc_bit = 1ULL << sc_index;
+    uint64_t zero_bit = alloc_bit << 32;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return l2_bitmap ? -EIO : QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_entry & QCOW_OFLAG_ZERO) {
+        return -EIO;
+    } else if (l2_bitmap & zero_bit) {
+        return (l2_bitmap & alloc_bit) ? -EIO : QCOW2_CLUSTER_ZERO;
+    } else if (l2_bitmap & alloc_bit) {
+        return qcow2_data_offset_valid(s, l2_entry) ? QCOW2_CLUSTER_NORMAL
+                                                    : -EIO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -489,6 +690,7 @@ void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_drop_free_cluster_map(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -515,6 +717,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
 
+void qcow2_add_metadata_cluster(BlockDriverState *bs, int ol, uint64_t offset);
+void qcow2_remove_metadata_cluster(BlockDriverState *bs, int ol,
+                                   uint64_t offset);
+void qcow2_drop_metadata_clusters(BlockDriverState *bs, int ol);
 int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
                                  int64_t size);
 int qcow2_pre_write_overlap_check(BlockDriverState *bs, int ign, int64_t offset,
@@ -528,7 +734,6 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
@@ -568,8 +773,22 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-compress.c functions */
+bool qcow2_compression_type_supported(Qcow2CompressionType type);
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+int coroutine_fn qcow2_co_preadv_compressed(BlockDriverState *bs,
+                                            uint64_t cluster_descriptor,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov);
+Qcow2DecompressCache *qcow2_decompress_cache_create(int num_clusters);
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c);
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -587,6 +806,10 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_prefetched(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, const void *data, void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                         uint64_t size);
 
 #endif
@@ -77,6 +77,8 @@ int64_t max_advance;
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* true if each vcpu uses its own CPUState::throttle_percentage */
+static bool throttle_per_vcpu;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -560,17 +562,26 @@ static const VMStateDescription vmstate_timers = {
 
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
+    double pct, pct_max;
     double throttle_ratio;
     long sleeptime_ns;
 
     if (!cpu_throttle_get_percentage()) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
+    /* The timer fires every CPU_THROTTLE_TIMESLICE_NS / (1 - pct_max);
+     * sleep for the fraction of that period this vcpu is throttled by.
+     */
+    pct_max = (double)cpu_throttle_get_percentage() / 100;
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    throttle_ratio = pct / (1 - pct_max);
     sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    if (!sleeptime_ns) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
+        return;
+    }
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -605,15 +616,57 @@ void cpu_throttle_set(int new_throttle_pct)
     new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
     new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
 
+    atomic_set(&throttle_per_vcpu, false);
     atomic_set(&throttle_percentage, new_throttle_pct);
 
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    CPUState *other;
+    int max_pct = 0;
+    bool was_active = cpu_throttle_active();
+
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, 0);
+
+    if (!atomic_read(&throttle_per_vcpu)) {
+        /* Start from the uniform percentage that was in effect */
+        CPU_FOREACH(other) {
+            atomic_set(&other->throttle_percentage, throttle_percentage);
+        }
+        atomic_set(&throttle_per_vcpu, true);
+    }
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    CPU_FOREACH(other) {
+        max_pct = MAX(max_pct, atomic_read(&other->throttle_percentage));
+    }
+    atomic_set(&throttle_percentage, max_pct);
+
+    if (max_pct && !was_active) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    if (!cpu_throttle_active()) {
+        return 0;
+    }
+    if (atomic_read(&throttle_per_vcpu)) {
+        return atomic_read(&cpu->throttle_percentage);
+    }
+    return cpu_throttle_get_percentage();
+}
+
 void cpu_throttle_stop(void)
 {
     atomic_set(&throttle_percentage, 0);
+    atomic_set(&throttle_per_vcpu, false);
 }
 
 bool cpu_throttle_active(void)
@@ -57,6 +57,7 @@
 #include "exec/log.h"
 
 #include "migration/vmstate.h"
+#include "migration/dirtyrate.h"
 
 #include "qemu/range.h"
 #ifndef _WIN32
@@ -1472,6 +1473,11 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -2072,6 +2078,15 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
         tb_unlock();
     }
 
+    /* Attribute the page to this vCPU if it is the first write since the
+     * migration bitmap was last synced.
+     */
+    if (dirty_rate_measuring() &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
+
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
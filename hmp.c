@@ -151,6 +151,17 @@ void hmp_info_mice(Monitor *mon, const QDict *qdict)
     qapi_free_MouseInfoList(mice_list);
 }
 
+static void hmp_info_migrate_section_times(Monitor *mon, const char *title,
+                                           MigrationSectionTimeList *list)
+{
+    monitor_printf(mon, "%s", title);
+    for (; list; list = list->next) {
+        monitor_printf(mon, " %s/%" PRId64 ": %" PRId64, list->value->name,
+                       list->value->instance_id, list->value->time);
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
@@ -254,6 +265,71 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_throttle) {
+        VcpuThrottleInfoList *vt;
+
+        monitor_printf(mon, "vcpu throttle percentage:");
+        for (vt = info->vcpu_throttle; vt; vt = vt->next) {
+            monitor_printf(mon, " %" PRId64 ": %" PRId64,
+                           vt->value->id, vt->value->percentage);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    if (info->has_postcopy_fault_latency) {
+        PostcopyFaultLatency *pl = info->postcopy_fault_latency;
+        intList *bucket;
+
+        monitor_printf(mon, "postcopy faults: %" PRId64 "\n", pl->faults);
+        monitor_printf(mon, "postcopy fault latency: average %" PRId64
+                       " us, max %" PRId64 " us\n", pl->average, pl->max);
+        monitor_printf(mon, "postcopy fault latency histogram (log2 us):");
+        for (bucket = pl->histogram; bucket; bucket = bucket->next) {
+            monitor_printf(mon, " %" PRId64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    if (info->has_ram_passes) {
+        MigrationPassStatsList *pl = info->ram_passes;
+        MigrationPassStats *ps;
+
+        while (pl->next) {
+            pl = pl->next;
+        }
+        ps = pl->value;
+        monitor_printf(mon, "last pass: %" PRId64 " (%" PRId64 " ms):"
+                       " sync %" PRId64 " us, scanned %" PRId64
+                       " pages, zero %" PRId64 " pages, compress %" PRId64
+                       " us, %" PRId64 " bytes, blocked %" PRId64 " us\n",
+                       ps->pass, ps->duration, ps->sync_time,
+                       ps->pages_scanned, ps->zero_pages, ps->compress_time,
+                       ps->bytes, ps->blocked_time);
+    }
+
+    if (info->has_downtime_save) {
+        hmp_info_migrate_section_times(mon, "downtime save (us):",
+                                       info->downtime_save);
+    }
+    if (info->has_downtime_load) {
+        hmp_info_migrate_section_times(mon, "downtime load (us):",
+                                       info->downtime_load);
+    }
+
+    if (info->has_colo_checkpoint) {
+        COLOCheckpointStats *cs = info->colo_checkpoint;
+
+        monitor_printf(mon, "colo checkpoints: %" PRId64 "\n",
+                       cs->checkpoints);
+        monitor_printf(mon, "colo checkpoint pause: last %" PRId64
+                       " us, average %" PRId64 " us, max %" PRId64 " us\n",
+                       cs->last_pause, cs->average_pause, cs->max_pause);
+        monitor_printf(mon, "colo checkpoint size: %" PRId64 " bytes\n",
+                       cs->last_size);
+        monitor_printf(mon, "colo presend: %" PRId64 " bytes\n",
+                       cs->presend_bytes);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -323,6 +399,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_dirty_rate_target);
+        monitor_printf(mon, " %s: %" PRId64 " MiB/s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DIRTY_RATE_TARGET],
+            params->dirty_rate_target);
+        assert(params->has_cpu_throttle_max);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_MAX],
+            params->cpu_throttle_max);
+        assert(params->has_device_state_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DEVICE_STATE_THREADS],
+            params->device_state_threads);
         monitor_printf(mon, "\n");
     }
 
@@ -1395,6 +1483,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_DIRTY_RATE_TARGET:
+                p.has_dirty_rate_target = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_MAX:
+                p.has_cpu_throttle_max = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+                p.has_device_state_threads = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1412,6 +1512,9 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.dirty_rate_target = valueint;
+                p.cpu_throttle_max = valueint;
+                p.device_state_threads = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
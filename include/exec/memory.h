@@ -1242,6 +1242,9 @@ void memory_listener_unregister(MemoryListener *listener);
 
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * Calls nest: logging stays enabled until every caller has called
+ * memory_global_dirty_log_stop().
  */
 void memory_global_dirty_log_start(void);
 
@@ -39,6 +39,10 @@ struct RAMBlock {
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
     int fd;
     size_t page_size;
+    /* fixed-ram migration: pages present in the file and where they are */
+    unsigned long *file_bmap;
+    int64_t bitmap_offset;
+    int64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -24,6 +24,7 @@ void colo_info_init(void);
 
 void migrate_start_colo_process(MigrationState *s);
 bool migration_in_colo_state(void);
+COLOCheckpointStats *colo_checkpoint_stats(void);
 
 /* loadvm */
 bool migration_incoming_enable_colo(void);
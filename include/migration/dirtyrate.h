@@ -0,0 +1,23 @@
+/*
+ * Guest dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/* Bounds for the sampling period of calc-dirty-rate, in seconds */
+#define DIRTY_RATE_MIN_CALC_TIME 1
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+/**
+ * dirty_rate_measuring: Check whether a dirty page rate sample is being
+ * taken.  While it is, the DIRTY_MEMORY_MIGRATION bitmap belongs to the
+ * measurement and a migration must not be started.
+ */
+bool dirty_rate_measuring(void);
+
+#endif
@@ -119,11 +119,13 @@ struct MigrationIncomingState {
 
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
+    GHashTable *device_delta;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
 MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
 void migration_incoming_state_destroy(void);
+void migration_incoming_lazy_restore_end(int ret);
 
 /*
  * An outstanding page request, on the source, having been received
@@ -188,6 +190,12 @@ struct MigrationState
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+    /*
+     * Posted on a page request to cut short the rate limit wait, but only
+     * if rate_limit_waiting says the migration thread is in that wait
+     */
+    QemuSemaphore rate_limit_sem;
+    bool rate_limit_waiting;
 
     /* The last error that occurred */
     Error *error;
@@ -233,6 +241,11 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -262,6 +275,7 @@ void migrate_decompress_threads_join(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+MigrationPassStatsList *ram_pass_stats(void);
 void free_xbzrle_decoded_buf(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
@@ -286,6 +300,18 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+/* For lazy restore from a file: results of ram_lazy_restore_get_page */
+enum {
+    LAZY_PAGE_CLAIMED,  /* Another thread is already placing the page */
+    LAZY_PAGE_ZERO,     /* Page is all zero and must be placed as such */
+    LAZY_PAGE_DATA,     /* Page contents were read into the buffer */
+};
+void ram_lazy_restore_set_source(int fd);
+int ram_lazy_restore_get_page(RAMBlock *rb, ram_addr_t offset, void *buf,
+                              bool fault);
+void ram_lazy_restore_cleanup(void);
+/* For fixed-ram migration to and from a file */
+void fixed_ram_set_page_fd(int fd);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -317,6 +343,7 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 bool migrate_colo_enabled(void);
+bool migrate_colo_incremental(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
@@ -324,7 +351,13 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+int migrate_device_state_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_batch_pages(void);
+bool migrate_background_snapshot(void);
+bool migrate_lazy_restore(void);
+bool migrate_use_fixed_ram(void);
+bool migrate_parallel_device_state(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
@@ -364,6 +397,7 @@ int global_state_store(void);
 void global_state_store_running(void);
 
 void flush_page_queue(MigrationState *ms);
+bool ram_save_queue_pending(MigrationState *ms);
 int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len);
 
@@ -41,6 +41,32 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
                                size_t length);
 
+/*
+ * Write tracking for background snapshots: write protect all of RAM and
+ * queue every page the guest tries to write as an urgent page request
+ * (see ram_save_queue_pages) until it is unprotected.
+ */
+bool ram_write_tracking_available(void);
+int ram_write_tracking_start(void);
+int ram_write_tracking_unprotect(void *host, size_t length);
+void ram_write_tracking_stop(void);
+
+/*
+ * Lazy restore from a file: register all of RAM for userfaults and serve
+ * them from the file (see ram_lazy_restore_get_page); once the VM has
+ * been loaded, start_fill places the remaining pages in the background.
+ * get_error returns the first error reading the file, or 0.
+ */
+int ram_lazy_restore_enable_notify(void);
+void ram_lazy_restore_start_fill(void);
+int ram_lazy_restore_get_error(void);
+
+/*
+ * Latency of the page faults resolved on the destination since postcopy
+ * was entered, or NULL if there have not been any.
+ */
+PostcopyFaultLatency *postcopy_fault_latency_get(void);
+
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
  * however leaving it until after precopy means that most of the precopy
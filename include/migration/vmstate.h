@@ -31,6 +31,7 @@
 #include "migration/qemu-file.h"
 #endif
 #include "migration/qjson.h"
+#include "qemu/thread.h"
 
 typedef void SaveStateHandler(QEMUFile *f, void *opaque);
 typedef int LoadStateHandler(QEMUFile *f, void *opaque, int version_id);
@@ -56,6 +57,11 @@ typedef struct SaveVMHandlers {
 
     /* This runs outside the iothread lock!  */
     int (*save_live_setup)(QEMUFile *f, void *opaque);
+    /* Completes a background snapshot while the guest runs; handlers
+     * without it are completed with save_live_complete_precopy inside the
+     * iothread lock instead.
+     */
+    int (*save_live_complete_background)(QEMUFile *f, void *opaque);
     void (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size,
                               uint64_t *non_postcopiable_pending,
                               uint64_t *postcopiable_pending);
@@ -977,12 +983,26 @@ extern const VMStateInfo vmstate_info_qtailq;
 #define SELF_ANNOUNCE_ROUNDS 5
 
 void loadvm_free_handlers(MigrationIncomingState *mis);
+void loadvm_free_device_delta(MigrationIncomingState *mis);
 
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc);
 
+/*
+ * For saving or loading several sections in parallel: the _fields variants
+ * leave out the top-level pre_save, pre_load and post_load hooks, which the
+ * caller runs itself in stream order, and each thread involved passes the
+ * same lock to vmstate_set_hook_lock().
+ */
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id);
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc);
+void vmstate_set_hook_lock(QemuMutex *lock);
+
+bool vmstate_is_independent(const VMStateDescription *vmsd);
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
 
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
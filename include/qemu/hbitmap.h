@@ -145,6 +145,17 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @count: Number of bits to look at.
+ *
+ * Return the index of the first zero bit in [@start, @start + @count),
+ * or -1 if every bit in the range (clamped to the bitmap size) is set.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
+
 /**
  * hbitmap_is_serializable:
  * @hb: HBitmap which should be (de-)serialized.
@@ -298,6 +298,8 @@ struct qemu_work_item;
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
+ * @dirty_pages: Number of clean guest pages dirtied by this vCPU, counted
+ *               by TCG while the migration dirty bitmap is being sampled.
  *
  * State of one CPU core or thread.
  */
@@ -388,6 +390,11 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
+
+    /* Pages dirtied by this vCPU, for the dirty page rate measurement */
+    uint64_t dirty_pages;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -731,6 +738,28 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 0 to 99, where
+ * 0 leaves the vCPU unthrottled.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  The first call switches
+ * throttling to per-vCPU mode, starting every vCPU at the percentage that
+ * was in effect so far; cpu_throttle_set or cpu_throttle_stop switch back
+ * to uniform throttling.  cpu_throttle_get_percentage then returns the
+ * highest per-vCPU percentage.  Must be called with the iothread lock held.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage applied to @cpu, 0 if it is not throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
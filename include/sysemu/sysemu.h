@@ -97,6 +97,8 @@ enum qemu_vm_cmd {
                                       were previously sent during
                                       precopy but are dirty. */
     MIG_CMD_PACKAGED,          /* Send a wrapped stream within this stream */
+    MIG_CMD_DEVICE_STATES,     /* Device sections to load in parallel */
+    MIG_CMD_DEVICE_DELTA,      /* Device section, or reference to the last */
     MIG_CMD_MAX
 };
 
@@ -110,6 +112,14 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy);
 void qemu_savevm_state_cleanup(void);
 void qemu_savevm_state_complete_postcopy(QEMUFile *f);
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only);
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy);
+int qemu_savevm_state_complete_background(QEMUFile *f);
+void qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                     bool in_postcopy);
+void qemu_savevm_set_device_delta(bool enable);
+void qemu_savevm_downtime_reset(void);
+MigrationSectionTimeList *qemu_savevm_downtime_save(void);
+MigrationSectionTimeList *qemu_savevm_downtime_load(void);
 void qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size,
                                uint64_t *res_non_postcopiable,
                                uint64_t *res_postcopiable);
@@ -128,6 +138,7 @@ void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
                                            uint64_t *length_list);
 
 int qemu_loadvm_state(QEMUFile *f);
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
 
 extern int autostart;
 
@@ -37,6 +37,7 @@ static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
+static unsigned int global_dirty_log_users;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -2275,6 +2276,9 @@ void memory_global_dirty_log_sync(void)
 
 void memory_global_dirty_log_start(void)
 {
+    if (global_dirty_log_users++) {
+        return;
+    }
     global_dirty_log = true;
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
@@ -2287,6 +2291,10 @@ void memory_global_dirty_log_start(void)
 
 void memory_global_dirty_log_stop(void)
 {
+    assert(global_dirty_log_users > 0);
+    if (--global_dirty_log_users) {
+        return;
+    }
     global_dirty_log = false;
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
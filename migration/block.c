@@ -36,7 +36,7 @@
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
-#define MAX_IS_ALLOCATED_SEARCH 65536
+#define MAX_IS_ALLOCATED_SEARCH (1 << 21)
 
 #define MAX_INFLIGHT_IO 512
 
@@ -127,13 +127,26 @@ static void blk_mig_unlock(void)
     qemu_mutex_unlock(&block_mig_state.lock);
 }
 
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds, int64_t sector,
+                            uint64_t flags)
+{
+    int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
+
+    /* device name */
+    len = strlen(bmds->blk_name);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *) bmds->blk_name, len);
+}
+
 /* Must run outside of the iothread lock during the bulk phase,
  * or the VM will stall.
  */
 
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
-    int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
@@ -141,14 +154,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(blk->bmds->blk_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *) blk->bmds->blk_name, len);
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -161,6 +167,22 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
+/* Send [sector, sector + nr_sectors) as zero blocks without reading it.
+ * Only valid if the destination understands BLK_MIG_FLAG_ZERO_BLOCK.
+ */
+
+static void blk_send_zero_range(QEMUFile *f, BlkMigDevState *bmds,
+                                int64_t sector, int64_t nr_sectors)
+{
+    int64_t end = sector + nr_sectors;
+
+    for (; sector < end; sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        blk_send_header(f, bmds, sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+    }
+    qemu_fflush(f);
+}
+
 int blk_mig_active(void)
 {
     return !QSIMPLEQ_EMPTY(&block_mig_state.bmds_list);
@@ -263,29 +285,51 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Block status is used to skip what needs no reading: unallocated parts of
+ * the top image when the base is shared, and ranges that read as zeroes.
+ * Zero ranges are sent as BLK_MIG_FLAG_ZERO_BLOCK when the destination
+ * supports it, otherwise they are queued from a zeroed buffer.  Up to
+ * @max_reads chunks are queued per call, so that many reads are in flight.
+ */
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds,
+                                int max_reads)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
+    int64_t zero_sectors = 0;
+    int64_t end, status;
     BlockBackend *bb = bmds->blk;
+    BlockDriverState *bs = blk_bs(bb);
+    BlockDriverState *file;
     BlkMigBlock *blk;
     int nr_sectors;
+    int i;
+
+    /* We do not know if bs is under the main thread (and thus does
+     * not acquire the AioContext when doing AIO) or rather under
+     * dataplane.  Thus acquire both the iothread mutex and the
+     * AioContext.
+     *
+     * This is ugly and will disappear when we make bdrv_* thread-safe,
+     * without the need to acquire the AioContext.
+     */
+    qemu_mutex_lock_iothread();
+    aio_context_acquire(blk_get_aio_context(bb));
 
     if (bmds->shared_base) {
-        qemu_mutex_lock_iothread();
-        aio_context_acquire(blk_get_aio_context(bb));
         while (cur_sector < total_sectors &&
-               !bdrv_is_allocated(blk_bs(bb), cur_sector,
+               !bdrv_is_allocated(bs, cur_sector,
                                   MAX_IS_ALLOCATED_SEARCH, &nr_sectors)) {
             cur_sector += nr_sectors;
         }
-        aio_context_release(blk_get_aio_context(bb));
-        qemu_mutex_unlock_iothread();
     }
 
     if (cur_sector >= total_sectors) {
+        aio_context_release(blk_get_aio_context(bb));
+        qemu_mutex_unlock_iothread();
         bmds->cur_sector = bmds->completed_sectors = total_sectors;
         return 1;
     }
@@ -294,45 +338,94 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    /* With a shared base only the top image is looked at, the rest of the
+     * chain is already present on the destination.
+     */
+    if (bmds->shared_base) {
+        status = bdrv_get_block_status(bs, cur_sector,
+                                       MIN(total_sectors - cur_sector,
+                                           MAX_IS_ALLOCATED_SEARCH),
+                                       &nr_sectors, &file);
+    } else {
+        status = bdrv_get_block_status_above(bs, NULL, cur_sector,
+                                             MIN(total_sectors - cur_sector,
+                                                 MAX_IS_ALLOCATED_SEARCH),
+                                             &nr_sectors, &file);
+    }
+    if (status < 0) {
+        /* we are going to transfer a full block and let the read fail */
+        status = BDRV_BLOCK_DATA;
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
+    end = cur_sector + nr_sectors;
+    if (status & BDRV_BLOCK_ZERO) {
+        /* only whole chunks can be skipped, except at the end of the disk */
+        if (end < total_sectors) {
+            end &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        }
+        zero_sectors = end - cur_sector;
+    }
+    if (!zero_sectors) {
+        /* we are going to transfer full blocks even if partly unallocated */
+        end = MIN(QEMU_ALIGN_UP(MAX(end, cur_sector + 1),
+                                BDRV_SECTORS_PER_DIRTY_CHUNK),
+                  total_sectors);
     }
 
-    blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+    if (zero_sectors && block_mig_state.zero_blocks) {
+        DPRINTF("Skipping %" PRId64 " zero sectors at %" PRId64 "\n",
+                zero_sectors, cur_sector);
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, zero_sectors);
+        aio_context_release(blk_get_aio_context(bb));
+        qemu_mutex_unlock_iothread();
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+        blk_send_zero_range(f, bmds, cur_sector, zero_sectors);
+        bmds->cur_sector = cur_sector + zero_sectors;
+        return (bmds->cur_sector >= total_sectors);
+    }
 
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
+    for (i = 0; i < max_reads && cur_sector < end; i++) {
+        nr_sectors = MIN(BDRV_SECTORS_PER_DIRTY_CHUNK,
+                         total_sectors - cur_sector);
 
-    /* We do not know if bs is under the main thread (and thus does
-     * not acquire the AioContext when doing AIO) or rather under
-     * dataplane.  Thus acquire both the iothread mutex and the
-     * AioContext.
-     *
-     * This is ugly and will disappear when we make bdrv_* thread-safe,
-     * without the need to acquire the AioContext.
-     */
-    qemu_mutex_lock_iothread();
-    aio_context_acquire(blk_get_aio_context(bmds->blk));
-    blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE, &blk->qiov,
-                                0, blk_mig_read_cb, blk);
+        blk = g_new(BlkMigBlock, 1);
+        blk->bmds = bmds;
+        blk->sector = cur_sector;
+        blk->nr_sectors = nr_sectors;
+
+        if (zero_sectors) {
+            /* no need to read what is known to be zero */
+            blk->buf = g_malloc0(BLOCK_SIZE);
+            blk->ret = 0;
+
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done++;
+            blk_mig_unlock();
+        } else {
+            blk->buf = g_malloc(BLOCK_SIZE);
+            blk->iov.iov_base = blk->buf;
+            blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+            blk_mig_lock();
+            block_mig_state.submitted++;
+            bmds_set_aio_inflight(bmds, cur_sector, nr_sectors, 1);
+            blk_mig_unlock();
+
+            blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE,
+                                        &blk->qiov, 0, blk_mig_read_cb, blk);
+        }
 
-    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
-    aio_context_release(blk_get_aio_context(bmds->blk));
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
+        cur_sector += nr_sectors;
+    }
+
+    aio_context_release(blk_get_aio_context(bb));
     qemu_mutex_unlock_iothread();
 
-    bmds->cur_sector = cur_sector + nr_sectors;
+    bmds->cur_sector = cur_sector;
     return (bmds->cur_sector >= total_sectors);
 }
 
@@ -459,7 +552,7 @@ out:
 
 /* Called with no lock taken.  */
 
-static int blk_mig_save_bulked_block(QEMUFile *f)
+static int blk_mig_save_bulked_block(QEMUFile *f, int max_reads)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
@@ -468,7 +561,7 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
+            if (mig_save_device_bulk(f, bmds, max_reads) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
@@ -505,72 +598,77 @@ static void blk_mig_reset_dirty_cursor(void)
     }
 }
 
-/* Called with iothread lock and AioContext taken.  */
+/* Called with iothread lock and AioContext taken.
+ *
+ * Sends the next dirty chunk at or after cur_dirty, found by walking the
+ * dirty bitmap rather than testing every chunk.
+ */
 
 static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
-    BlockDriverState *bs = blk_bs(bmds->blk);
+    BdrvDirtyBitmapIter *iter;
     int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
-            blk_mig_unlock();
-            blk_drain(bmds->blk);
-        } else {
-            blk_mig_unlock();
-        }
-        if (bdrv_get_dirty(bs, bmds->dirty_bitmap, sector)) {
+    iter = bdrv_dirty_iter_new(bmds->dirty_bitmap, bmds->cur_dirty);
+    sector = bdrv_dirty_iter_next(iter);
+    bdrv_dirty_iter_free(iter);
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_new(BlkMigBlock, 1);
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->aiocb = blk_aio_preadv(bmds->blk,
-                                            sector * BDRV_SECTOR_SIZE,
-                                            &blk->qiov, 0, blk_mig_read_cb,
-                                            blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = blk_pread(bmds->blk, sector * BDRV_SECTOR_SIZE, blk->buf,
-                                nr_sectors * BDRV_SECTOR_SIZE);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        blk_drain(bmds->blk);
+    } else {
+        blk_mig_unlock();
+    }
 
-            bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
-            break;
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_new(BlkMigBlock, 1);
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk->aiocb = blk_aio_preadv(bmds->blk, sector * BDRV_SECTOR_SIZE,
+                                    &blk->qiov, 0, blk_mig_read_cb, blk);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        ret = blk_pread(bmds->blk, sector * BDRV_SECTOR_SIZE, blk->buf,
+                        nr_sectors * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
+    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
+    bmds->cur_dirty = sector + BDRV_SECTORS_PER_DIRTY_CHUNK;
+
     return (bmds->cur_dirty >= bmds->total_sectors);
 
 error:
@@ -726,6 +824,7 @@ static int block_save_setup(QEMUFile *f, void *opaque)
 static int block_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
+    int64_t inflight, max_reads;
     int64_t last_ftell = qemu_ftell(f);
     int64_t delta_ftell;
 
@@ -741,16 +840,16 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     /* control the rate of transfer */
     blk_mig_lock();
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
+    while ((inflight = block_mig_state.submitted +
+                       block_mig_state.read_done) * BLOCK_SIZE <
            qemu_file_get_rate_limit(f) &&
-           (block_mig_state.submitted +
-            block_mig_state.read_done) <
-           MAX_INFLIGHT_IO) {
+           inflight < MAX_INFLIGHT_IO) {
+        max_reads = MIN(MAX_INFLIGHT_IO,
+                        qemu_file_get_rate_limit(f) / BLOCK_SIZE) - inflight;
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            if (blk_mig_save_bulked_block(f, MAX(max_reads, 1)) == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
             }
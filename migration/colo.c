@@ -22,6 +22,35 @@
 
 #define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
 
+/* How often dirty pages are sent ahead of a checkpoint */
+#define COLO_PRESEND_INTERVAL_MS 50
+
+/*
+ * The Secondary keeps the pages sent ahead until the next checkpoint, so
+ * they may take at most this many bytes per checkpoint.  Pages dirtied
+ * beyond that are left to the checkpoint itself.
+ */
+#define COLO_PRESEND_MAX_SIZE (16 * COLO_BUFFER_BASE_SIZE)
+
+/*
+ * Bytes of stream per dirty page on top of its data: the page header,
+ * the RAMBlock name and what compression may add.
+ */
+#define COLO_PRESEND_PAGE_OVERHEAD 512
+
+/*
+ * Written by the COLO thread and read by query-migrate, both with the
+ * iothread lock held; the COLO thread alone may read them without it.
+ */
+static struct {
+    int64_t checkpoints;
+    int64_t last_pause;     /* us */
+    int64_t total_pause;    /* us */
+    int64_t max_pause;      /* us */
+    uint64_t last_size;
+    uint64_t presend_bytes;
+} colo_stats;
+
 bool colo_supported(void)
 {
     return true;
@@ -46,6 +75,21 @@ static bool colo_runstate_is_stopped(void)
     return runstate_check(RUN_STATE_COLO) || !runstate_is_running();
 }
 
+COLOCheckpointStats *colo_checkpoint_stats(void)
+{
+    COLOCheckpointStats *stats = g_new0(COLOCheckpointStats, 1);
+
+    stats->checkpoints = colo_stats.checkpoints;
+    stats->last_pause = colo_stats.last_pause;
+    if (colo_stats.checkpoints) {
+        stats->average_pause = colo_stats.total_pause / colo_stats.checkpoints;
+    }
+    stats->max_pause = colo_stats.max_pause;
+    stats->last_size = colo_stats.last_size;
+    stats->presend_bytes = colo_stats.presend_bytes;
+    return stats;
+}
+
 static void secondary_vm_do_failover(void)
 {
     int old_state;
@@ -207,6 +251,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
                                           QEMUFile *fb)
 {
     Error *local_err = NULL;
+    int64_t pause_start, pause;
     int ret = -1;
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
@@ -231,6 +276,7 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
     }
     vm_stop_force_state(RUN_STATE_COLO);
     qemu_mutex_unlock_iothread();
+    pause_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     trace_colo_vm_state_change("run", "stop");
     /*
      * Failover request bh could be called after vm_stop_force_state(),
@@ -288,8 +334,15 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
 
     qemu_mutex_lock_iothread();
     vm_start();
+    pause = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - pause_start;
+    colo_stats.checkpoints++;
+    colo_stats.last_pause = pause;
+    colo_stats.total_pause += pause;
+    colo_stats.max_pause = MAX(colo_stats.max_pause, pause);
+    colo_stats.last_size = bioc->usage;
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
+    trace_colo_checkpoint(pause, bioc->usage);
 
 out:
     if (local_err) {
@@ -298,15 +351,93 @@ out:
     return ret;
 }
 
+/*
+ * Send the pages dirtied since the last checkpoint while the guest keeps
+ * running, so that the next checkpoint only has to send those dirtied
+ * again in the meantime.  The Secondary keeps them aside and only loads
+ * them as part of that checkpoint: a failover before it must still find
+ * its RAM matching its device state.
+ *
+ * *presend_size counts the bytes sent ahead of the next checkpoint so
+ * far.  Returns false if the pages dirtied now might not fit within
+ * COLO_PRESEND_MAX_SIZE; nothing is sent then and the checkpoint has to
+ * carry them.
+ */
+static bool colo_ram_presend(MigrationState *s, QIOChannelBuffer *bioc,
+                             QEMUFile *fb, uint64_t *presend_size,
+                             Error **errp)
+{
+    uint64_t pend_nonpost = 0, pend_post = 0, pend, pages;
+    Error *local_err = NULL;
+    int ret;
+
+    /*
+     * Synchronizes the dirty bitmap.  The iterations below only send what
+     * is dirty in it now, so the pending size bounds what they send.
+     */
+    qemu_savevm_state_pending(fb, UINT64_MAX, &pend_nonpost, &pend_post);
+    pend = pend_nonpost + pend_post;
+    if (!pend) {
+        return true;
+    }
+    pages = DIV_ROUND_UP(pend, 1 << qemu_target_page_bits());
+    if (*presend_size + pend + pages * COLO_PRESEND_PAGE_OVERHEAD >
+        COLO_PRESEND_MAX_SIZE) {
+        return false;
+    }
+
+    qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
+    bioc->usage = 0;
+
+    do {
+        ret = qemu_savevm_state_iterate(fb, false);
+    } while (ret == 0 && !qemu_file_get_error(fb));
+    qemu_put_byte(fb, QEMU_VM_EOF);
+    qemu_fflush(fb);
+
+    ret = qemu_file_get_error(fb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to save dirty pages");
+        return false;
+    }
+
+    colo_send_message_value(s->to_dst_file, COLO_MESSAGE_RAM_PRESEND,
+                            bioc->usage, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return false;
+    }
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+    ret = qemu_file_get_error(s->to_dst_file);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to send dirty pages");
+        return false;
+    }
+    *presend_size += bioc->usage;
+
+    qemu_mutex_lock_iothread();
+    colo_stats.presend_bytes += bioc->usage;
+    qemu_mutex_unlock_iothread();
+    trace_colo_ram_presend(bioc->usage);
+    return true;
+}
+
 static void colo_process_checkpoint(MigrationState *s)
 {
     QIOChannelBuffer *bioc;
     QEMUFile *fb = NULL;
     int64_t current_time, checkpoint_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    uint64_t presend_size;
+    bool presend;
     Error *local_err = NULL;
     int ret;
 
     failover_init_state();
+    qemu_mutex_lock_iothread();
+    memset(&colo_stats, 0, sizeof(colo_stats));
+    qemu_savevm_set_device_delta(migrate_colo_incremental());
+    qemu_mutex_unlock_iothread();
 
     s->rp_state.from_dst_file = qemu_file_get_return_path(s->to_dst_file);
     if (!s->rp_state.from_dst_file) {
@@ -339,6 +470,27 @@ static void colo_process_checkpoint(MigrationState *s)
         }
 
         current_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        /*
+         * Only once the first checkpoint has turned block migration off;
+         * until then there is nothing the Secondary misses anyway.
+         */
+        presend = migrate_colo_incremental() && colo_stats.checkpoints;
+        presend_size = 0;
+        while (presend &&
+               current_time - checkpoint_time + COLO_PRESEND_INTERVAL_MS <
+               s->parameters.x_checkpoint_delay) {
+            g_usleep(COLO_PRESEND_INTERVAL_MS * 1000);
+            if (failover_get_state() != FAILOVER_STATUS_NONE) {
+                error_report("failover request");
+                goto out;
+            }
+            presend = colo_ram_presend(s, bioc, fb, &presend_size,
+                                       &local_err);
+            if (local_err) {
+                goto out;
+            }
+            current_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        }
         if (current_time - checkpoint_time <
             s->parameters.x_checkpoint_delay) {
             int64_t delay_ms;
@@ -367,6 +519,9 @@ out:
     if (s->rp_state.from_dst_file) {
         qemu_fclose(s->rp_state.from_dst_file);
     }
+    qemu_mutex_lock_iothread();
+    qemu_savevm_set_device_delta(false);
+    qemu_mutex_unlock_iothread();
 }
 
 void migrate_start_colo_process(MigrationState *s)
@@ -378,7 +533,44 @@ void migrate_start_colo_process(MigrationState *s)
     qemu_mutex_lock_iothread();
 }
 
+/*
+ * Append pages sent ahead of the next checkpoint to @pbioc, where they
+ * wait to be loaded together with it.  The Primary stops sending them
+ * before @pbioc would grow beyond COLO_PRESEND_MAX_SIZE.
+ */
+static void colo_receive_ram_presend(QEMUFile *f, QIOChannelBuffer *pbioc,
+                                     Error **errp)
+{
+    uint64_t size;
+    int ret;
+
+    size = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to get value for COLO message: %s",
+                         COLOMessage_lookup[COLO_MESSAGE_RAM_PRESEND]);
+        return;
+    }
+
+    if (size > COLO_PRESEND_MAX_SIZE - pbioc->usage) {
+        error_setg(errp, "Dirty pages sent ahead of the checkpoint exceed %d"
+                   " bytes", COLO_PRESEND_MAX_SIZE);
+        return;
+    }
+    if (pbioc->usage + size > pbioc->capacity) {
+        pbioc->capacity = pbioc->usage + size;
+        pbioc->data = g_realloc(pbioc->data, pbioc->capacity);
+    }
+    if (qemu_get_buffer(f, pbioc->data + pbioc->usage, size) != size) {
+        error_setg(errp, "Got less than the %" PRIu64 " bytes of dirty pages"
+                   " expected", size);
+        return;
+    }
+    pbioc->usage += size;
+}
+
 static void colo_wait_handle_message(QEMUFile *f, int *checkpoint_request,
+                                     QIOChannelBuffer *pbioc, int *presend,
                                      Error **errp)
 {
     COLOMessage msg;
@@ -394,6 +586,15 @@ static void colo_wait_handle_message(QEMUFile *f, int *checkpoint_request,
     case COLO_MESSAGE_CHECKPOINT_REQUEST:
         *checkpoint_request = 1;
         break;
+    case COLO_MESSAGE_RAM_PRESEND:
+        *checkpoint_request = 0;
+        colo_receive_ram_presend(f, pbioc, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        (*presend)++;
+        break;
     default:
         *checkpoint_request = 0;
         error_setg(errp, "Got unknown COLO message: %d", msg);
@@ -406,6 +607,9 @@ void *colo_process_incoming_thread(void *opaque)
     MigrationIncomingState *mis = opaque;
     QEMUFile *fb = NULL;
     QIOChannelBuffer *bioc = NULL; /* Cache incoming device state */
+    QEMUFile *pf = NULL;
+    QIOChannelBuffer *pbioc = NULL; /* Pages sent ahead of the checkpoint */
+    int presend = 0;
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
@@ -432,6 +636,10 @@ void *colo_process_incoming_thread(void *opaque)
     fb = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
     object_unref(OBJECT(bioc));
 
+    pbioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
+    pf = qemu_fopen_channel_input(QIO_CHANNEL(pbioc));
+    object_unref(OBJECT(pbioc));
+
     colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_READY,
                       &local_err);
     if (local_err) {
@@ -441,15 +649,18 @@ void *colo_process_incoming_thread(void *opaque)
     while (mis->state == MIGRATION_STATUS_COLO) {
         int request = 0;
 
-        colo_wait_handle_message(mis->from_src_file, &request, &local_err);
+        colo_wait_handle_message(mis->from_src_file, &request, pbioc,
+                                 &presend, &local_err);
         if (local_err) {
             goto out;
         }
-        assert(request);
         if (failover_get_state() != FAILOVER_STATUS_NONE) {
             error_report("failover request");
             goto out;
         }
+        if (!request) {
+            continue;
+        }
 
         /* FIXME: This is unnecessary for periodic checkpoint mode */
         colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_REPLY,
@@ -496,6 +707,17 @@ void *colo_process_incoming_thread(void *opaque)
 
         qemu_mutex_lock_iothread();
         qemu_system_reset(VMRESET_SILENT);
+        /* Each batch of pages sent ahead ends with its own QEMU_VM_EOF */
+        qio_channel_io_seek(QIO_CHANNEL(pbioc), 0, 0, NULL);
+        for (; presend; presend--) {
+            if (qemu_loadvm_state_main(pf, mis) < 0) {
+                error_report("COLO: loading dirty pages failed");
+                qemu_mutex_unlock_iothread();
+                goto out;
+            }
+        }
+        pbioc->usage = 0;
+        qio_channel_io_seek(QIO_CHANNEL(pbioc), 0, 0, NULL);
         if (qemu_loadvm_state(fb) < 0) {
             error_report("COLO: loadvm failed");
             qemu_mutex_unlock_iothread();
@@ -520,9 +742,14 @@ out:
         qemu_fclose(fb);
     }
 
+    if (pf) {
+        qemu_fclose(pf);
+    }
+
     if (mis->to_src_file) {
         qemu_fclose(mis->to_src_file);
     }
+    loadvm_free_device_delta(mis);
     migration_incoming_exit_colo();
 
     return NULL;
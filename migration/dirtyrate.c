@@ -0,0 +1,196 @@
+/*
+ * Guest dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * calc-dirty-rate samples how fast the guest dirties its memory without
+ * starting a migration.  It enables global dirty logging, throws away the
+ * dirty state accumulated so far, waits for the requested period and then
+ * counts the pages that were dirtied in the meantime.
+ *
+ * With TCG, writes to a clean page go through notdirty_mem_write in the
+ * context of the vCPU that performs them, which lets us attribute each
+ * newly dirtied page to a vCPU.  Other accelerators only report the
+ * global rate.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qom/cpu.h"
+#include "exec/ram_addr.h"
+#include "sysemu/sysemu.h"
+#include "migration/migration.h"
+#include "migration/dirtyrate.h"
+#include "trace.h"
+
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t dirty_rate;
+    int ncpus;
+    int64_t *cpu_index;
+    int64_t *cpu_dirty_rate;
+} dirty_rate;
+
+bool dirty_rate_measuring(void)
+{
+    return atomic_read(&dirty_rate.status) == DIRTY_RATE_STATUS_MEASURING;
+}
+
+/*
+ * Fetch and clear the migration dirty bits of all RAM blocks.
+ * Returns the number of dirty pages.  Called with the iothread lock held.
+ */
+static uint64_t dirty_rate_sync_pages(void)
+{
+    RAMBlock *block;
+    unsigned long *bitmap;
+    uint64_t num_dirty = 0;
+
+    memory_global_dirty_log_sync();
+
+    rcu_read_lock();
+    bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(bitmap,
+                                                           block->offset,
+                                                           block->used_length);
+    }
+    rcu_read_unlock();
+
+    g_free(bitmap);
+    return num_dirty;
+}
+
+/* Convert a number of pages dirtied over @secs seconds into MiB/s */
+static int64_t dirty_rate_mbps(uint64_t pages, int64_t secs)
+{
+    return (pages << TARGET_PAGE_BITS) / secs / (1024 * 1024);
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    int64_t secs = dirty_rate.calc_time;
+    uint64_t num_dirty;
+    CPUState *cpu;
+    int i;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    dirty_rate_sync_pages();
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+    }
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    qemu_mutex_unlock_iothread();
+
+    trace_dirty_rate_start(secs);
+    g_usleep(secs * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    num_dirty = dirty_rate_sync_pages();
+    memory_global_dirty_log_stop();
+
+    g_free(dirty_rate.cpu_index);
+    g_free(dirty_rate.cpu_dirty_rate);
+    dirty_rate.cpu_index = NULL;
+    dirty_rate.cpu_dirty_rate = NULL;
+    dirty_rate.ncpus = 0;
+    if (tcg_enabled()) {
+        CPU_FOREACH(cpu) {
+            dirty_rate.ncpus++;
+        }
+        dirty_rate.cpu_index = g_new(int64_t, dirty_rate.ncpus);
+        dirty_rate.cpu_dirty_rate = g_new(int64_t, dirty_rate.ncpus);
+        i = 0;
+        CPU_FOREACH(cpu) {
+            dirty_rate.cpu_index[i] = cpu->cpu_index;
+            dirty_rate.cpu_dirty_rate[i] =
+                dirty_rate_mbps(atomic_read(&cpu->dirty_pages), secs);
+            i++;
+        }
+    }
+    dirty_rate.dirty_rate = dirty_rate_mbps(num_dirty, secs);
+    qemu_mutex_unlock_iothread();
+
+    trace_dirty_rate_end(num_dirty, dirty_rate.dirty_rate);
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    QemuThread thread;
+
+    if (calc_time < DIRTY_RATE_MIN_CALC_TIME ||
+        calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTY_RATE_MIN_CALC_TIME, DIRTY_RATE_MAX_CALC_TIME);
+        return;
+    }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is already running");
+        return;
+    }
+    if (!migration_is_idle(s) || runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Cannot measure the dirty page rate while a "
+                   "migration is in progress");
+        return;
+    }
+
+    dirty_rate.calc_time = calc_time;
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURING);
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    int i;
+
+    info->status = atomic_mb_read(&dirty_rate.status);
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        info->calc_time = dirty_rate.calc_time;
+        return info;
+    }
+
+    info->start_time = dirty_rate.start_time;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate.dirty_rate;
+
+    if (dirty_rate.ncpus) {
+        info->has_vcpu_dirty_rate = true;
+        for (i = 0; i < dirty_rate.ncpus; i++) {
+            DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+            entry->value = g_new0(DirtyRateVcpu, 1);
+            entry->value->id = dirty_rate.cpu_index[i];
+            entry->value->dirty_rate = dirty_rate.cpu_dirty_rate[i];
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->vcpu_dirty_rate = head;
+    }
+    return info;
+}
@@ -0,0 +1,187 @@
+/*
+ * QEMU live migration to and from a regular file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+
+/*
+ * Both directions do positioned I/O at the offset QEMUFile asks for rather
+ * than going through a channel, so that parts of the file can be skipped
+ * (see qemu_file_skip_input/output) and RAM stored at fixed offsets.
+ */
+typedef struct QEMUFileRegular {
+    int fd;
+} QEMUFileRegular;
+
+static ssize_t file_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                               size_t size)
+{
+    QEMUFileRegular *s = opaque;
+    ssize_t len;
+
+    do {
+        len = pread(s->fd, buf, size, pos);
+    } while (len == -1 && errno == EINTR);
+
+    return len == -1 ? -errno : len;
+}
+
+static ssize_t file_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileRegular *s = opaque;
+    ssize_t done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size_t off = 0;
+
+        while (off < iov[i].iov_len) {
+            ssize_t len = pwrite(s->fd, (uint8_t *)iov[i].iov_base + off,
+                                 iov[i].iov_len - off, pos + done);
+            if (len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            off += len;
+            done += len;
+        }
+    }
+    return done;
+}
+
+static int file_close(void *opaque)
+{
+    QEMUFileRegular *s = opaque;
+    int ret = 0;
+
+    if (qemu_close(s->fd)) {
+        ret = -errno;
+    }
+    g_free(s);
+    return ret;
+}
+
+static const QEMUFileOps file_read_ops = {
+    .get_buffer = file_get_buffer,
+    .close =      file_close
+};
+
+static const QEMUFileOps file_write_ops = {
+    .writev_buffer = file_writev_buffer,
+    .close =         file_close
+};
+
+/*
+ * fixed-ram keeps guest pages on a descriptor of their own, opened with
+ * O_DIRECT where the file system allows it so that saving or restoring a
+ * large guest does not go through the page cache.
+ */
+static int file_open_page_fd(const char *filename, int flags, Error **errp)
+{
+    int fd = -1;
+
+#ifdef O_DIRECT
+    if ((1ul << qemu_target_page_bits()) >= 4096) {
+        fd = qemu_open(filename, flags | O_DIRECT);
+    }
+#endif
+    if (fd < 0) {
+        fd = qemu_open(filename, flags);
+    }
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Unable to open %s", filename);
+    }
+    return fd;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QEMUFileRegular *fs;
+    int fd;
+
+    trace_migration_file_outgoing(filename);
+    fd = qemu_open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Unable to open %s", filename);
+        return;
+    }
+
+    if (migrate_use_fixed_ram()) {
+        int page_fd = file_open_page_fd(filename, O_WRONLY, errp);
+
+        if (page_fd < 0) {
+            qemu_close(fd);
+            return;
+        }
+        fixed_ram_set_page_fd(page_fd);
+    }
+
+    fs = g_new0(QEMUFileRegular, 1);
+    fs->fd = fd;
+    s->to_dst_file = qemu_fopen_ops(fs, &file_write_ops);
+    migrate_fd_connect(s);
+}
+
+static void file_process_incoming_migration(void *opaque)
+{
+    migration_fd_process_incoming(opaque);
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QEMUFileRegular *s;
+    QEMUFile *f;
+    int fd;
+
+    trace_migration_file_incoming(filename);
+    fd = qemu_open(filename, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Unable to open %s", filename);
+        return;
+    }
+
+    if (migrate_lazy_restore()) {
+        int lazy_fd = dup(fd);
+
+        if (lazy_fd < 0) {
+            error_setg_errno(errp, errno, "Unable to duplicate %s file "
+                             "descriptor", filename);
+            qemu_close(fd);
+            return;
+        }
+        ram_lazy_restore_set_source(lazy_fd);
+    }
+
+    if (migrate_use_fixed_ram()) {
+        int page_fd = file_open_page_fd(filename, O_RDONLY, errp);
+
+        if (page_fd < 0) {
+            qemu_close(fd);
+            return;
+        }
+        fixed_ram_set_page_fd(page_fd);
+    }
+
+    s = g_new0(QEMUFileRegular, 1);
+    s->fd = fd;
+    f = qemu_fopen_ops(s, &file_read_ops);
+
+    /* Start once the main loop runs, like the other incoming transports */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            file_process_incoming_migration, f);
+}
@@ -37,6 +37,7 @@
 #include "io/channel-buffer.h"
 #include "io/channel-tls.h"
 #include "migration/colo.h"
+#include "migration/dirtyrate.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -56,9 +57,12 @@
 #define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
 /*0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Default thread count for parallel-device-state */
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREAD_COUNT 4
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+#define DEFAULT_MIGRATE_CPU_THROTTLE_MAX 99
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -101,11 +105,15 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .dirty_rate_target = 0,
+            .cpu_throttle_max = DEFAULT_MIGRATE_CPU_THROTTLE_MAX,
+            .device_state_threads = DEFAULT_MIGRATE_DEVICE_STATE_THREAD_COUNT,
         },
     };
 
     if (!once) {
         qemu_mutex_init(&current_migration.src_page_req_mutex);
+        qemu_sem_init(&current_migration.rate_limit_sem, 0);
         once = true;
     }
     return &current_migration;
@@ -135,6 +143,7 @@ void migration_incoming_state_destroy(void)
 {
     qemu_event_destroy(&mis_current->main_thread_load_event);
     loadvm_free_handlers(mis_current);
+    loadvm_free_device_delta(mis_current);
     g_free(mis_current);
     mis_current = NULL;
 }
@@ -312,6 +321,12 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
+    if (migrate_use_fixed_ram() && strcmp(uri, "defer") &&
+        !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram needs a file: migration URI");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
@@ -327,6 +342,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -368,6 +385,17 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+
+    if (migrate_lazy_restore()) {
+        /*
+         * The device state is in; read the rest of RAM while the VM runs.
+         * The migration completes when that is done, see
+         * migration_incoming_lazy_restore_end.
+         */
+        ram_lazy_restore_start_fill();
+        return;
+    }
+
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -379,6 +407,24 @@ static void process_incoming_migration_bh(void *opaque)
     migration_incoming_state_destroy();
 }
 
+/*
+ * Called in the main loop once all of RAM has been restored lazily, or
+ * once that failed with @ret; in the latter case the VM has been stopped.
+ */
+void migration_incoming_lazy_restore_end(int ret)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (ret < 0) {
+        error_report("lazy restore of RAM failed: %s", strerror(-ret));
+    }
+    migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
+                      ret < 0 ? MIGRATION_STATUS_FAILED
+                              : MIGRATION_STATUS_COMPLETED);
+    qemu_bh_delete(mis->bh);
+    migration_incoming_state_destroy();
+}
+
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
@@ -391,6 +437,10 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    if (!ret && migrate_lazy_restore()) {
+        /* Pages the device state needed may have failed to load */
+        ret = ram_lazy_restore_get_error();
+    }
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -595,6 +645,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_dirty_rate_target = true;
+    params->dirty_rate_target = s->parameters.dirty_rate_target;
+    params->has_cpu_throttle_max = true;
+    params->cpu_throttle_max = s->parameters.cpu_throttle_max;
+    params->has_device_state_threads = true;
+    params->device_state_threads = s->parameters.device_state_threads;
 
     return params;
 }
@@ -645,12 +701,38 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->dirty_sync_count = s->dirty_sync_count;
     info->ram->postcopy_requests = s->postcopy_requests;
 
+    info->ram_passes = ram_pass_stats();
+    info->has_ram_passes = !!info->ram_passes;
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
     }
 }
 
+static void populate_vcpu_throttle_info(MigrationInfo *info,
+                                        MigrationState *s)
+{
+    VcpuThrottleInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!s->parameters.dirty_rate_target) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        VcpuThrottleInfoList *entry = g_new0(VcpuThrottleInfoList, 1);
+
+        entry->value = g_new0(VcpuThrottleInfo, 1);
+        entry->value->id = cpu->cpu_index;
+        entry->value->percentage = cpu_throttle_get_vcpu_percentage(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_vcpu_throttle = true;
+    info->vcpu_throttle = head;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -688,6 +770,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         if (cpu_throttle_active()) {
             info->has_cpu_throttle_percentage = true;
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+            populate_vcpu_throttle_info(info, s);
         }
 
         get_xbzrle_cache_stats(info);
@@ -717,7 +800,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
-        /* TODO: display COLO specific information (checkpoint info etc.) */
+        info->has_colo_checkpoint = true;
+        info->colo_checkpoint = colo_checkpoint_stats();
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
@@ -745,6 +829,14 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    /* Filled in on the destination, whatever the (outgoing) state is */
+    info->postcopy_fault_latency = postcopy_fault_latency_get();
+    info->has_postcopy_fault_latency = !!info->postcopy_fault_latency;
+    info->downtime_save = qemu_savevm_downtime_save();
+    info->has_downtime_save = !!info->downtime_save;
+    info->downtime_load = qemu_savevm_downtime_load();
+    info->has_downtime_load = !!info->downtime_load;
+
     return info;
 }
 
@@ -754,6 +846,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
     bool old_postcopy_cap = migrate_postcopy_ram();
+    bool old_lazy_restore_cap = migrate_lazy_restore();
 
     if (migration_is_setup_or_active(s->state)) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
@@ -798,6 +891,56 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_background_snapshot()) {
+        /* Every page is sent once and unprotected right after, so nothing
+         * that resends, defers or transforms pages can be combined with it.
+         */
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression() || migrate_colo_enabled() ||
+            migrate_use_batch_pages() || migrate_auto_converge() ||
+            s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]) {
+            error_report("Background snapshot is not compatible with "
+                         "postcopy-ram, xbzrle, compress, x-colo, "
+                         "batch-pages, auto-converge or rdma-pin-all");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        } else if (!ram_write_tracking_available()) {
+            error_report("Background snapshot is not supported: the host "
+                         "lacks userfaultfd write protection");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT] =
+                false;
+        }
+    }
+
+    if (migrate_lazy_restore()) {
+        /* Lazily restored pages are placed with userfaultfd just as
+         * postcopy pages are, and come straight out of the saved file, so
+         * neither postcopy nor page transforms can be mixed in.
+         */
+        if (migrate_postcopy_ram()) {
+            error_report("Lazy restore is not compatible with postcopy-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE] = false;
+        } else if (!old_lazy_restore_cap &&
+                   runstate_check(RUN_STATE_INMIGRATE) &&
+                   !postcopy_ram_supported_by_host()) {
+            /* postcopy_ram_supported_by_host will have emitted a more
+             * detailed message
+             */
+            error_report("Lazy restore is not supported");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE] = false;
+        }
+    }
+
+    if (migrate_use_fixed_ram()) {
+        /* Pages are written in place, never into the stream */
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression() || migrate_colo_enabled()) {
+            error_report("fixed-ram is not compatible with postcopy-ram, "
+                         "xbzrle, compress or x-colo");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -858,6 +1001,27 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_dirty_rate_target && params->dirty_rate_target < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_rate_target",
+                   "is invalid, it should be positive or 0 to disable");
+        return;
+    }
+    if (params->has_cpu_throttle_max &&
+        (params->cpu_throttle_max < 1 || params->cpu_throttle_max > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "cpu_throttle_max",
+                   "an integer in the range of 1 to 99");
+        return;
+    }
+    if (params->has_device_state_threads &&
+        (params->device_state_threads < 1 ||
+         params->device_state_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "device_state_threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -896,6 +1060,15 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
     if (params->has_x_checkpoint_delay) {
         s->parameters.x_checkpoint_delay = params->x_checkpoint_delay;
     }
+    if (params->has_dirty_rate_target) {
+        s->parameters.dirty_rate_target = params->dirty_rate_target;
+    }
+    if (params->has_cpu_throttle_max) {
+        s->parameters.cpu_throttle_max = params->cpu_throttle_max;
+    }
+    if (params->has_device_state_threads) {
+        s->parameters.device_state_threads = params->device_state_threads;
+    }
 }
 
 
@@ -1114,6 +1287,7 @@ MigrationState *migrate_init(const MigrationParams *params)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    qemu_savevm_downtime_reset();
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1205,6 +1379,19 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
     }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is in progress");
+        return;
+    }
+    if (params.blk && migrate_background_snapshot()) {
+        error_setg(errp, "Block migration is not compatible with "
+                   "background snapshots");
+        return;
+    }
+    if (migrate_use_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "fixed-ram needs a file: migration URI");
+        return;
+    }
 
     if (migration_is_blocked(errp)) {
         return;
@@ -1224,6 +1411,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1364,6 +1553,15 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.device_state_threads;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1373,6 +1571,51 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_use_batch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BATCH_PAGES];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
+bool migrate_use_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1827,6 +2070,31 @@ bool migrate_colo_enabled(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_X_COLO];
 }
 
+bool migrate_colo_incremental(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_COLO_INCREMENTAL];
+}
+
+/*
+ * Sleep out the rest of the rate limit period, unless a page is requested
+ * (see ram_save_queue_pages).  The semaphore is only posted while we are
+ * here, so its count never builds up.
+ */
+static void migration_rate_limit_wait(MigrationState *s, int64_t ms)
+{
+    bool woken = false;
+
+    atomic_mb_set(&s->rate_limit_waiting, true);
+    if (!ram_save_queue_pending(s)) {
+        woken = qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0;
+    }
+    if (!atomic_xchg(&s->rate_limit_waiting, false) && !woken) {
+        /* A request came in as we stopped waiting, take its post */
+        qemu_sem_wait(&s->rate_limit_sem);
+    }
+}
+
 /*
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
@@ -1880,7 +2148,8 @@ static void *migration_thread(void *opaque)
         int64_t current_time;
         uint64_t pending_size;
 
-        if (!qemu_file_rate_limit(s->to_dst_file)) {
+        if (!qemu_file_rate_limit(s->to_dst_file) ||
+            ram_save_queue_pending(s)) {
             uint64_t pend_post, pend_nonpost;
 
             qemu_savevm_state_pending(s->to_dst_file, max_size, &pend_nonpost,
@@ -1943,8 +2212,9 @@ static void *migration_thread(void *opaque)
             initial_bytes = qemu_ftell(s->to_dst_file);
         }
         if (qemu_file_rate_limit(s->to_dst_file)) {
-            /* usleep expects microseconds */
-            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            migration_rate_limit_wait(s,
+                                      initial_time + BUFFER_DELAY -
+                                      current_time);
         }
     }
 
@@ -1997,6 +2267,104 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Initial size of the buffer that holds the device state of a background
+ * snapshot while RAM is being saved.
+ */
+#define BG_SNAPSHOT_BUFFER_BASE_SIZE (512 * 1024)
+
+/*
+ * Migration thread used for background snapshots.
+ * The VM is stopped only long enough to save the device state into a
+ * buffer and write protect its RAM; RAM is then saved in a single pass
+ * while the guest runs, pages it writes to being saved first.  The device
+ * state is sent after RAM, as in a normal migration stream.
+ */
+static void *background_snapshot_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t start_time;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool old_vm_running;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_begin(s->to_dst_file, &s->params);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+    trace_background_snapshot_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(BG_SNAPSHOT_BUFFER_BASE_SIZE);
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    old_vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret && old_vm_running) {
+        ret = vm_stop(RUN_STATE_SAVE_VM);
+    }
+    if (!ret) {
+        cpu_synchronize_all_states();
+        qemu_savevm_state_complete_precopy_non_iterable(fb, false);
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret) {
+        ret = ram_write_tracking_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+    if (old_vm_running) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+    trace_background_snapshot_thread_vm_resumed(s->downtime, ret);
+
+    if (!ret) {
+        ret = qemu_savevm_state_complete_background(s->to_dst_file);
+        ram_write_tracking_stop();
+    }
+    if (!ret) {
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+        ret = qemu_file_get_error(s->to_dst_file);
+    }
+    qemu_fclose(fb);
+
+    if (ret) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    } else {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_COMPLETED);
+    }
+    trace_background_snapshot_thread_end(ret);
+
+    qemu_mutex_lock_iothread();
+    qemu_savevm_state_cleanup();
+    if (s->state == MIGRATION_STATUS_COMPLETED) {
+        uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
+        s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                        s->total_time;
+        if (s->total_time) {
+            s->mbps = (((double) transferred_bytes * 8.0) /
+                       ((double) s->total_time)) / 1000;
+        }
+    }
+    /* The VM keeps running from where it was, so no POSTMIGRATE here */
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     s->expected_downtime = s->parameters.downtime_limit;
@@ -2024,8 +2392,14 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot",
+                           background_snapshot_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
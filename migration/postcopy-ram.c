@@ -24,6 +24,10 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "qemu/seqlock.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -60,6 +64,164 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+/*
+ * Upper bound on the number of host pages requested for a single fault.
+ * The window doubles each time the guest faults right behind the previous
+ * request, and falls back to one page when it faults somewhere else.
+ */
+#define POSTCOPY_PREFETCH_MAX_PAGES 64
+
+/* Buckets of PostcopyFaultLatency.histogram, log2 of microseconds */
+#define POSTCOPY_LATENCY_BUCKETS 21
+
+/* Faults whose latency can be timed at the same time */
+#define POSTCOPY_LATENCY_SLOTS 64
+
+/*
+ * Time between the fault thread seeing a fault and the page being placed.
+ * The fault thread notes each host page faulted on in a free slot, with
+ * the time (ns) of the first fault; placing a page only has to look at
+ * the slots when some are in use, which they rarely are.  The statistics
+ * are only updated by the thread placing pages and are read under the
+ * seqlock.
+ */
+static struct {
+    struct {
+        void *host;     /* NULL if the slot is free */
+        int64_t start;
+    } slots[POSTCOPY_LATENCY_SLOTS];
+    int pending;        /* slots in use */
+    bool active;
+
+    QemuSeqLock sequence;
+    uint64_t faults;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t histogram[POSTCOPY_LATENCY_BUCKETS];
+} fault_latency;
+
+static void fault_latency_reset(void)
+{
+    int i;
+
+    for (i = 0; i < POSTCOPY_LATENCY_SLOTS; i++) {
+        atomic_set(&fault_latency.slots[i].host, NULL);
+    }
+    atomic_set(&fault_latency.pending, 0);
+
+    seqlock_write_begin(&fault_latency.sequence);
+    fault_latency.faults = 0;
+    fault_latency.total_us = 0;
+    fault_latency.max_us = 0;
+    memset(fault_latency.histogram, 0, sizeof(fault_latency.histogram));
+    seqlock_write_end(&fault_latency.sequence);
+    atomic_set(&fault_latency.active, true);
+}
+
+/* Called from the fault thread */
+static void fault_latency_start(void *host)
+{
+    int i, free_slot = -1;
+
+    for (i = 0; i < POSTCOPY_LATENCY_SLOTS; i++) {
+        void *slot_host = atomic_read(&fault_latency.slots[i].host);
+
+        /* Another vCPU may be waiting on the same page; keep its time */
+        if (slot_host == host) {
+            return;
+        }
+        if (!slot_host && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (free_slot < 0) {
+        /* Too many faults in flight, this one is not timed */
+        return;
+    }
+
+    fault_latency.slots[free_slot].start =
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    atomic_inc(&fault_latency.pending);
+    atomic_mb_set(&fault_latency.slots[free_slot].host, host);
+}
+
+/* Called from the thread placing pages */
+static void fault_latency_end(void *host)
+{
+    int64_t start;
+    uint64_t us;
+    int i, bucket;
+
+    if (!atomic_read(&fault_latency.pending)) {
+        return;
+    }
+    for (i = 0; i < POSTCOPY_LATENCY_SLOTS; i++) {
+        if (atomic_read(&fault_latency.slots[i].host) == host) {
+            break;
+        }
+    }
+    if (i == POSTCOPY_LATENCY_SLOTS) {
+        return;
+    }
+
+    /* Pairs with atomic_mb_set in fault_latency_start */
+    smp_rmb();
+    start = fault_latency.slots[i].start;
+    atomic_mb_set(&fault_latency.slots[i].host, NULL);
+    atomic_dec(&fault_latency.pending);
+
+    us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / SCALE_US;
+    bucket = us ? 63 - clz64(us) : 0;
+
+    seqlock_write_begin(&fault_latency.sequence);
+    fault_latency.histogram[MIN(bucket, POSTCOPY_LATENCY_BUCKETS - 1)]++;
+    fault_latency.faults++;
+    fault_latency.total_us += us;
+    fault_latency.max_us = MAX(fault_latency.max_us, us);
+    seqlock_write_end(&fault_latency.sequence);
+    trace_postcopy_fault_latency(host, us);
+}
+
+PostcopyFaultLatency *postcopy_fault_latency_get(void)
+{
+    PostcopyFaultLatency *info;
+    uint64_t faults, total_us, max_us;
+    uint64_t histogram[POSTCOPY_LATENCY_BUCKETS];
+    intList **tail;
+    unsigned seq;
+    int i;
+
+    if (!atomic_read(&fault_latency.active)) {
+        return NULL;
+    }
+
+    do {
+        seq = seqlock_read_begin(&fault_latency.sequence);
+        faults = fault_latency.faults;
+        total_us = fault_latency.total_us;
+        max_us = fault_latency.max_us;
+        memcpy(histogram, fault_latency.histogram, sizeof(histogram));
+    } while (seqlock_read_retry(&fault_latency.sequence, seq));
+
+    if (!faults) {
+        return NULL;
+    }
+
+    info = g_new0(PostcopyFaultLatency, 1);
+    info->faults = faults;
+    info->average = total_us / faults;
+    info->max = max_us;
+
+    tail = &info->histogram;
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        *tail = g_new0(intList, 1);
+        (*tail)->value = histogram[i];
+        tail = &(*tail)->next;
+    }
+
+    return info;
+}
+
 static bool ufd_version_check(int ufd)
 {
     struct uffdio_api api_struct;
@@ -423,6 +585,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
     size_t hostpagesize = getpagesize();
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    ram_addr_t last_start = 0, last_end = 0; /* last range requested */
+    size_t window = 1; /* host pages to request for the next fault */
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
@@ -491,19 +655,40 @@ static void *postcopy_ram_fault_thread(void *opaque)
         trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
+        fault_latency_start((void *)(uintptr_t)(msg.arg.pagefault.address &
+                                                ~(uint64_t)(hostpagesize - 1)));
+
+        if (rb == last_rb && rb_offset >= last_start && rb_offset < last_end) {
+            /* Already on its way from the source */
+            continue;
+        }
 
         /*
-         * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
+         * Send the request to the source - we want to request at least one
+         * of our host page sizes (which is >= TPS), and more of the pages
+         * that follow while the guest keeps faulting on them in order.
          */
+        if (rb == last_rb && rb_offset == last_end) {
+            window = MIN(window * 2, POSTCOPY_PREFETCH_MAX_PAGES);
+        } else {
+            window = 1;
+        }
+        last_start = rb_offset;
+        last_end = MIN(rb_offset + window * hostpagesize,
+                       qemu_ram_get_used_length(rb));
+        if (window > 1) {
+            trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                     rb_offset, window);
+        }
+
         if (rb != last_rb) {
             last_rb = rb;
             migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
+                                     rb_offset, last_end - rb_offset);
         } else {
             /* Save some space */
             migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
+                                     rb_offset, last_end - rb_offset);
         }
     }
     trace_postcopy_ram_fault_thread_exit();
@@ -537,6 +722,8 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    fault_latency_reset();
+
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -586,6 +773,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
         return -e;
     }
 
+    fault_latency_end(host);
     trace_postcopy_place_page(host);
     return 0;
 }
@@ -610,6 +798,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
         return -e;
     }
 
+    fault_latency_end(host);
     trace_postcopy_place_page_zero(host);
     return 0;
 }
@@ -638,6 +827,581 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Write tracking for background snapshots.
+ *
+ * All of RAM is write-protected through userfaultfd at the point in time
+ * the snapshot is taken.  When the guest writes to a page that has not been
+ * saved yet, the fault thread queues that page as an urgent request for the
+ * migration thread, which saves it and then drops the protection, waking
+ * the faulting vCPU up.
+ */
+
+/* Older kernel headers lack the write-protect ioctl */
+#ifndef UFFDIO_WRITEPROTECT
+#define _UFFDIO_WRITEPROTECT            (0x06)
+struct uffdio_writeprotect {
+    struct uffdio_range range;
+    __u64 mode;
+};
+#define UFFDIO_WRITEPROTECT_MODE_WP     ((__u64)1 << 0)
+#define UFFDIO_WRITEPROTECT_MODE_DONTWAKE ((__u64)1 << 1)
+#define UFFDIO_WRITEPROTECT _IOWR(UFFDIO, _UFFDIO_WRITEPROTECT, \
+                                  struct uffdio_writeprotect)
+#endif
+
+static struct {
+    int ufd;
+    int quit_fd;
+    QemuThread thread;
+} write_tracking = { .ufd = -1, .quit_fd = -1 };
+
+static int ufd_open_wp(void)
+{
+    struct uffdio_api api_struct;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        return -1;
+    }
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(ufd, UFFDIO_API, &api_struct) ||
+        !(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        close(ufd);
+        return -1;
+    }
+    return ufd;
+}
+
+bool ram_write_tracking_available(void)
+{
+    int ufd = ufd_open_wp();
+
+    if (ufd < 0) {
+        return false;
+    }
+    close(ufd);
+    return true;
+}
+
+static int ufd_change_protection(int ufd, void *host, uint64_t length,
+                                 bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)host;
+    wp_struct.range.len = length;
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int e = errno;
+        error_report("%s: %s host: %p len: %" PRIu64,
+                     __func__, strerror(e), host, length);
+        return -e;
+    }
+    return 0;
+}
+
+static int ram_block_enable_write_tracking(const char *block_name,
+                                           void *host_addr,
+                                           ram_addr_t offset,
+                                           ram_addr_t length, void *opaque)
+{
+    struct uffdio_register reg_struct;
+    size_t pagesize = getpagesize();
+    volatile uint8_t *p;
+    ram_addr_t i;
+
+    /* Only populated pages can be write protected; fault everything in
+     * with reads, which do not allocate anything new for zero pages.
+     */
+    for (i = 0, p = host_addr; i < length; i += pagesize) {
+        (void)p[i];
+    }
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(write_tracking.ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: cannot register %s: %s", __func__, block_name,
+                     strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: %s does not support write protection", __func__,
+                     block_name);
+        return -1;
+    }
+    return ufd_change_protection(write_tracking.ufd, host_addr, length, true);
+}
+
+static int ram_block_disable_write_tracking(const char *block_name,
+                                            void *host_addr,
+                                            ram_addr_t offset,
+                                            ram_addr_t length, void *opaque)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+    /* Unregistering also removes any protection that is left */
+    ioctl(write_tracking.ufd, UFFDIO_UNREGISTER, &range_struct);
+    return 0;
+}
+
+static void *ram_write_tracking_thread(void *opaque)
+{
+    MigrationState *ms = migrate_get_current();
+    size_t pagesize = getpagesize();
+    struct uffd_msg msg;
+    int ret;
+
+    rcu_register_thread();
+    while (true) {
+        struct pollfd pfd[2];
+        ram_addr_t rb_offset;
+        RAMBlock *rb;
+
+        pfd[0].fd = write_tracking.ufd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = write_tracking.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(write_tracking.ufd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: failed to read userfault message", __func__);
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rcu_read_lock();
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 false, &rb_offset);
+        if (rb) {
+            rb_offset &= ~(pagesize - 1);
+            trace_ram_write_tracking_fault(qemu_ram_get_idstr(rb), rb_offset);
+            ram_save_queue_pages(ms, qemu_ram_get_idstr(rb), rb_offset,
+                                 pagesize);
+        }
+        rcu_read_unlock();
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int ram_write_tracking_start(void)
+{
+    write_tracking.ufd = ufd_open_wp();
+    if (write_tracking.ufd < 0) {
+        error_report("%s: userfaultfd write protection is not available",
+                     __func__);
+        return -1;
+    }
+    write_tracking.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (write_tracking.quit_fd == -1) {
+        error_report("%s: opening quit fd: %s", __func__, strerror(errno));
+        close(write_tracking.ufd);
+        write_tracking.ufd = -1;
+        return -1;
+    }
+
+    if (qemu_ram_foreach_block(ram_block_enable_write_tracking, NULL)) {
+        qemu_ram_foreach_block(ram_block_disable_write_tracking, NULL);
+        close(write_tracking.quit_fd);
+        close(write_tracking.ufd);
+        write_tracking.quit_fd = write_tracking.ufd = -1;
+        return -1;
+    }
+
+    qemu_thread_create(&write_tracking.thread, "snapshot/wp",
+                       ram_write_tracking_thread, NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+int ram_write_tracking_unprotect(void *host, size_t length)
+{
+    if (write_tracking.ufd < 0) {
+        return 0;
+    }
+    return ufd_change_protection(write_tracking.ufd, host, length, false);
+}
+
+void ram_write_tracking_stop(void)
+{
+    uint64_t tmp64 = 1;
+
+    if (write_tracking.ufd < 0) {
+        return;
+    }
+
+    /* Unprotecting everything wakes up any vCPU still waiting on a page */
+    qemu_ram_foreach_block(ram_block_disable_write_tracking, NULL);
+
+    if (write(write_tracking.quit_fd, &tmp64, 8) != 8) {
+        error_report("%s: incrementing quit fd: %s", __func__,
+                     strerror(errno));
+    }
+    qemu_thread_join(&write_tracking.thread);
+
+    close(write_tracking.quit_fd);
+    close(write_tracking.ufd);
+    write_tracking.quit_fd = write_tracking.ufd = -1;
+}
+
+
+/*
+ * Lazy restore of RAM from a file.
+ *
+ * Guest RAM is emptied and registered with userfaultfd while the RAM
+ * section is loaded; ram.c only records where each page is in the file.
+ * Faults are resolved by reading the page from the file, and once the VM
+ * runs a background thread places all remaining pages, after which
+ * userfault is turned off again.
+ *
+ * If the file cannot be read, the restore fails: from then on faults are
+ * resolved with zero pages, so that nothing stays blocked on them, and
+ * either the load of the device state fails or, if the VM is already
+ * running, it is stopped with an internal error and must be reset.
+ */
+static struct {
+    int ufd;
+    int quit_fd;
+    QemuThread fault_thread;
+    QemuThread fill_thread;
+    uint64_t faults;
+    bool running;   /* set by ram_lazy_restore_start_fill */
+    int error;      /* first read error, accessed atomically */
+} lazy_restore = { .ufd = -1, .quit_fd = -1 };
+
+/*
+ * Record that RAM could not be restored; called from the fault and fill
+ * threads.
+ */
+static void lazy_restore_fail(int ret)
+{
+    if (atomic_cmpxchg(&lazy_restore.error, 0, ret) != 0) {
+        return;
+    }
+    error_report("lazy restore: cannot read guest RAM from the file: %s",
+                 strerror(-ret));
+    if (atomic_read(&lazy_restore.running)) {
+        qemu_system_vmstop_request_prepare();
+        qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+    }
+}
+
+int ram_lazy_restore_get_error(void)
+{
+    return atomic_read(&lazy_restore.error);
+}
+
+static int lazy_restore_place(void *host, void *from, int kind)
+{
+    int ret;
+
+    if (kind == LAZY_PAGE_DATA) {
+        struct uffdio_copy copy_struct;
+
+        copy_struct.dst = (uint64_t)(uintptr_t)host;
+        copy_struct.src = (uint64_t)(uintptr_t)from;
+        copy_struct.len = getpagesize();
+        copy_struct.mode = 0;
+        ret = ioctl(lazy_restore.ufd, UFFDIO_COPY, &copy_struct);
+    } else {
+        struct uffdio_zeropage zero_struct;
+
+        zero_struct.range.start = (uint64_t)(uintptr_t)host;
+        zero_struct.range.len = getpagesize();
+        zero_struct.mode = 0;
+        ret = ioctl(lazy_restore.ufd, UFFDIO_ZEROPAGE, &zero_struct);
+    }
+    /* EEXIST: the page was written after the range was discarded */
+    if (ret && errno != EEXIST) {
+        int e = errno;
+        error_report("%s: %s host: %p", __func__, strerror(e), host);
+        return -e;
+    }
+    return 0;
+}
+
+static int lazy_restore_init_range(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    struct uffdio_register reg_struct;
+
+    /* Anything put there at init time (e.g. ROMs) comes from the file */
+    if (postcopy_ram_discard_range(NULL, host_addr, length)) {
+        return -1;
+    }
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(lazy_restore.ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int lazy_restore_cleanup_range(const char *block_name,
+                                      void *host_addr, ram_addr_t offset,
+                                      ram_addr_t length, void *opaque)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+    if (ioctl(lazy_restore.ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *lazy_restore_fault_thread(void *opaque)
+{
+    size_t hostpagesize = getpagesize();
+    void *tmp_page = qemu_memalign(hostpagesize, hostpagesize);
+    struct uffd_msg msg;
+    int ret;
+
+    rcu_register_thread();
+    while (true) {
+        ram_addr_t rb_offset;
+        struct pollfd pfd[2];
+        RAMBlock *rb;
+        void *host;
+
+        pfd[0].fd = lazy_restore.ufd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = lazy_restore.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(lazy_restore.ufd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: failed to read userfault message", __func__);
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        rcu_read_lock();
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &rb_offset);
+        if (!rb) {
+            rcu_read_unlock();
+            error_report("%s: fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+        rb_offset &= ~(hostpagesize - 1);
+        host = (void *)(uintptr_t)(msg.arg.pagefault.address &
+                                   ~(uint64_t)(hostpagesize - 1));
+        trace_lazy_restore_fault(qemu_ram_get_idstr(rb), rb_offset);
+        lazy_restore.faults++;
+
+        if (atomic_read(&lazy_restore.error)) {
+            ret = LAZY_PAGE_ZERO;
+        } else {
+            ret = ram_lazy_restore_get_page(rb, rb_offset, tmp_page, true);
+            if (ret < 0) {
+                error_report("%s: cannot restore page at %s+" RAM_ADDR_FMT,
+                             __func__, qemu_ram_get_idstr(rb), rb_offset);
+                lazy_restore_fail(ret);
+                /* Don't leave the faulting thread blocked */
+                ret = LAZY_PAGE_ZERO;
+            }
+        }
+        if (ret != LAZY_PAGE_CLAIMED) {
+            ret = lazy_restore_place(host, tmp_page, ret);
+            if (ret < 0) {
+                lazy_restore_fail(ret);
+            }
+        }
+        rcu_read_unlock();
+    }
+    qemu_vfree(tmp_page);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int lazy_restore_fill_range(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    size_t hostpagesize = getpagesize();
+    RAMBlock *rb = qemu_ram_block_by_name(block_name);
+    ram_addr_t rb_offset;
+    int ret;
+
+    for (rb_offset = 0; rb_offset < length; rb_offset += hostpagesize) {
+        if (atomic_read(&lazy_restore.error)) {
+            return atomic_read(&lazy_restore.error);
+        }
+        ret = ram_lazy_restore_get_page(rb, rb_offset, opaque, false);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == LAZY_PAGE_DATA) {
+            ret = lazy_restore_place((uint8_t *)host_addr + rb_offset,
+                                     opaque, ret);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Turn userfault off for all of RAM, which also wakes up any thread still
+ * waiting for a page, and stop the fault thread.
+ */
+static void lazy_restore_stop_faults(void)
+{
+    uint64_t tmp64 = 1;
+
+    qemu_ram_foreach_block(lazy_restore_cleanup_range, NULL);
+    if (write(lazy_restore.quit_fd, &tmp64, 8) != 8) {
+        error_report("%s: incrementing quit fd: %s", __func__,
+                     strerror(errno));
+    }
+    qemu_thread_join(&lazy_restore.fault_thread);
+    close(lazy_restore.quit_fd);
+    close(lazy_restore.ufd);
+    lazy_restore.quit_fd = lazy_restore.ufd = -1;
+}
+
+static void lazy_restore_end_bh(void *opaque)
+{
+    migration_incoming_lazy_restore_end(ram_lazy_restore_get_error());
+}
+
+static void *lazy_restore_fill_thread(void *opaque)
+{
+    size_t hostpagesize = getpagesize();
+    void *tmp_page = qemu_memalign(hostpagesize, hostpagesize);
+    int64_t start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    rcu_register_thread();
+    ret = qemu_ram_foreach_block(lazy_restore_fill_range, tmp_page);
+    if (ret < 0) {
+        lazy_restore_fail(ret);
+    }
+
+    /*
+     * Everything that has data is in place; once userfault is off the
+     * remaining holes read as zero, exactly as the zero pages they are.
+     * After a failure the VM is being stopped and has to be reset anyway.
+     */
+    lazy_restore_stop_faults();
+
+    ram_lazy_restore_cleanup();
+    qemu_balloon_inhibit(false);
+    trace_lazy_restore_end(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time,
+                           lazy_restore.faults);
+
+    /* Only now is the incoming migration complete (or failed) */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), lazy_restore_end_bh,
+                            NULL);
+
+    qemu_vfree(tmp_page);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int ram_lazy_restore_enable_notify(void)
+{
+    lazy_restore.ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (lazy_restore.ufd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    if (!ufd_version_check(lazy_restore.ufd)) {
+        close(lazy_restore.ufd);
+        lazy_restore.ufd = -1;
+        return -1;
+    }
+    lazy_restore.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (lazy_restore.quit_fd == -1) {
+        error_report("%s: Opening quit fd: %s", __func__, strerror(errno));
+        close(lazy_restore.ufd);
+        lazy_restore.ufd = -1;
+        return -1;
+    }
+
+    /*
+     * Start serving faults before registering: nothing but the device
+     * state load touches RAM and it only does so after the RAM section.
+     */
+    qemu_thread_create(&lazy_restore.fault_thread, "lazy/fault",
+                       lazy_restore_fault_thread, NULL, QEMU_THREAD_JOINABLE);
+    if (qemu_ram_foreach_block(lazy_restore_init_range, NULL)) {
+        /* Unregistering blocks that were never registered just fails */
+        lazy_restore_stop_faults();
+        return -1;
+    }
+
+    /* Ballooned out pages would be refilled from the file */
+    qemu_balloon_inhibit(true);
+    trace_lazy_restore_enable_notify();
+    return 0;
+}
+
+void ram_lazy_restore_start_fill(void)
+{
+    if (lazy_restore.ufd < 0) {
+        return;
+    }
+    atomic_set(&lazy_restore.running, true);
+    qemu_thread_create(&lazy_restore.fill_thread, "lazy/fill",
+                       lazy_restore_fill_thread, NULL, QEMU_THREAD_DETACHED);
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -695,6 +1459,46 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+int ram_write_tracking_start(void)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+int ram_write_tracking_unprotect(void *host, size_t length)
+{
+    return 0;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+int ram_lazy_restore_enable_notify(void)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+void ram_lazy_restore_start_fill(void)
+{
+}
+
+int ram_lazy_restore_get_error(void)
+{
+    return 0;
+}
+
+PostcopyFaultLatency *postcopy_fault_latency_get(void)
+{
+    return NULL;
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -28,6 +28,7 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
@@ -53,6 +54,8 @@ struct QEMUFile {
     unsigned int iovcnt;
 
     int last_error;
+
+    int64_t write_ns; /* time spent in writev_buffer */
 };
 
 /*
@@ -149,8 +152,11 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->iovcnt > 0) {
+        int64_t start = get_clock_realtime();
+
         expect = iov_size(f->iov, f->iovcnt);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+        f->write_ns += get_clock_realtime() - start;
     }
 
     if (ret >= 0) {
@@ -380,6 +386,46 @@ void qemu_file_skip(QEMUFile *f, int size)
     }
 }
 
+/*
+ * Leave a hole of 'size' bytes in the output, to be filled in with
+ * positioned writes.  Same restriction as qemu_file_skip_input, for
+ * writev_buffer.
+ */
+void qemu_file_skip_output(QEMUFile *f, size_t size)
+{
+    assert(qemu_file_is_writable(f));
+    qemu_fflush(f);
+    f->pos += size;
+}
+
+/*
+ * Position in the stream of the next byte to be read.
+ */
+int64_t qemu_ftell_input(QEMUFile *f)
+{
+    assert(!qemu_file_is_writable(f));
+    return f->pos - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Skip 'size' bytes of input, which unlike qemu_file_skip may go past the
+ * buffered data without reading it.  Only valid for files whose get_buffer
+ * honours its 'pos' argument (e.g. the file: incoming migration).
+ */
+void qemu_file_skip_input(QEMUFile *f, size_t size)
+{
+    size_t pending = f->buf_size - f->buf_index;
+
+    assert(!qemu_file_is_writable(f));
+    if (size <= pending) {
+        f->buf_index += size;
+        return;
+    }
+    f->pos += size - pending;
+    f->buf_index = 0;
+    f->buf_size = 0;
+}
+
 /*
  * Read 'size' bytes from file (at 'offset') without moving the
  * pointer and set 'buf' to point to that data.
@@ -559,6 +605,15 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f)
     return f->xfer_limit;
 }
 
+/*
+ * Total time, in nanoseconds, the file has spent handing data to the
+ * channel underneath; for a socket this is mostly time blocked on it.
+ */
+int64_t qemu_file_get_write_time(QEMUFile *f)
+{
+    return f->write_ns;
+}
+
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
 {
     f->xfer_limit = limit;
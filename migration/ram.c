@@ -48,6 +48,7 @@
 static int dirty_rate_high_cnt;
 
 static uint64_t bitmap_sync_count;
+static uint64_t bytes_transferred;
 
 /***********************************************************/
 /* ram save/restore */
@@ -61,6 +62,10 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTI_PAGE       0x200
+
+/* Maximum number of pages sent under a single RAM_SAVE_FLAG_MULTI_PAGE */
+#define RAM_SAVE_MULTI_PAGE_MAX        64
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -147,6 +152,7 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t scanned_pages;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -431,6 +437,113 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+static int compare_dirty_rate(const void *a, const void *b)
+{
+    double ra = *(const double *)a, rb = *(const double *)b;
+
+    return ra < rb ? -1 : ra > rb;
+}
+
+/*
+ * Find the per-vcpu dirty rate cap such that capping each of the @n
+ * unthrottled rates in @rates at it sums up to @target (water filling).
+ * Returns a negative value if the rates already fit within @target.
+ */
+static double dirty_rate_cap(const double *rates, int n, double target)
+{
+    double *sorted = g_memdup(rates, n * sizeof(*rates));
+    double cap = -1;
+    int i;
+
+    qsort(sorted, n, sizeof(*sorted), compare_dirty_rate);
+    for (i = 0; i < n; i++) {
+        double share = target / (n - i);
+
+        if (sorted[i] > share) {
+            cap = share;
+            break;
+        }
+        target -= sorted[i];
+    }
+    g_free(sorted);
+    return cap;
+}
+
+/*
+ * Throttle each vcpu so that the guest dirty rate approaches the
+ * dirty-rate-target parameter.  @dirty_rate is the rate measured during
+ * the last period, in bytes per second.
+ *
+ * The share of each vcpu comes from the pages TCG attributed to it in
+ * notdirty_mem_write; without attribution all vcpus get an equal share.
+ * Dividing by the fraction of time a vcpu was allowed to run estimates the
+ * rate it would dirty at unthrottled.  Only vcpus above the water-filling
+ * cap are throttled, each by the amount it exceeds it, and the throttle of
+ * a vcpu moves by at most cpu-throttle-increment per period so that the
+ * loop does not overshoot.
+ */
+static void mig_throttle_guest_to_target(double dirty_rate)
+{
+    MigrationState *s = migrate_get_current();
+    double target = (double)s->parameters.dirty_rate_target * 1024 * 1024;
+    int max_pct = s->parameters.cpu_throttle_max;
+    int step = s->parameters.cpu_throttle_increment;
+    uint64_t *pages, total_pages = 0;
+    double *rates, cap;
+    CPUState *cpu;
+    int n = 0, i;
+
+    CPU_FOREACH(cpu) {
+        n++;
+    }
+    if (!n) {
+        return;
+    }
+    pages = g_new(uint64_t, n);
+    rates = g_new(double, n);
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        pages[i] = atomic_xchg(&cpu->dirty_pages, 0);
+        total_pages += pages[i];
+        i++;
+    }
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        double share = total_pages ? (double)pages[i] / total_pages : 1.0 / n;
+        double pct = cpu_throttle_get_vcpu_percentage(cpu) / 100.0;
+
+        rates[i] = dirty_rate * share / (1 - pct);
+        i++;
+    }
+
+    cap = dirty_rate_cap(rates, n, target);
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        int cur = cpu_throttle_get_vcpu_percentage(cpu);
+        int want = 0;
+
+        if (cap >= 0 && rates[i] > cap) {
+            want = (int)(100 * (1 - cap / rates[i]) + 0.5);
+        }
+        want = MIN(want, max_pct);
+        want = MIN(want, cur + step);
+        want = MAX(want, cur - step);
+        want = MAX(want, 0);
+        if (want != cur || !cpu_throttle_active()) {
+            cpu_throttle_set_vcpu(cpu, want);
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, (uint64_t)rates[i],
+                                      want);
+        i++;
+    }
+
+    g_free(pages);
+    g_free(rates);
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -562,6 +675,13 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+static inline bool migration_bitmap_test_dirty(ram_addr_t addr)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+
+    return test_bit(addr >> TARGET_PAGE_BITS, bitmap);
+}
+
 static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 {
     bool ret;
@@ -591,13 +711,141 @@ static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
 
+/* Time the compression threads spent on pages, updated atomically */
+static uint64_t compress_time_ns;
+
+/*
+ * Statistics for each pass over the dirty bitmap, that is from one
+ * migration_bitmap_sync to the next; the last few are kept for
+ * query-migrate.  'start' holds the counters as they were when the
+ * current pass began.
+ */
+#define MIGRATION_PASS_HISTORY 16
+
+typedef struct MigrationPass {
+    uint64_t pass;
+    int64_t time_ms;
+    uint64_t sync_us;
+    uint64_t scanned_pages;
+    uint64_t zero_pages;
+    uint64_t compress_ns;
+    uint64_t bytes;
+    int64_t write_ns;
+} MigrationPass;
+
+static struct {
+    QemuMutex lock;
+    bool running;
+    MigrationPass start;
+    MigrationPass history[MIGRATION_PASS_HISTORY];
+    unsigned int count;
+} migration_passes;
+
+static void migration_pass_counters(MigrationPass *mp)
+{
+    QEMUFile *f = migrate_get_current()->to_dst_file;
+
+    mp->time_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    mp->scanned_pages = acct_info.scanned_pages;
+    mp->zero_pages = acct_info.dup_pages;
+    mp->compress_ns = atomic_read(&compress_time_ns);
+    mp->bytes = bytes_transferred;
+    mp->write_ns = f ? qemu_file_get_write_time(f) : 0;
+}
+
+static void migration_pass_end(void)
+{
+    MigrationPass now, *mp;
+
+    qemu_mutex_lock(&migration_passes.lock);
+    if (migration_passes.running) {
+        migration_pass_counters(&now);
+        mp = &migration_passes.history[migration_passes.count++ %
+                                       MIGRATION_PASS_HISTORY];
+        mp->pass = migration_passes.start.pass;
+        mp->time_ms = now.time_ms - migration_passes.start.time_ms;
+        mp->sync_us = migration_passes.start.sync_us;
+        mp->scanned_pages = now.scanned_pages -
+                            migration_passes.start.scanned_pages;
+        mp->zero_pages = now.zero_pages - migration_passes.start.zero_pages;
+        mp->compress_ns = now.compress_ns - migration_passes.start.compress_ns;
+        mp->bytes = now.bytes - migration_passes.start.bytes;
+        mp->write_ns = now.write_ns - migration_passes.start.write_ns;
+        migration_passes.running = false;
+
+        trace_migration_pass_stats(mp->pass, mp->time_ms, mp->sync_us,
+                                   mp->scanned_pages, mp->zero_pages,
+                                   mp->compress_ns / SCALE_US, mp->bytes,
+                                   mp->write_ns / SCALE_US);
+    }
+    qemu_mutex_unlock(&migration_passes.lock);
+}
+
+static void migration_pass_start(uint64_t pass, int64_t sync_ns)
+{
+    migration_pass_end();
+
+    qemu_mutex_lock(&migration_passes.lock);
+    migration_pass_counters(&migration_passes.start);
+    migration_passes.start.pass = pass;
+    migration_passes.start.sync_us = sync_ns / SCALE_US;
+    migration_passes.running = true;
+    qemu_mutex_unlock(&migration_passes.lock);
+}
+
+/* The passes recorded so far, oldest first */
+MigrationPassStatsList *ram_pass_stats(void)
+{
+    MigrationPassStatsList *head = NULL, **tail = &head;
+    unsigned int i, first;
+
+    if (!migration_passes.count) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&migration_passes.lock);
+    first = migration_passes.count > MIGRATION_PASS_HISTORY ?
+            migration_passes.count - MIGRATION_PASS_HISTORY : 0;
+    for (i = first; i < migration_passes.count; i++) {
+        MigrationPass *mp = &migration_passes.history[i %
+                                                      MIGRATION_PASS_HISTORY];
+        MigrationPassStatsList *entry = g_new0(MigrationPassStatsList, 1);
+
+        entry->value = g_new0(MigrationPassStats, 1);
+        entry->value->pass = mp->pass;
+        entry->value->duration = mp->time_ms;
+        entry->value->sync_time = mp->sync_us;
+        entry->value->pages_scanned = mp->scanned_pages;
+        entry->value->zero_pages = mp->zero_pages;
+        entry->value->compress_time = mp->compress_ns / SCALE_US;
+        entry->value->bytes = mp->bytes;
+        entry->value->blocked_time = mp->write_ns / SCALE_US;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&migration_passes.lock);
+
+    return head;
+}
+
 static void migration_bitmap_sync_init(void)
 {
+    static bool once;
+
     start_time = 0;
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+
+    if (!once) {
+        qemu_mutex_init(&migration_passes.lock);
+        once = true;
+    }
+    qemu_mutex_lock(&migration_passes.lock);
+    migration_passes.running = false;
+    migration_passes.count = 0;
+    qemu_mutex_unlock(&migration_passes.lock);
 }
 
 static void migration_bitmap_sync(void)
@@ -607,6 +855,7 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     bitmap_sync_count++;
 
@@ -615,7 +864,12 @@ static void migration_bitmap_sync(void)
     }
 
     if (!start_time) {
+        CPUState *cpu;
+
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        CPU_FOREACH(cpu) {
+            atomic_set(&cpu->dirty_pages, 0);
+        }
     }
 
     trace_migration_bitmap_sync_start();
@@ -636,7 +890,11 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
+        if (migrate_auto_converge() && s->parameters.dirty_rate_target) {
+            mig_throttle_guest_to_target((double)num_dirty_pages_period *
+                                         TARGET_PAGE_SIZE * 1000 /
+                                         (end_time - start_time));
+        } else if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -672,6 +930,8 @@ static void migration_bitmap_sync(void)
         num_dirty_pages_period = 0;
     }
     s->dirty_sync_count = bitmap_sync_count;
+    migration_pass_start(bitmap_sync_count,
+                         qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - sync_start);
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
@@ -705,6 +965,62 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/**
+ * ram_save_page_run: Send a run of contiguous dirty pages with one header
+ *
+ * Returns: Number of pages written, or -1 if the page at pss->offset does
+ *          not start a run and should be sent on its own.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: position of the first page; left on the last page of the run
+ * @offset: offset of the first page, with RAM_SAVE_FLAG_CONTINUE if set
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_page_run(QEMUFile *f, PageSearchStatus *pss,
+                             ram_addr_t offset, uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    uint8_t *p = block->host + pss->offset;
+    unsigned long *unsentmap;
+    ram_addr_t next;
+    uint32_t n = 1;
+
+    /* Extend the run over the following dirty, non-zero pages.  Zero
+     * pages end it: they are much cheaper to send on their own.
+     */
+    next = pss->offset + TARGET_PAGE_SIZE;
+    while (n < RAM_SAVE_MULTI_PAGE_MAX && next < block->used_length &&
+           migration_bitmap_test_dirty(block->offset + next) &&
+           !is_zero_range(block->host + next, TARGET_PAGE_SIZE)) {
+        n++;
+        next += TARGET_PAGE_SIZE;
+    }
+    if (n == 1) {
+        return -1;
+    }
+
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    for (next = pss->offset + TARGET_PAGE_SIZE;
+         next < pss->offset + n * TARGET_PAGE_SIZE;
+         next += TARGET_PAGE_SIZE) {
+        migration_bitmap_clear_dirty(block->offset + next);
+        if (unsentmap) {
+            clear_bit((block->offset + next) >> TARGET_PAGE_BITS, unsentmap);
+        }
+    }
+
+    *bytes_transferred += save_page_header(f, block,
+                                           offset | RAM_SAVE_FLAG_MULTI_PAGE);
+    qemu_put_be32(f, n);
+    qemu_put_buffer_async(f, p, (size_t)n * TARGET_PAGE_SIZE);
+    *bytes_transferred += 4 + (uint64_t)n * TARGET_PAGE_SIZE;
+    acct_info.norm_pages += n;
+
+    /* Leave pss->offset on the last page of the run */
+    pss->offset += (n - 1) * TARGET_PAGE_SIZE;
+    return n;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -778,6 +1094,20 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    if (migrate_background_snapshot()) {
+        /* The page is unprotected as soon as it has been saved, so its
+         * contents must be copied into the stream right now.
+         */
+        send_async = false;
+    }
+
+    /* Normal page that may start a run of contiguous dirty pages */
+    if (pages == -1 && send_async && migrate_use_batch_pages() &&
+        !migration_in_postcopy(migrate_get_current()) &&
+        !(migrate_use_xbzrle() && !ram_bulk_stage)) {
+        pages = ram_save_page_run(f, pss, offset, bytes_transferred);
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -802,11 +1132,14 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 {
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
     blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
                                      migrate_compress_level());
+    atomic_add(&compress_time_ns,
+               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -818,8 +1151,6 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
-
 static void flush_compressed_data(QEMUFile *f)
 {
     int idx, len, thread_count;
@@ -1120,6 +1451,24 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
     return !!block;
 }
 
+/**
+ * ram_save_queue_pending: Check for outstanding page requests
+ *    The destination is stalled on every one of these, so they are
+ *    serviced even when the bandwidth limit has been reached.
+ *
+ * ms: MigrationState
+ */
+bool ram_save_queue_pending(MigrationState *ms)
+{
+    bool pending;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    pending = !QSIMPLEQ_EMPTY(&ms->src_page_requests);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return pending;
+}
+
 /**
  * flush_page_queue: Flush any remaining pages in the ram request queue
  *    it should be empty at the end anyway, but in error cases there may be
@@ -1199,6 +1548,11 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
+    /* Wake the migration thread if it is waiting out the rate limit */
+    if (atomic_xchg(&ms->rate_limit_waiting, false)) {
+        qemu_sem_post(&ms->rate_limit_sem);
+    }
+
     return 0;
 
 err:
@@ -1206,6 +1560,182 @@ err:
     return -1;
 }
 
+/*
+ * fixed-ram: with a file as the migration target, every page of a RAMBlock
+ * has a fixed offset in a region reserved for the block right after its
+ * entry in the RAM_SAVE_FLAG_MEM_SIZE list:
+ *
+ *   be64 bitmap_offset, be64 pages_offset  (in the stream)
+ *   <hole up to bitmap_offset>
+ *   bitmap: one bit per target page, set if the page is in the file
+ *   <hole up to pages_offset>
+ *   used_length bytes of pages
+ *
+ * after which the stream carries on.  Pages dirtied again are rewritten in
+ * place and the bitmaps are filled in when RAM is complete.  Both offsets
+ * are aligned to FIXED_RAM_FILE_ALIGN so that pages can be accessed with
+ * O_DIRECT, through fixed_ram_fd.
+ */
+#define FIXED_RAM_FILE_ALIGN (1 * 1024 * 1024)
+
+static int fixed_ram_fd = -1;
+
+void fixed_ram_set_page_fd(int fd)
+{
+    fixed_ram_fd = fd;
+}
+
+static int fixed_ram_pio(bool is_write, void *buf, size_t size, int64_t pos)
+{
+    uint8_t *p = buf;
+
+    while (size) {
+        ssize_t len;
+
+        if (is_write) {
+            len = pwrite(fixed_ram_fd, p, size, pos);
+        } else {
+            len = pread(fixed_ram_fd, p, size, pos);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            return -EIO;
+        }
+        p += len;
+        pos += len;
+        size -= len;
+    }
+    return 0;
+}
+
+static size_t fixed_ram_bitmap_size(RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    /* Whole 4k units, so that the bitmap can be written with O_DIRECT */
+    return QEMU_ALIGN_UP(DIV_ROUND_UP(pages, BITS_PER_BYTE), 4096);
+}
+
+static void fixed_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    int64_t header_end = qemu_ftell(f) + 2 * sizeof(uint64_t);
+    int64_t region_end;
+
+    block->bitmap_offset = QEMU_ALIGN_UP(header_end, FIXED_RAM_FILE_ALIGN);
+    block->pages_offset = QEMU_ALIGN_UP(block->bitmap_offset +
+                                        fixed_ram_bitmap_size(block),
+                                        FIXED_RAM_FILE_ALIGN);
+    region_end = QEMU_ALIGN_UP(block->pages_offset + block->used_length,
+                               FIXED_RAM_FILE_ALIGN);
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_skip_output(f, region_end - header_end);
+}
+
+/*
+ * Write the page at pss->offset, extended over the dirty pages following
+ * it, in place.  Like ram_save_page_run, leaves pss->offset on the last
+ * page written.
+ */
+static int ram_save_fixed_ram_page(PageSearchStatus *pss,
+                                   uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    unsigned long page = pss->offset >> TARGET_PAGE_BITS;
+    uint8_t *p = block->host + pss->offset;
+    unsigned long *unsentmap;
+    ram_addr_t next;
+    uint32_t n = 1;
+    int ret;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        /* Nothing to write, just forget any older contents */
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
+
+    next = pss->offset + TARGET_PAGE_SIZE;
+    while (n < RAM_SAVE_MULTI_PAGE_MAX && next < block->used_length &&
+           migration_bitmap_test_dirty(block->offset + next)) {
+        n++;
+        next += TARGET_PAGE_SIZE;
+    }
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    for (next = pss->offset + TARGET_PAGE_SIZE;
+         next < pss->offset + n * TARGET_PAGE_SIZE;
+         next += TARGET_PAGE_SIZE) {
+        migration_bitmap_clear_dirty(block->offset + next);
+        if (unsentmap) {
+            clear_bit((block->offset + next) >> TARGET_PAGE_BITS, unsentmap);
+        }
+    }
+
+    ret = fixed_ram_pio(true, p, (size_t)n * TARGET_PAGE_SIZE,
+                        block->pages_offset + pss->offset);
+    if (ret < 0) {
+        error_report("%s: writing %s at " RAM_ADDR_FMT ": %s", __func__,
+                     block->idstr, pss->offset, strerror(-ret));
+        return ret;
+    }
+    bitmap_set(block->file_bmap, page, n);
+    *bytes_transferred += (uint64_t)n * TARGET_PAGE_SIZE;
+    acct_info.norm_pages += n;
+
+    pss->offset += (n - 1) * TARGET_PAGE_SIZE;
+    return n;
+}
+
+/* Called once RAM is complete: record which pages the file holds */
+static int fixed_ram_save_bitmaps(void)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = fixed_ram_bitmap_size(block);
+        uint8_t *buf = qemu_memalign(4096, size);
+        unsigned long i;
+
+        memset(buf, 0, size);
+        for (i = find_first_bit(block->file_bmap, pages); i < pages;
+             i = find_next_bit(block->file_bmap, pages, i + 1)) {
+            buf[i / BITS_PER_BYTE] |= 1 << (i % BITS_PER_BYTE);
+        }
+        ret = fixed_ram_pio(true, buf, size, block->bitmap_offset);
+        qemu_vfree(buf);
+        if (ret < 0) {
+            error_report("%s: writing bitmap of %s: %s", __func__,
+                         block->idstr, strerror(-ret));
+            break;
+        }
+    }
+    return ret;
+}
+
+static void fixed_ram_cleanup(void)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    if (fixed_ram_fd >= 0) {
+        qemu_close(fixed_ram_fd);
+        fixed_ram_fd = -1;
+    }
+}
+
 /**
  * ram_save_target_page: Save one target page
  *
@@ -1230,7 +1760,11 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+
+        acct_info.scanned_pages++;
+        if (migrate_use_fixed_ram()) {
+            res = ram_save_fixed_ram_page(pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1282,6 +1816,8 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
                               ram_addr_t dirty_ram_abs)
 {
     int tmppages, pages = 0;
+    ram_addr_t host_start = pss->offset & qemu_host_page_mask;
+
     do {
         tmppages = ram_save_target_page(ms, f, pss, last_stage,
                                         bytes_transferred, dirty_ram_abs);
@@ -1290,10 +1826,17 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
         }
 
         pages += tmppages;
+        /* A run of pages may have moved pss->offset further */
         pss->offset += TARGET_PAGE_SIZE;
-        dirty_ram_abs += TARGET_PAGE_SIZE;
+        dirty_ram_abs = pss->block->offset + pss->offset;
     } while (pss->offset & (qemu_host_page_size - 1));
 
+    if (migrate_background_snapshot()) {
+        /* Saved: let the guest write to it again */
+        ram_write_tracking_unprotect(pss->block->host + host_start,
+                                     pss->offset - host_start);
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
     return pages;
@@ -1321,7 +1864,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     PageSearchStatus pss;
     MigrationState *ms = migrate_get_current();
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
 
@@ -1336,6 +1879,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     do {
         again = true;
         found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        urgent = found;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -1346,6 +1890,13 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
             pages = ram_save_host_page(ms, f, &pss,
                                        last_stage, bytes_transferred,
                                        dirty_ram_abs);
+            if (urgent) {
+                /*
+                 * A vCPU on the destination is waiting for this page; don't
+                 * let it sit in the buffer behind background pages.
+                 */
+                qemu_fflush(f);
+            }
         }
     } while (!pages && again);
 
@@ -1415,7 +1966,9 @@ static void ram_migration_cleanup(void *opaque)
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
-        memory_global_dirty_log_stop();
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_stop();
+        }
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
 
@@ -1430,6 +1983,12 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_use_fixed_ram()) {
+        rcu_read_lock();
+        fixed_ram_cleanup();
+        rcu_read_unlock();
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1928,8 +2487,13 @@ static int ram_save_init_globals(void)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    /* A background snapshot saves RAM as it was when write protection was
+     * enabled; every page is sent exactly once, so there is no dirty log.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync();
+    }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
     rcu_read_unlock();
@@ -1962,6 +2526,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_use_fixed_ram()) {
+            fixed_ram_save_block_header(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -1993,7 +2560,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
+    /* Page requests from a postcopy destination bypass the rate limit */
+    while ((ret = qemu_file_rate_limit(f)) == 0 ||
+           ram_save_queue_pending(migrate_get_current())) {
         int pages;
 
         pages = ram_find_and_save_block(f, false, &bytes_transferred);
@@ -2043,7 +2612,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    if (!migration_in_postcopy(migrate_get_current())) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        !migrate_background_snapshot()) {
         migration_bitmap_sync();
     }
 
@@ -2065,6 +2635,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     flush_compressed_data(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    migration_pass_end();
+
+    if (migrate_use_fixed_ram() && fixed_ram_save_bitmaps() < 0) {
+        rcu_read_unlock();
+        return -1;
+    }
 
     rcu_read_unlock();
 
@@ -2453,6 +3029,330 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/*
+ * Lazy restore: rather than copying RAM out of the incoming stream, note
+ * where in the (seekable) file every page lives and let the userfault
+ * handling in postcopy-ram.c place pages when they are first touched or
+ * when its background thread gets to them.
+ *
+ * Index entries are per target page: > 0 is the file offset of the page
+ * data, 0 an all-zero page, < 0 a page filled with byte (-entry - 1).
+ * The index is only written while the RAM section is loaded, before any
+ * page can be faulted in.
+ */
+static struct {
+    int fd;
+    int64_t *index;
+    /* Host pages that a thread has started to place */
+    unsigned long *claimed;
+    QemuMutex claimed_lock;
+} lazy_restore = { .fd = -1 };
+
+void ram_lazy_restore_set_source(int fd)
+{
+    lazy_restore.fd = fd;
+}
+
+static int ram_lazy_restore_init(void)
+{
+    unsigned long pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    if (lazy_restore.fd < 0) {
+        error_report("lazy-restore needs a file: incoming migration");
+        return -EINVAL;
+    }
+    if (lazy_restore.index) {
+        /* Already set up by an earlier RAM section */
+        return 0;
+    }
+
+    lazy_restore.index = g_new0(int64_t, pages);
+    lazy_restore.claimed = bitmap_new(pages);
+    qemu_mutex_init(&lazy_restore.claimed_lock);
+
+    return ram_lazy_restore_enable_notify();
+}
+
+/* Record 'n' pages of data at the current stream position and skip them */
+static void ram_lazy_restore_note_pages(QEMUFile *f, RAMBlock *block,
+                                        ram_addr_t addr, uint32_t n)
+{
+    unsigned long page = (block->offset + addr) >> TARGET_PAGE_BITS;
+    int64_t pos = qemu_ftell_input(f);
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        lazy_restore.index[page + i] = pos + (int64_t)i * TARGET_PAGE_SIZE;
+    }
+    qemu_file_skip_input(f, (size_t)n * TARGET_PAGE_SIZE);
+}
+
+/**
+ * ram_lazy_restore_get_page: claim a host page of a lazily restored block
+ *
+ * Returns LAZY_PAGE_CLAIMED if another thread already claimed the page,
+ * LAZY_PAGE_ZERO if it must be placed as a zero page and LAZY_PAGE_DATA if
+ * its contents were read into @buf; -errno on read errors.  Zero pages are
+ * only claimed for faults (@fault); the background thread leaves them
+ * alone since they read as zero once userfault is turned off.
+ *
+ * @rb: RAMBlock the page is in
+ * @offset: host page aligned offset of the page in @rb
+ * @buf: host page sized buffer for the contents
+ * @fault: true if called to resolve a userfault
+ */
+int ram_lazy_restore_get_page(RAMBlock *rb, ram_addr_t offset, void *buf,
+                              bool fault)
+{
+    unsigned long first = (rb->offset + offset) >> TARGET_PAGE_BITS;
+    unsigned long n = qemu_host_page_size >> TARGET_PAGE_BITS;
+    bool zero = true;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        if (lazy_restore.index[first + i]) {
+            zero = false;
+            break;
+        }
+    }
+    if (zero && !fault) {
+        return LAZY_PAGE_ZERO;
+    }
+
+    qemu_mutex_lock(&lazy_restore.claimed_lock);
+    if (test_bit(first, lazy_restore.claimed)) {
+        qemu_mutex_unlock(&lazy_restore.claimed_lock);
+        return LAZY_PAGE_CLAIMED;
+    }
+    set_bit(first, lazy_restore.claimed);
+    qemu_mutex_unlock(&lazy_restore.claimed_lock);
+
+    if (zero) {
+        return LAZY_PAGE_ZERO;
+    }
+
+    for (i = 0; i < n; i++) {
+        int64_t entry = lazy_restore.index[first + i];
+        uint8_t *p = (uint8_t *)buf + (i << TARGET_PAGE_BITS);
+        ssize_t len;
+
+        if (entry <= 0) {
+            memset(p, entry ? -entry - 1 : 0, TARGET_PAGE_SIZE);
+            continue;
+        }
+        do {
+            len = pread(lazy_restore.fd, p, TARGET_PAGE_SIZE, entry);
+        } while (len == -1 && errno == EINTR);
+        if (len != TARGET_PAGE_SIZE) {
+            error_report("%s: reading %s at %" PRId64 " failed: %s",
+                         __func__, rb->idstr, entry,
+                         len < 0 ? strerror(errno) : "short read");
+            return len < 0 ? -errno : -EIO;
+        }
+    }
+
+    return LAZY_PAGE_DATA;
+}
+
+void ram_lazy_restore_cleanup(void)
+{
+    if (lazy_restore.index) {
+        g_free(lazy_restore.index);
+        lazy_restore.index = NULL;
+        g_free(lazy_restore.claimed);
+        lazy_restore.claimed = NULL;
+        qemu_mutex_destroy(&lazy_restore.claimed_lock);
+    }
+    if (lazy_restore.fd >= 0) {
+        close(lazy_restore.fd);
+        lazy_restore.fd = -1;
+    }
+}
+
+/*
+ * fixed-ram load: read the block's offsets and bitmap, then skip its
+ * region of the file; the pages themselves are read by
+ * fixed_ram_load_pages once every block is known.
+ */
+static int fixed_ram_load_block_header(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t size = fixed_ram_bitmap_size(block);
+    int64_t header_end, region_end;
+    uint8_t *buf;
+    unsigned long i;
+    int ret;
+
+    if (fixed_ram_fd < 0) {
+        error_report("fixed-ram needs a file: incoming migration");
+        return -EINVAL;
+    }
+
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    header_end = qemu_ftell_input(f);
+    if (block->bitmap_offset < header_end ||
+        block->pages_offset < block->bitmap_offset + size ||
+        (block->bitmap_offset | block->pages_offset) &
+        (FIXED_RAM_FILE_ALIGN - 1)) {
+        error_report("Invalid fixed-ram region for %s", block->idstr);
+        return -EINVAL;
+    }
+
+    buf = qemu_memalign(4096, size);
+    ret = fixed_ram_pio(false, buf, size, block->bitmap_offset);
+    if (ret < 0) {
+        error_report("%s: reading bitmap of %s: %s", __func__, block->idstr,
+                     strerror(-ret));
+        qemu_vfree(buf);
+        return ret;
+    }
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(pages);
+    for (i = 0; i < pages; i++) {
+        if (buf[i / BITS_PER_BYTE] & (1 << (i % BITS_PER_BYTE))) {
+            set_bit(i, block->file_bmap);
+        }
+    }
+    qemu_vfree(buf);
+
+    region_end = QEMU_ALIGN_UP(block->pages_offset + block->used_length,
+                               FIXED_RAM_FILE_ALIGN);
+    qemu_file_skip_input(f, region_end - header_end);
+    return 0;
+}
+
+typedef struct FixedRamLoadThread {
+    QemuThread thread;
+    unsigned int id;
+    unsigned int count;
+    int ret;
+} FixedRamLoadThread;
+
+/*
+ * Each thread reads its share of the pages of every block, and clears the
+ * pages that are not in the file
+ */
+static void *fixed_ram_load_thread(void *opaque)
+{
+    FixedRamLoadThread *t = opaque;
+    RAMBlock *block;
+
+    rcu_register_thread();
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long chunk = DIV_ROUND_UP(pages, t->count);
+        unsigned long start = MIN(t->id * chunk, pages);
+        unsigned long end = MIN(start + chunk, pages);
+        unsigned long i, j;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        for (i = start; i < end; i = j) {
+            if (!test_bit(i, block->file_bmap)) {
+                j = find_next_bit(block->file_bmap, end, i);
+                ram_handle_compressed(block->host + (i << TARGET_PAGE_BITS),
+                                      0, (j - i) << TARGET_PAGE_BITS);
+                continue;
+            }
+            j = find_next_zero_bit(block->file_bmap, end, i);
+            t->ret = fixed_ram_pio(false, block->host +
+                                   (i << TARGET_PAGE_BITS),
+                                   (j - i) << TARGET_PAGE_BITS,
+                                   block->pages_offset +
+                                   ((int64_t)i << TARGET_PAGE_BITS));
+            if (t->ret < 0) {
+                error_report("%s: reading %s: %s", __func__, block->idstr,
+                             strerror(-t->ret));
+                goto out;
+            }
+        }
+    }
+out:
+    rcu_read_unlock();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Pages not in the file were zero on the source.  RAM on the destination
+ * need not be (ROMs and firmware are put there at init time), so they are
+ * cleared unless they already read as zero, which leaves untouched memory
+ * unallocated.
+ */
+static int fixed_ram_load_pages(void)
+{
+    unsigned int count = MAX(migrate_decompress_threads(), 1);
+    FixedRamLoadThread *threads = g_new0(FixedRamLoadThread, count);
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < count; i++) {
+        threads[i].id = i;
+        threads[i].count = count;
+        qemu_thread_create(&threads[i].thread, "fixed_ram_load",
+                           fixed_ram_load_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < count; i++) {
+        qemu_thread_join(&threads[i].thread);
+        if (threads[i].ret < 0 && !ret) {
+            ret = threads[i].ret;
+        }
+    }
+    g_free(threads);
+    return ret;
+}
+
+/* Lazy restore of a fixed-ram file: the bitmaps say where everything is */
+static void fixed_ram_lazy_restore_index(void)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long i;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        for (i = find_first_bit(block->file_bmap, pages); i < pages;
+             i = find_next_bit(block->file_bmap, pages, i + 1)) {
+            lazy_restore.index[first + i] = block->pages_offset +
+                                            ((int64_t)i << TARGET_PAGE_BITS);
+        }
+    }
+}
+
+/*
+ * Load a run of pages sent with RAM_SAVE_FLAG_MULTI_PAGE straight into
+ * guest memory, or only note where they are for a lazy restore.  @host
+ * points to the first page, at offset @addr of the last block read from
+ * the stream.
+ */
+static int ram_load_page_run(QEMUFile *f, ram_addr_t addr, void *host)
+{
+    uint32_t n = qemu_get_be32(f);
+    RAMBlock *block = ram_block_from_stream(f, RAM_SAVE_FLAG_CONTINUE);
+
+    if (!n || n > RAM_SAVE_MULTI_PAGE_MAX || !block ||
+        !offset_in_ramblock(block, addr + (ram_addr_t)(n - 1) *
+                                   TARGET_PAGE_SIZE)) {
+        error_report("Invalid run of %u pages at " RAM_ADDR_FMT, n, addr);
+        return -EINVAL;
+    }
+
+    if (lazy_restore.index) {
+        ram_lazy_restore_note_pages(f, block, addr, n);
+        return 0;
+    }
+    qemu_get_buffer(f, host, (size_t)n * TARGET_PAGE_SIZE);
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2484,6 +3384,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL;
+        RAMBlock *rb = NULL;
         uint8_t ch;
 
         addr = qemu_get_be64(f);
@@ -2491,10 +3392,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_MULTI_PAGE)) {
+            rb = ram_block_from_stream(f, flags);
 
-            host = host_from_ram_block_offset(block, addr);
+            host = host_from_ram_block_offset(rb, addr);
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
@@ -2502,6 +3404,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
+        if (lazy_restore.index &&
+            (flags & (RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE))) {
+            error_report("Compressed and XBZRLE pages cannot be restored "
+                         "lazily");
+            ret = -EINVAL;
+            break;
+        }
+
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
@@ -2529,6 +3439,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_use_fixed_ram()) {
+                        ret = fixed_ram_load_block_header(f, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2537,17 +3450,50 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_lazy_restore()) {
+                ret = ram_lazy_restore_init();
+            }
+            if (!ret && migrate_use_fixed_ram()) {
+                if (lazy_restore.index) {
+                    fixed_ram_lazy_restore_index();
+                } else {
+                    ret = fixed_ram_load_pages();
+                }
+                fixed_ram_cleanup();
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
             ch = qemu_get_byte(f);
+            if (lazy_restore.index) {
+                lazy_restore.index[(rb->offset + addr) >> TARGET_PAGE_BITS] =
+                    ch ? -(int64_t)ch - 1 : 0;
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
 
         case RAM_SAVE_FLAG_PAGE:
+            if (lazy_restore.index) {
+                ram_lazy_restore_note_pages(f, rb, addr, 1);
+                break;
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
+        case RAM_SAVE_FLAG_MULTI_PAGE:
+            /* Older destinations don't know the flag either, so a source
+             * must only send it when both sides enabled the capability.
+             */
+            if (!migrate_use_batch_pages()) {
+                error_report("Received a run of pages, but the batch-pages "
+                             "capability is not enabled");
+                ret = -EINVAL;
+                break;
+            }
+            ret = ram_load_page_run(f, addr, host);
+            break;
+
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
             if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
@@ -2594,6 +3540,7 @@ static SaveVMHandlers savevm_ram_handlers = {
     .save_live_iterate = ram_save_iterate,
     .save_live_complete_postcopy = ram_save_complete,
     .save_live_complete_precopy = ram_save_complete,
+    .save_live_complete_background = ram_save_complete,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cleanup = ram_migration_cleanup,
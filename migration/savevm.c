@@ -52,8 +52,11 @@
 #include "block/snapshot.h"
 #include "block/qapi.h"
 #include "qemu/cutils.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
+#include "migration/dirtyrate.h"
 
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
@@ -79,6 +82,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
                                    .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_DEVICE_STATES]    = { .len =  4, .name = "DEVICE_STATES" },
+    [MIG_CMD_DEVICE_DELTA]     = { .len =  8, .name = "DEVICE_DELTA" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -260,17 +265,111 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Section as last sent, when sending device deltas */
+    GByteArray *last_state;
 } SaveStateEntry;
 
 typedef struct SaveState {
     QTAILQ_HEAD(, SaveStateEntry) handlers;
     int global_section_id;
     bool skip_configuration;
+    bool device_delta;
     uint32_t len;
     const char *name;
     uint32_t target_page_bits;
 } SaveState;
 
+/*
+ * Time taken by each section that is saved or loaded with the guest
+ * stopped, which together make up most of the downtime.  The lists are
+ * filled in by the migration or postcopy listen thread while query-migrate
+ * may read them.  Each list only describes the latest downtime: it is reset
+ * whenever a new completion or load starts, so that COLO checkpoints don't
+ * accumulate entries.
+ */
+typedef struct SectionTimes {
+    QemuMutex lock;
+    MigrationSectionTimeList *head;
+    MigrationSectionTimeList **tail;
+} SectionTimes;
+
+static SectionTimes downtime_save, downtime_load;
+
+static void __attribute__((constructor)) section_times_init(void)
+{
+    qemu_mutex_init(&downtime_save.lock);
+    qemu_mutex_init(&downtime_load.lock);
+}
+
+static void section_times_reset(SectionTimes *st)
+{
+    MigrationSectionTimeList *old;
+
+    qemu_mutex_lock(&st->lock);
+    old = st->head;
+    st->head = NULL;
+    st->tail = &st->head;
+    qemu_mutex_unlock(&st->lock);
+
+    qapi_free_MigrationSectionTimeList(old);
+}
+
+static void section_times_append(SectionTimes *st, SaveStateEntry *se,
+                                 int64_t us)
+{
+    MigrationSectionTimeList *entry = g_new0(MigrationSectionTimeList, 1);
+
+    entry->value = g_new0(MigrationSectionTime, 1);
+    entry->value->name = g_strdup(se->idstr);
+    entry->value->instance_id = se->instance_id;
+    entry->value->time = us;
+
+    qemu_mutex_lock(&st->lock);
+    if (!st->tail) {
+        st->tail = &st->head;
+    }
+    *st->tail = entry;
+    st->tail = &entry->next;
+    qemu_mutex_unlock(&st->lock);
+}
+
+/* Record the time since start for se; returns it in microseconds */
+static int64_t section_times_add(SectionTimes *st, SaveStateEntry *se,
+                                 int64_t start)
+{
+    int64_t us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / SCALE_US;
+
+    section_times_append(st, se, us);
+    return us;
+}
+
+static MigrationSectionTimeList *section_times_get(SectionTimes *st)
+{
+    MigrationSectionTimeList *list = NULL;
+
+    qemu_mutex_lock(&st->lock);
+    if (st->head) {
+        list = QAPI_CLONE(MigrationSectionTimeList, st->head);
+    }
+    qemu_mutex_unlock(&st->lock);
+    return list;
+}
+
+void qemu_savevm_downtime_reset(void)
+{
+    section_times_reset(&downtime_save);
+}
+
+MigrationSectionTimeList *qemu_savevm_downtime_save(void)
+{
+    return section_times_get(&downtime_save);
+}
+
+MigrationSectionTimeList *qemu_savevm_downtime_load(void)
+{
+    return section_times_get(&downtime_load);
+}
+
 static SaveState savevm_state = {
     .handlers = QTAILQ_HEAD_INITIALIZER(savevm_state.handlers),
     .global_section_id = 0,
@@ -648,6 +747,9 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
             QTAILQ_REMOVE(&savevm_state.handlers, se, entry);
             g_free(se->compat);
             g_free(se->ops);
+            if (se->last_state) {
+                g_byte_array_unref(se->last_state);
+            }
             g_free(se);
         }
     }
@@ -705,6 +807,9 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
         if (se->vmsd == vmsd && se->opaque == opaque) {
             QTAILQ_REMOVE(&savevm_state.handlers, se, entry);
             g_free(se->compat);
+            if (se->last_state) {
+                g_byte_array_unref(se->last_state);
+            }
             g_free(se);
         }
     }
@@ -787,6 +892,117 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * With the parallel-device-state capability, each run of consecutive
+ * device sections that are independent of each other and of everything
+ * else (see vmstate_is_independent) is saved, and loaded, by up to
+ * device-state-threads threads.  The pre_save, pre_load and post_load hooks
+ * of the sections themselves still run in stream order in the calling
+ * thread.  The run is sent as a DEVICE_STATES command:
+ *
+ *    be32 number of sections (the command data), then for each section
+ *    be32 length, followed by the FULL section with header and footer
+ *
+ * Keeping runs in place keeps the order relative to the other devices the
+ * same as without the capability.
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    LoadStateEntry *le;         /* Loading only */
+    int version_id;             /* Loading only */
+    QEMUFile *file;             /* Buffer holding the section */
+    QIOChannelBuffer *bioc;
+    QJSON *vmdesc;              /* Saving only */
+    int ret;
+    int64_t time;               /* ns */
+} DeviceStateJob;
+
+typedef struct DeviceStateJobs {
+    DeviceStateJob *jobs;
+    int count;
+    int next;                   /* Next job to start, updated atomically */
+    bool save;
+    bool fields_only;           /* The caller runs the top-level hooks */
+    QemuMutex hook_lock;        /* See vmstate_set_hook_lock */
+} DeviceStateJobs;
+
+static bool check_section_footer(QEMUFile *f, LoadStateEntry *le);
+
+static void *device_state_thread(void *opaque)
+{
+    DeviceStateJobs *dsj = opaque;
+    int i;
+
+    vmstate_set_hook_lock(&dsj->hook_lock);
+    while ((i = atomic_fetch_inc(&dsj->next)) < dsj->count) {
+        DeviceStateJob *job = &dsj->jobs[i];
+        SaveStateEntry *se = job->se;
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        if (dsj->save) {
+            trace_vmstate_save(se->idstr, se->vmsd->name);
+            vmstate_save_state_fields(job->file, se->vmsd, se->opaque,
+                                      job->vmdesc);
+        } else if (dsj->fields_only) {
+            trace_vmstate_load(se->idstr, se->vmsd->name);
+            job->ret = vmstate_load_state_fields(job->file, se->vmsd,
+                                                 se->opaque, job->version_id);
+        } else {
+            job->ret = vmstate_load(job->file, se, job->version_id);
+        }
+        if (!dsj->save) {
+            if (job->ret >= 0) {
+                job->ret = qemu_file_get_error(job->file);
+            }
+            if (job->ret >= 0 && !check_section_footer(job->file, job->le)) {
+                job->ret = -EINVAL;
+            }
+        }
+        job->time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    }
+    vmstate_set_hook_lock(NULL);
+
+    return NULL;
+}
+
+static void *device_state_worker(void *opaque)
+{
+    rcu_register_thread();
+    device_state_thread(opaque);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run all the jobs on up to 'threads' threads, including the caller.  The
+ * caller holds the iothread lock throughout, on behalf of all of them.
+ */
+static void device_state_run(DeviceStateJobs *dsj, int threads)
+{
+    QemuThread *thread;
+    int i;
+
+    qemu_mutex_init(&dsj->hook_lock);
+    threads = MIN(threads, dsj->count) - 1;
+    thread = g_new0(QemuThread, MAX(threads, 0));
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(&thread[i], "device_state", device_state_worker,
+                           dsj, QEMU_THREAD_JOINABLE);
+    }
+    device_state_thread(dsj);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_join(&thread[i]);
+    }
+    g_free(thread);
+    qemu_mutex_destroy(&dsj->hook_lock);
+}
+
+static bool savevm_se_independent(SaveStateEntry *se)
+{
+    return se->vmsd && !se->ops && !se->is_ram &&
+           vmstate_is_independent(se->vmsd);
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1092,22 +1308,15 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start, us;
     int ret;
-    bool in_postcopy = migration_in_postcopy(migrate_get_current());
-
-    trace_savevm_state_complete_precopy();
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->save_live_complete_postcopy) ||
-            (in_postcopy && !iterable_only) ||
             !se->ops->save_live_complete_precopy) {
             continue;
         }
@@ -1118,22 +1327,220 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        us = section_times_add(&downtime_save, se, start);
+        trace_savevm_downtime_section(se->idstr, se->instance_id, us);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return -1;
         }
     }
 
-    if (iterable_only) {
+    return 0;
+}
+
+/*
+ * Complete the iterable sections of a background snapshot, called from the
+ * migration thread while the guest runs.  This is not part of the downtime.
+ */
+int qemu_savevm_state_complete_background(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete_precopy) {
+            continue;
+        }
+
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        trace_savevm_section_start(se->idstr, se->section_id);
+
+        save_section_header(f, se, QEMU_VM_SECTION_END);
+
+        if (se->ops->save_live_complete_background) {
+            ret = se->ops->save_live_complete_background(f, se->opaque);
+        } else {
+            qemu_mutex_lock_iothread();
+            ret = se->ops->save_live_complete_precopy(f, se->opaque);
+            qemu_mutex_unlock_iothread();
+        }
+        trace_savevm_section_end(se->idstr, se->section_id, ret);
+        save_section_footer(f, se);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void savevm_save_section_full(QEMUFile *f, SaveStateEntry *se,
+                                     QJSON *vmdesc)
+{
+    int64_t start, us;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    json_start_object(vmdesc, NULL);
+    json_prop_str(vmdesc, "name", se->idstr);
+    json_prop_int(vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(f, se, QEMU_VM_SECTION_FULL);
+    vmstate_save(f, se, vmdesc);
+    trace_savevm_section_end(se->idstr, se->section_id, 0);
+    save_section_footer(f, se);
+    us = section_times_add(&downtime_save, se, start);
+    trace_savevm_downtime_section(se->idstr, se->instance_id, us);
+
+    json_end_object(vmdesc);
+}
+
+/* Save a run of independent sections as a DEVICE_STATES command */
+static void savevm_save_device_states(QEMUFile *f, GPtrArray *run,
+                                      QJSON *vmdesc)
+{
+    DeviceStateJobs dsj = { .save = true };
+    uint32_t tmp;
+    int i;
+
+    if (run->len == 1) {
+        savevm_save_section_full(f, g_ptr_array_index(run, 0), vmdesc);
         return;
     }
 
+    dsj.jobs = g_new0(DeviceStateJob, run->len);
+    dsj.count = run->len;
+    for (i = 0; i < dsj.count; i++) {
+        DeviceStateJob *job = &dsj.jobs[i];
+
+        job->se = g_ptr_array_index(run, i);
+        trace_savevm_section_start(job->se->idstr, job->se->section_id);
+        job->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+        job->file = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        save_section_header(job->file, job->se, QEMU_VM_SECTION_FULL);
+
+        job->vmdesc = qjson_new();
+        json_prop_str(job->vmdesc, "name", job->se->idstr);
+        json_prop_int(job->vmdesc, "instance_id", job->se->instance_id);
+
+        if (job->se->vmsd->pre_save) {
+            job->se->vmsd->pre_save(job->se->opaque);
+        }
+    }
+
+    device_state_run(&dsj, migrate_device_state_threads());
+
+    tmp = cpu_to_be32(dsj.count);
+    trace_savevm_send_device_states(dsj.count);
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATES, 4, (uint8_t *)&tmp);
+
+    for (i = 0; i < dsj.count; i++) {
+        DeviceStateJob *job = &dsj.jobs[i];
+        int64_t us = job->time / SCALE_US;
+
+        save_section_footer(job->file, job->se);
+        qemu_fflush(job->file);
+        trace_savevm_section_end(job->se->idstr, job->se->section_id, 0);
+
+        qemu_put_be32(f, job->bioc->usage);
+        qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+        qemu_fclose(job->file);
+
+        qjson_finish(job->vmdesc);
+        json_prop_raw(vmdesc, NULL, qjson_get_str(job->vmdesc));
+        qjson_destroy(job->vmdesc);
+
+        section_times_append(&downtime_save, job->se, us);
+        trace_savevm_downtime_section(job->se->idstr, job->se->instance_id,
+                                      us);
+    }
+
+    g_free(dsj.jobs);
+}
+
+/*
+ * Save a section as a DEVICE_DELTA command, which only carries the section
+ * if it changed since it was last sent:
+ *      be32   Section id
+ *      be32   Length of the section, 0 if it did not change
+ *  n x byte   QEMU_VM_SECTION_FULL section
+ */
+static void savevm_save_section_delta(QEMUFile *f, SaveStateEntry *se,
+                                      QJSON *vmdesc)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *df;
+    uint32_t tmp[2];
+    bool unchanged;
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-device-delta");
+    df = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    savevm_save_section_full(df, se, vmdesc);
+    qemu_fflush(df);
+
+    unchanged = se->last_state && se->last_state->len == bioc->usage &&
+                !memcmp(se->last_state->data, bioc->data, bioc->usage);
+    trace_savevm_send_device_delta(se->idstr, se->instance_id, unchanged);
+
+    tmp[0] = cpu_to_be32(se->section_id);
+    tmp[1] = cpu_to_be32(unchanged ? 0 : bioc->usage);
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_DELTA, 8, (uint8_t *)tmp);
+    if (!unchanged) {
+        qemu_put_buffer(f, bioc->data, bioc->usage);
+        if (!se->last_state) {
+            se->last_state = g_byte_array_new();
+        }
+        g_byte_array_set_size(se->last_state, 0);
+        g_byte_array_append(se->last_state, bioc->data, bioc->usage);
+    }
+    qemu_fclose(df);
+}
+
+/*
+ * Used by COLO, which sends the state of all devices at every checkpoint:
+ * with @enable set, devices whose state did not change since the previous
+ * checkpoint are sent as a reference to the copy the destination already
+ * has.  Either way, the copies kept from earlier checkpoints are dropped.
+ */
+void qemu_savevm_set_device_delta(bool enable)
+{
+    SaveStateEntry *se;
+
+    savevm_state.device_delta = enable;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->last_state) {
+            g_byte_array_unref(se->last_state);
+            se->last_state = NULL;
+        }
+    }
+}
+
+void qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                     bool in_postcopy)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    GPtrArray *run = g_ptr_array_new();
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1147,19 +1554,25 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
             continue;
         }
 
-        trace_savevm_section_start(se->idstr, se->section_id);
-
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
-
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        vmstate_save(f, se, vmdesc);
-        trace_savevm_section_end(se->idstr, se->section_id, 0);
-        save_section_footer(f, se);
+        if (savevm_state.device_delta) {
+            savevm_save_section_delta(f, se, vmdesc);
+            continue;
+        }
+        if (migrate_parallel_device_state() && savevm_se_independent(se)) {
+            g_ptr_array_add(run, se);
+            continue;
+        }
+        if (run->len) {
+            savevm_save_device_states(f, run, vmdesc);
+            g_ptr_array_set_size(run, 0);
+        }
 
-        json_end_object(vmdesc);
+        savevm_save_section_full(f, se, vmdesc);
     }
+    if (run->len) {
+        savevm_save_device_states(f, run, vmdesc);
+    }
+    g_ptr_array_free(run, true);
 
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
@@ -1180,6 +1593,36 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
     qemu_fflush(f);
 }
 
+void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
+{
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
+    trace_savevm_state_complete_precopy();
+
+    /* When switching to postcopy the non-iterable sections are saved by a
+     * second call, which belongs to the same downtime.
+     */
+    if (!in_postcopy || iterable_only) {
+        section_times_reset(&downtime_save);
+    }
+
+    cpu_synchronize_all_states();
+
+    /* In postcopy the iterable sections are only completed here when
+     * iterable_only is set; otherwise they carry on in the background.
+     */
+    if ((!in_postcopy || iterable_only) &&
+        qemu_savevm_state_complete_precopy_iterable(f, in_postcopy)) {
+        return;
+    }
+
+    if (iterable_only) {
+        return;
+    }
+
+    qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy);
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1235,6 +1678,12 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         ret = -EINVAL;
         goto done;
     }
+    /* Saving RAM consumes the migration dirty bitmap */
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty page rate measurement is in progress");
+        ret = -EINVAL;
+        goto done;
+    }
 
     qemu_mutex_unlock_iothread();
     qemu_savevm_state_header(f);
@@ -1324,7 +1773,10 @@ enum LoadVMExitCodes {
     LOADVM_QUIT     =  1,
 };
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
+static int loadvm_handle_cmd_device_states(QEMUFile *f,
+                                           MigrationIncomingState *mis);
+static int loadvm_handle_cmd_device_delta(QEMUFile *f,
+                                          MigrationIncomingState *mis);
 
 /* ------ incoming postcopy messages ------ */
 /* 'advise' arrives before any transfers just to tell us that a postcopy
@@ -1740,6 +2192,12 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_PACKAGED:
         return loadvm_handle_cmd_packaged(mis);
 
+    case MIG_CMD_DEVICE_STATES:
+        return loadvm_handle_cmd_device_states(f, mis);
+
+    case MIG_CMD_DEVICE_DELTA:
+        return loadvm_handle_cmd_device_delta(f, mis);
+
     case MIG_CMD_POSTCOPY_ADVISE:
         return loadvm_postcopy_handle_advise(mis);
 
@@ -1808,14 +2266,17 @@ void loadvm_free_handlers(MigrationIncomingState *mis)
     }
 }
 
+/*
+ * Read the header of a START or FULL section and set up its LoadStateEntry
+ */
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_header(QEMUFile *f, MigrationIncomingState *mis,
+                           LoadStateEntry **lep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     LoadStateEntry *le;
     char idstr[256];
-    int ret;
 
     /* Read section start */
     section_id = qemu_get_be32(f);
@@ -1858,24 +2319,50 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     le->version_id = version_id;
     QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
 
-    ret = vmstate_load(f, le->se, le->version_id);
+    *lep = le;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t section_type)
+{
+    SaveStateEntry *se;
+    LoadStateEntry *le;
+    int64_t start, us;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, mis, &le);
+    if (ret < 0) {
+        return ret;
+    }
+    se = le->se;
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = vmstate_load(f, se, le->version_id);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    if (section_type == QEMU_VM_SECTION_FULL) {
+        us = section_times_add(&downtime_load, se, start);
+        trace_loadvm_downtime_section(se->idstr, se->instance_id, us);
+    }
 
     return 0;
 }
 
 static int
-qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis,
+                             uint8_t section_type)
 {
     uint32_t section_id;
     LoadStateEntry *le;
+    int64_t start, us;
     int ret;
 
     section_id = qemu_get_be32(f);
@@ -1891,6 +2378,7 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, le->se, le->version_id);
     if (ret < 0) {
         error_report("error while loading state section id %d(%s)",
@@ -1900,11 +2388,202 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    if (section_type == QEMU_VM_SECTION_END) {
+        us = section_times_add(&downtime_load, le->se, start);
+        trace_loadvm_downtime_section(le->se->idstr, le->se->instance_id, us);
+    }
 
     return 0;
 }
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * A run of independent device sections saved by savevm_save_device_states;
+ * they are loaded with device-state-threads threads, unless one of them is
+ * not independent on this side.  In that case the sections are loaded one
+ * after the other, hooks included, as if they had been sent one by one.
+ */
+static int loadvm_handle_cmd_device_states(QEMUFile *f,
+                                           MigrationIncomingState *mis)
+{
+    DeviceStateJobs dsj = { .save = false };
+    uint32_t count, sections = 0;
+    SaveStateEntry *se;
+    int threads = migrate_device_state_threads();
+    int i, ret = 0;
+
+    count = qemu_get_be32(f);
+    trace_loadvm_handle_cmd_device_states(count);
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        sections++;
+    }
+    if (count > sections) {
+        error_report("CMD_DEVICE_STATES: %u sections, only %u exist",
+                     count, sections);
+        return -EINVAL;
+    }
+
+    dsj.jobs = g_new0(DeviceStateJob, count);
+    for (i = 0; i < count; i++) {
+        DeviceStateJob *job = &dsj.jobs[i];
+        uint32_t length = qemu_get_be32(f);
+
+        if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+            error_report("CMD_DEVICE_STATES: Unreasonably large section: %u",
+                         length);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        job->bioc = qio_channel_buffer_new(length);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+        job->file = qemu_fopen_channel_input(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        if (qemu_get_buffer(f, job->bioc->data, length) != length) {
+            error_report("CMD_DEVICE_STATES: Buffer receive fail length=%u",
+                         length);
+            ret = -EIO;
+            goto out;
+        }
+        job->bioc->usage = length;
+
+        if (qemu_get_byte(job->file) != QEMU_VM_SECTION_FULL) {
+            error_report("CMD_DEVICE_STATES: Section %d is not a full section",
+                         i);
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = qemu_loadvm_section_header(job->file, mis, &job->le);
+        if (ret < 0) {
+            goto out;
+        }
+        job->se = job->le->se;
+        job->version_id = job->le->version_id;
+        if (!savevm_se_independent(job->se)) {
+            threads = 1;
+        }
+    }
+
+    dsj.count = count;
+    dsj.fields_only = threads > 1;
+    for (i = 0; dsj.fields_only && i < count; i++) {
+        SaveStateEntry *se = dsj.jobs[i].se;
+
+        if (se->vmsd->pre_load) {
+            ret = se->vmsd->pre_load(se->opaque);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+    }
+
+    device_state_run(&dsj, threads);
+
+    for (i = 0; i < count; i++) {
+        DeviceStateJob *job = &dsj.jobs[i];
+        int64_t us = job->time / SCALE_US;
+
+        if (job->ret >= 0 && dsj.fields_only && job->se->vmsd->post_load) {
+            job->ret = job->se->vmsd->post_load(job->se->opaque,
+                                                job->version_id);
+        }
+        if (job->ret < 0) {
+            error_report("error while loading state for instance 0x%x of"
+                         " device '%s'", job->se->instance_id,
+                         job->se->idstr);
+            ret = job->ret;
+            goto out;
+        }
+        section_times_append(&downtime_load, job->se, us);
+        trace_loadvm_downtime_section(job->se->idstr, job->se->instance_id,
+                                      us);
+    }
+
+out:
+    for (i = 0; i < count; i++) {
+        if (dsj.jobs[i].file) {
+            qemu_fclose(dsj.jobs[i].file);
+        }
+    }
+    g_free(dsj.jobs);
+    return ret;
+}
+
+/*
+ * A section saved by savevm_save_section_delta; a copy of it is kept to be
+ * loaded again when the source reports it as unchanged.
+ */
+static int loadvm_handle_cmd_device_delta(QEMUFile *f,
+                                          MigrationIncomingState *mis)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *sf;
+    GByteArray *state;
+    uint32_t section_id, length;
+    int ret;
+
+    section_id = qemu_get_be32(f);
+    length = qemu_get_be32(f);
+    trace_loadvm_handle_cmd_device_delta(section_id, length);
+
+    if (!mis->device_delta) {
+        mis->device_delta = g_hash_table_new_full(NULL, NULL, NULL,
+                                            (GDestroyNotify)g_byte_array_unref);
+    }
+
+    if (length) {
+        if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+            error_report("CMD_DEVICE_DELTA: Unreasonably large section: %u",
+                         length);
+            return -EINVAL;
+        }
+        state = g_byte_array_sized_new(length);
+        g_byte_array_set_size(state, length);
+        if (qemu_get_buffer(f, state->data, length) != length) {
+            error_report("CMD_DEVICE_DELTA: Buffer receive fail length=%u",
+                         length);
+            g_byte_array_unref(state);
+            return -EIO;
+        }
+        g_hash_table_insert(mis->device_delta, GUINT_TO_POINTER(section_id),
+                            state);
+    } else {
+        state = g_hash_table_lookup(mis->device_delta,
+                                    GUINT_TO_POINTER(section_id));
+        if (!state) {
+            error_report("CMD_DEVICE_DELTA: No earlier state for section %u",
+                         section_id);
+            return -EINVAL;
+        }
+    }
+
+    bioc = qio_channel_buffer_new(state->len);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-device-delta");
+    memcpy(bioc->data, state->data, state->len);
+    bioc->usage = state->len;
+    sf = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    if (qemu_get_byte(sf) != QEMU_VM_SECTION_FULL) {
+        error_report("CMD_DEVICE_DELTA: Section %u is not a full section",
+                     section_id);
+        ret = -EINVAL;
+    } else {
+        ret = qemu_loadvm_section_start_full(sf, mis, QEMU_VM_SECTION_FULL);
+    }
+    qemu_fclose(sf);
+    return ret;
+}
+
+void loadvm_free_device_delta(MigrationIncomingState *mis)
+{
+    if (mis->device_delta) {
+        g_hash_table_destroy(mis->device_delta);
+        mis->device_delta = NULL;
+    }
+}
+
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint8_t section_type;
     int ret = 0;
@@ -1915,14 +2594,14 @@ static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
-            ret = qemu_loadvm_section_part_end(f, mis);
+            ret = qemu_loadvm_section_part_end(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
@@ -1960,6 +2639,8 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    section_times_reset(&downtime_load);
+
     v = qemu_get_be32(f);
     if (v != QEMU_VM_FILE_MAGIC) {
         error_report("Not a migration stream");
@@ -4,6 +4,7 @@
 #include "migration/qemu-file.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/queue.h"
 #include "trace.h"
@@ -77,8 +78,184 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
-int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
-                       void *opaque, int version_id)
+/*
+ * Arrays of plain integers are transferred as a single buffer instead of
+ * element by element; this gives the element size for fields where that is
+ * possible, 0 otherwise.  The data is big endian on the wire either way.
+ */
+static int vmstate_bulk_width(VMStateField *field, int size)
+{
+    const VMStateInfo *info = field->info;
+    int width;
+
+    if (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER)) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+
+    return size == width ? width : 0;
+}
+
+#ifndef HOST_WORDS_BIGENDIAN
+static void vmstate_bulk_swap(uint8_t *dst, const uint8_t *src, int width,
+                              int n_elems)
+{
+    int i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < n_elems; i++) {
+            stw_he_p(dst + i * 2, bswap16(lduw_he_p(src + i * 2)));
+        }
+        break;
+    case 4:
+        for (i = 0; i < n_elems; i++) {
+            stl_he_p(dst + i * 4, bswap32(ldl_he_p(src + i * 4)));
+        }
+        break;
+    case 8:
+        for (i = 0; i < n_elems; i++) {
+            stq_he_p(dst + i * 8, bswap64(ldq_he_p(src + i * 8)));
+        }
+        break;
+    default:
+        memcpy(dst, src, width * n_elems);
+        break;
+    }
+}
+#endif
+
+static void vmstate_get_bulk(QEMUFile *f, void *base_addr, int width,
+                             int n_elems)
+{
+    size_t len = (size_t)width * n_elems;
+
+    if (qemu_get_buffer(f, base_addr, len) != len) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+#ifndef HOST_WORDS_BIGENDIAN
+    vmstate_bulk_swap(base_addr, base_addr, width, n_elems);
+#endif
+}
+
+static void vmstate_put_bulk(QEMUFile *f, void *base_addr, int width,
+                             int n_elems)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    if (width > 1) {
+        uint8_t buf[1024];
+        int per_buf = sizeof(buf) / width;
+        uint8_t *p = base_addr;
+
+        while (n_elems) {
+            int n = MIN(n_elems, per_buf);
+
+            vmstate_bulk_swap(buf, p, width, n);
+            qemu_put_buffer(f, buf, n * width);
+            p += n * width;
+            n_elems -= n;
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, base_addr, (size_t)width * n_elems);
+}
+
+/*
+ * Set in each thread that saves or loads sections in parallel.  Plain data
+ * fields only touch the device they belong to, but hooks and other
+ * VMStateInfos may reach into other devices, so they run one at a time.
+ */
+static __thread QemuMutex *vmstate_hook_lock;
+static __thread int vmstate_hook_depth;
+
+void vmstate_set_hook_lock(QemuMutex *lock)
+{
+    assert(!vmstate_hook_depth);
+    vmstate_hook_lock = lock;
+}
+
+static void vmstate_hook_enter(void)
+{
+    if (vmstate_hook_lock && vmstate_hook_depth++ == 0) {
+        qemu_mutex_lock(vmstate_hook_lock);
+    }
+}
+
+static void vmstate_hook_exit(void)
+{
+    if (vmstate_hook_lock && --vmstate_hook_depth == 0) {
+        qemu_mutex_unlock(vmstate_hook_lock);
+    }
+}
+
+/* Whether @info only moves data between the stream and the field */
+static bool vmstate_info_is_plain(const VMStateInfo *info)
+{
+    static const VMStateInfo *const infos[] = {
+        &vmstate_info_bool, &vmstate_info_int8, &vmstate_info_int16,
+        &vmstate_info_int32, &vmstate_info_int32_equal, &vmstate_info_int32_le,
+        &vmstate_info_int64, &vmstate_info_uint8, &vmstate_info_uint16,
+        &vmstate_info_uint32, &vmstate_info_uint32_equal, &vmstate_info_uint64,
+        &vmstate_info_uint64_equal, &vmstate_info_uint8_equal,
+        &vmstate_info_uint16_equal, &vmstate_info_float64,
+        &vmstate_info_cpudouble, &vmstate_info_buffer,
+        &vmstate_info_unused_buffer, &vmstate_info_bitmap,
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(infos); i++) {
+        if (info == infos[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int vmstate_info_get(QEMUFile *f, VMStateField *field, void *addr,
+                            int size)
+{
+    int ret;
+
+    if (!vmstate_hook_lock || vmstate_info_is_plain(field->info)) {
+        return field->info->get(f, addr, size, field);
+    }
+    vmstate_hook_enter();
+    ret = field->info->get(f, addr, size, field);
+    vmstate_hook_exit();
+    return ret;
+}
+
+static void vmstate_info_put(QEMUFile *f, VMStateField *field, void *addr,
+                             int size, QJSON *vmdesc)
+{
+    if (!vmstate_hook_lock || vmstate_info_is_plain(field->info)) {
+        field->info->put(f, addr, size, field, vmdesc);
+        return;
+    }
+    vmstate_hook_enter();
+    field->info->put(f, addr, size, field, vmdesc);
+    vmstate_hook_exit();
+}
+
+/*
+ * With @hooks false, the pre_load and post_load hooks of @vmsd itself are
+ * left to the caller; those of nested descriptions still run.
+ */
+static int vmstate_do_load_state(QEMUFile *f, const VMStateDescription *vmsd,
+                                 void *opaque, int version_id, bool hooks)
 {
     VMStateField *field = vmsd->fields;
     int ret = 0;
@@ -104,8 +281,10 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         trace_vmstate_load_state_end(vmsd->name, "too old", -EINVAL);
         return -EINVAL;
     }
-    if (vmsd->pre_load) {
-        int ret = vmsd->pre_load(opaque);
+    if (hooks && vmsd->pre_load) {
+        vmstate_hook_enter();
+        ret = vmsd->pre_load(opaque);
+        vmstate_hook_exit();
         if (ret) {
             return ret;
         }
@@ -119,7 +298,19 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *base_addr = vmstate_base_addr(opaque, field, true);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int width = n_elems > 1 ? vmstate_bulk_width(field, size) : 0;
 
+            if (width) {
+                vmstate_get_bulk(f, base_addr, width, n_elems);
+                ret = qemu_file_get_error(f);
+                if (ret < 0) {
+                    error_report("Failed to load %s:%s", vmsd->name,
+                                 field->name);
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -130,7 +321,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                     ret = vmstate_load_state(f, field->vmsd, addr,
                                              field->vmsd->version_id);
                 } else {
-                   ret = field->info->get(f, addr, size, field);
+                    ret = vmstate_info_get(f, field, addr, size);
                 }
                 if (ret >= 0) {
                     ret = qemu_file_get_error(f);
@@ -154,13 +345,27 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
     if (ret != 0) {
         return ret;
     }
-    if (vmsd->post_load) {
+    if (hooks && vmsd->post_load) {
+        vmstate_hook_enter();
         ret = vmsd->post_load(opaque, version_id);
+        vmstate_hook_exit();
     }
     trace_vmstate_load_state_end(vmsd->name, "end", ret);
     return ret;
 }
 
+int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
+                       void *opaque, int version_id)
+{
+    return vmstate_do_load_state(f, vmsd, opaque, version_id, true);
+}
+
+int vmstate_load_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, int version_id)
+{
+    return vmstate_do_load_state(f, vmsd, opaque, version_id, false);
+}
+
 static int vmfield_name_num(VMStateField *start, VMStateField *search)
 {
     VMStateField *field;
@@ -291,6 +496,41 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
 }
 
 
+/*
+ * Whether a device's section can be saved and loaded concurrently with other
+ * devices' sections.  This is about state shared with other devices, not
+ * about hooks: plain fields only touch the device itself, the hooks of the
+ * section run in stream order in the thread that drives the parallel save
+ * or load, and nested hooks and VMStateInfos that may look at other devices
+ * run one at a time (see vmstate_set_hook_lock).  The only thing that
+ * cannot be handled like that is load_state_old, which parses a format the
+ * description doesn't cover.
+ */
+bool vmstate_is_independent(const VMStateDescription *vmsd)
+{
+    const VMStateDescription **sub;
+    VMStateField *field;
+
+    if (vmsd->load_state_old) {
+        return false;
+    }
+
+    for (field = vmsd->fields; field->name; field++) {
+        if ((field->flags & VMS_STRUCT) &&
+            !vmstate_is_independent(field->vmsd)) {
+            return false;
+        }
+    }
+
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        if (!vmstate_is_independent(*sub)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 {
     if (vmsd->needed && !vmsd->needed(opaque)) {
@@ -301,15 +541,18 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 }
 
 
-void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
-                        void *opaque, QJSON *vmdesc)
+/* With @hooks false, the pre_save hook of @vmsd itself is left to the caller */
+static void vmstate_do_save_state(QEMUFile *f, const VMStateDescription *vmsd,
+                                  void *opaque, QJSON *vmdesc, bool hooks)
 {
     VMStateField *field = vmsd->fields;
 
     trace_vmstate_save_state_top(vmsd->name);
 
-    if (vmsd->pre_save) {
+    if (hooks && vmsd->pre_save) {
+        vmstate_hook_enter();
         vmsd->pre_save(opaque);
+        vmstate_hook_exit();
     }
 
     if (vmdesc) {
@@ -326,8 +569,16 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             int size = vmstate_size(opaque, field);
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
+            int width = n_elems > 1 ? vmstate_bulk_width(field, size) : 0;
 
             trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
+            if (width && (!vmdesc || vmsd_can_compress(field))) {
+                /* Described like any compressed array: by its first element */
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmstate_put_bulk(f, base_addr, width, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, width, 0);
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -340,7 +591,7 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                 if (field->flags & VMS_STRUCT) {
                     vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
                 } else {
-                    field->info->put(f, addr, size, field, vmdesc_loop);
+                    vmstate_info_put(f, field, addr, size, vmdesc_loop);
                 }
 
                 written_bytes = qemu_ftell_fast(f) - old_offset;
@@ -368,6 +619,18 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
     vmstate_subsection_save(f, vmsd, opaque, vmdesc);
 }
 
+void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
+                        void *opaque, QJSON *vmdesc)
+{
+    vmstate_do_save_state(f, vmsd, opaque, vmdesc, true);
+}
+
+void vmstate_save_state_fields(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, QJSON *vmdesc)
+{
+    vmstate_do_save_state(f, vmsd, opaque, vmdesc, false);
+}
+
 static const VMStateDescription *
 vmstate_get_subsection(const VMStateDescription **sub, char *idstr)
 {
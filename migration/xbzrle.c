@@ -12,8 +12,195 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+/*
+ * Run detection helpers.  Each returns the index of the first byte at or
+ * after @i where old_buf and new_buf stop being equal (find_zrun_end) or
+ * stop being different (find_nzrun_end), or @slen if the run extends to
+ * the end of the buffer.
+ */
+static int find_zrun_end_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (((uintptr_t)(new_buf + i) % sizeof(long)) && i < slen &&
+           old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + (int)sizeof(long) <= slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (((uintptr_t)(new_buf + i) % sizeof(long)) && i < slen &&
+           old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i + (int)sizeof(long) <= slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Compare 16 bytes at a time; the movemask has one bit per equal byte.  */
+static int find_zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xFFFF) {
+            return i + ctz32(~eq);
+        }
+        i += 16;
+    }
+    return find_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int find_nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 16;
+    }
+    return find_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int find_zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xFFFFFFFFu) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+    return find_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int find_nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    return find_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+#endif /* CONFIG_AVX2_OPT || __SSE2__ */
+
+typedef int (*xbzrle_run_fn)(const uint8_t *, const uint8_t *, int, int);
+
+#if defined(__SSE2__) && !defined(CONFIG_AVX2_OPT)
+# define INIT_ZRUN  find_zrun_end_sse2
+# define INIT_NZRUN find_nzrun_end_sse2
+#else
+# define INIT_ZRUN  find_zrun_end_int
+# define INIT_NZRUN find_nzrun_end_int
+#endif
+
+static xbzrle_run_fn find_zrun_end = INIT_ZRUN;
+static xbzrle_run_fn find_nzrun_end = INIT_NZRUN;
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max < 1) {
+        return;
+    }
+    __cpuid(1, a, b, c, d);
+    if (d & bit_SSE2) {
+        find_zrun_end = find_zrun_end_sse2;
+        find_nzrun_end = find_nzrun_end_sse2;
+    }
+
+    /* We must check that AVX is not just available, but usable.  */
+    if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+        int bv;
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((bv & 6) == 6 && (b & bit_AVX2)) {
+            find_zrun_end = find_zrun_end_avx2;
+            find_nzrun_end = find_nzrun_end_avx2;
+        }
+    }
+}
+#endif /* CONFIG_AVX2_OPT */
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,10 +214,8 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +226,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = find_zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +242,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = find_nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;
@@ -36,6 +36,7 @@
 
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
+#define MAX_COMPARE_THREADS 64
 
 /* TODO: Should be configurable */
 #define REGULAR_PACKET_CHECK_MS 3000
@@ -62,7 +63,50 @@
                     |packet  |  |packet  +    |packet  | |packet  +
                     +--------+  +--------+    +--------+ +--------+
 */
-typedef struct CompareState {
+typedef struct CompareState CompareState;
+
+/*
+ * Connections are spread over the compare workers by the hash of their key.
+ * A worker owns the connections of its shard, so that the packets of a
+ * connection are always compared in order and by the same thread.
+ */
+typedef struct CompareWorker {
+    CompareState *s;
+    QemuThread thread;
+
+    /* Packets handed over by the compare thread, protected by lock */
+    QemuMutex lock;
+    QemuCond cond;
+    GQueue pri_in;
+    GQueue sec_in;
+    bool quit;
+
+    /*
+     * Protects everything below against the old packet check and the
+     * statistics getter, which run in the main thread
+     */
+    QemuMutex conn_lock;
+    /* connection list: the connections of this worker could be found
+     * in this list.
+     * element type: Connection
+     */
+    GQueue conn_list;
+    /* hashtable to save connection */
+    GHashTable *connection_track_table;
+
+    /* Statistics, see ColoCompareStats */
+    int64_t packets;
+    int64_t segmented;
+    int64_t latency_total;
+    int64_t latency_max;
+    int64_t mismatch_size;
+    int64_t mismatch_payload;
+    int64_t mismatch_header;
+    int64_t old_packets;
+    int64_t dropped;
+} CompareWorker;
+
+struct CompareState {
     Object parent;
 
     char *pri_indev;
@@ -74,19 +118,18 @@ typedef struct CompareState {
     SocketReadState pri_rs;
     SocketReadState sec_rs;
 
-    /* connection list: the connections belonged to this NIC could be found
-     * in this list.
-     * element type: Connection
-     */
-    GQueue conn_list;
-    /* hashtable to save connection */
-    GHashTable *connection_track_table;
-    /* compare thread, a thread for each NIC */
+    /* compare workers */
+    uint32_t threads;
+    CompareWorker *workers;
+    /* Keeps the length and data of packets sent to outdev together */
+    QemuMutex out_lock;
+    /* compare thread, a thread for each NIC, that reads the packets in */
     QemuThread thread;
+    GMainContext *worker_context;
+    GMainLoop *compare_loop;
     /* Timer used on the primary to find packets that are never matched */
     QEMUTimer *timer;
-    QemuMutex timer_check_lock;
-} CompareState;
+};
 
 typedef struct CompareClass {
     ObjectClass parent_class;
@@ -97,11 +140,14 @@ enum {
     SECONDARY_IN,
 };
 
-static int compare_chr_send(CharBackend *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size);
+static void colo_compare_connection(CompareWorker *w, Connection *conn);
 
 /*
+ * Called from the compare thread on the primary: hand the packet over to
+ * the worker that owns its connection.
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
@@ -109,7 +155,7 @@ static int packet_enqueue(CompareState *s, int mode)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
-    Connection *conn;
+    CompareWorker *w;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf, s->pri_rs.packet_len);
@@ -122,14 +168,34 @@ static int packet_enqueue(CompareState *s, int mode)
         pkt = NULL;
         return -1;
     }
+    fill_connection_key(pkt, &key);
+    w = &s->workers[connection_key_hash(&key) % s->threads];
+
+    qemu_mutex_lock(&w->lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &w->pri_in : &w->sec_in, pkt);
+    qemu_cond_signal(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/*
+ * Called from a compare worker with conn_lock held: queue the packet on
+ * its connection and compare that connection.
+ */
+static void packet_enqueue_conn(CompareWorker *w, Packet *pkt, int mode)
+{
+    ConnectionKey key;
+    Connection *conn;
+
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(w->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &w->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&w->conn_list, conn);
         conn->processing = true;
     }
 
@@ -140,6 +206,9 @@ static int packet_enqueue(CompareState *s, int mode)
         } else {
             error_report("colo compare primary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
+            w->dropped++;
+            return;
         }
     } else {
         if (g_queue_get_length(&conn->secondary_list) <=
@@ -148,10 +217,13 @@ static int packet_enqueue(CompareState *s, int mode)
         } else {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
+            w->dropped++;
+            return;
         }
     }
 
-    return 0;
+    colo_compare_connection(w, conn);
 }
 
 /*
@@ -186,6 +258,10 @@ static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
     int res;
 
     trace_colo_compare_main("compare tcp");
+    if (spkt->tcp_matched) {
+        /* Already partly matched by colo_compare_tcp_payload */
+        return -1;
+    }
     if (ppkt->size != spkt->size) {
         if (trace_event_get_state(TRACE_COLO_COMPARE_MISCOMPARE)) {
             trace_colo_compare_main("pkt size not same");
@@ -300,6 +376,98 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
     return colo_packet_compare(ppkt, spkt);
 }
 
+/*
+ * Return the length of the TCP payload of @pkt and point @payload at it,
+ * or return -1 if the packet is malformed
+ */
+static int colo_tcp_payload(Packet *pkt, uint8_t **payload)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint8_t *end = pkt->network_header + ntohs(pkt->ip->ip_len);
+
+    if (pkt->transport_header + sizeof(*tcp) > (uint8_t *)pkt->data +
+        pkt->size || end > (uint8_t *)pkt->data + pkt->size) {
+        return -1;
+    }
+    *payload = pkt->transport_header + tcp->th_off * 4;
+    if (*payload > end) {
+        return -1;
+    }
+    return end - *payload;
+}
+
+/*
+ * A packet at the head of the primary queue that does not match is compared
+ * again on every pass until it matches or is released as old, so only count
+ * it the first time.
+ */
+static void colo_count_mismatch(Packet *pkt, int64_t *counter)
+{
+    if (!pkt->mismatched) {
+        pkt->mismatched = true;
+        (*counter)++;
+    }
+}
+
+/*
+ * Called from a compare worker on the primary when no secondary packet is
+ * the same as @ppkt: compare the TCP payload of @ppkt with that of the
+ * packets at the head of the secondary queue, whatever the way either side
+ * split it into segments.  Secondary packets are dropped once all of their
+ * payload is matched.
+ * return:    1 means all of @ppkt matched
+ *            0 means the secondary has not sent enough yet
+ *           -1 means packet different
+ */
+static int colo_compare_tcp_payload(CompareWorker *w, Connection *conn,
+                                    Packet *ppkt)
+{
+    struct tcphdr *ptcp = (struct tcphdr *)ppkt->transport_header;
+    uint8_t *pdata, *sdata;
+    int plen, slen, len;
+
+    plen = colo_tcp_payload(ppkt, &pdata);
+    if (plen <= 0 || ptcp->th_flags & (TH_SYN | TH_RST)) {
+        colo_count_mismatch(ppkt, &w->mismatch_header);
+        return -1;
+    }
+
+    while (ppkt->tcp_matched < plen) {
+        Packet *spkt = g_queue_peek_head(&conn->secondary_list);
+        struct tcphdr *stcp;
+
+        if (!spkt) {
+            return 0;
+        }
+        stcp = (struct tcphdr *)spkt->transport_header;
+        slen = colo_tcp_payload(spkt, &sdata);
+        if (slen <= 0 || stcp->th_flags & (TH_SYN | TH_RST)) {
+            colo_count_mismatch(ppkt, &w->mismatch_header);
+            return -1;
+        }
+
+        len = MIN(plen - ppkt->tcp_matched, slen - spkt->tcp_matched);
+        if (memcmp(pdata + ppkt->tcp_matched, sdata + spkt->tcp_matched,
+                   len)) {
+            trace_colo_compare_tcp_payload_miscompare(ntohl(ptcp->th_seq),
+                                                      ppkt->tcp_matched,
+                                                      ntohl(stcp->th_seq),
+                                                      spkt->tcp_matched);
+            colo_count_mismatch(ppkt, &w->mismatch_payload);
+            return -1;
+        }
+        ppkt->tcp_matched += len;
+        spkt->tcp_matched += len;
+
+        if (spkt->tcp_matched == slen) {
+            g_queue_pop_head(&conn->secondary_list);
+            packet_destroy(spkt, NULL);
+        }
+    }
+
+    return 1;
+}
+
 static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
 {
     int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
@@ -315,6 +483,7 @@ static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
 static void colo_old_packet_check_one_conn(void *opaque,
                                            void *user_data)
 {
+    CompareWorker *w = user_data;
     Connection *conn = opaque;
     GList *result = NULL;
     int64_t check_time = REGULAR_PACKET_CHECK_MS;
@@ -324,6 +493,7 @@ static void colo_old_packet_check_one_conn(void *opaque,
                                  (GCompareFunc)colo_old_packet_check_one);
 
     if (result) {
+        w->old_packets++;
         /* do checkpoint will flush old packet */
         /* TODO: colo_notify_checkpoint();*/
     }
@@ -337,31 +507,61 @@ static void colo_old_packet_check_one_conn(void *opaque,
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
+    int i;
 
-    g_queue_foreach(&s->conn_list, colo_old_packet_check_one_conn, NULL);
+    for (i = 0; i < s->threads; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        /* A busy worker is releasing packets, try again next time */
+        if (qemu_mutex_trylock(&w->conn_lock)) {
+            continue;
+        }
+        g_queue_foreach(&w->conn_list, colo_old_packet_check_one_conn, w);
+        qemu_mutex_unlock(&w->conn_lock);
+    }
 }
 
 /*
- * Called from the compare thread on the primary
+ * Called from a compare worker on the primary once the packet at the
+ * head of the primary queue has been matched
+ */
+static void colo_release_primary_packet(CompareWorker *w, Connection *conn)
+{
+    Packet *pkt = g_queue_pop_head(&conn->primary_list);
+    int64_t latency = qemu_clock_get_us(QEMU_CLOCK_HOST) - pkt->creation_us;
+    int ret;
+
+    ret = compare_chr_send(w->s, pkt->data, pkt->size);
+    if (ret < 0) {
+        error_report("colo_send_primary_packet failed");
+    }
+    trace_colo_compare_main("packet same and release packet");
+
+    w->packets++;
+    w->latency_total += latency;
+    w->latency_max = MAX(w->latency_max, latency);
+    packet_destroy(pkt, NULL);
+}
+
+/*
+ * Called from a compare worker on the primary
  * for compare connection
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareWorker *w, Connection *conn)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
-    Packet *pkt = NULL;
+    Packet *pkt = NULL, *spkt;
     GList *result = NULL;
-    int ret;
 
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
-        qemu_mutex_lock(&s->timer_check_lock);
-        pkt = g_queue_pop_tail(&conn->primary_list);
-        qemu_mutex_unlock(&s->timer_check_lock);
+        pkt = g_queue_peek_head(&conn->primary_list);
+        result = NULL;
         switch (conn->ip_proto) {
         case IPPROTO_TCP:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_tcp);
+            if (!pkt->tcp_matched) {
+                result = g_queue_find_custom(&conn->secondary_list,
+                         pkt, (GCompareFunc)colo_packet_compare_tcp);
+            }
             break;
         case IPPROTO_UDP:
             result = g_queue_find_custom(&conn->secondary_list,
@@ -378,30 +578,41 @@ static void colo_compare_connection(void *opaque, void *user_data)
         }
 
         if (result) {
-            ret = compare_chr_send(&s->chr_out, pkt->data, pkt->size);
-            if (ret < 0) {
-                error_report("colo_send_primary_packet failed");
+            spkt = result->data;
+            g_queue_remove(&conn->secondary_list, spkt);
+            packet_destroy(spkt, NULL);
+            colo_release_primary_packet(w, conn);
+            continue;
+        }
+
+        if (conn->ip_proto == IPPROTO_TCP) {
+            switch (colo_compare_tcp_payload(w, conn, pkt)) {
+            case 1:
+                w->segmented++;
+                colo_release_primary_packet(w, conn);
+                continue;
+            case 0:
+                /* The rest of the payload has not arrived yet */
+                return;
             }
-            trace_colo_compare_main("packet same and release packet");
-            g_queue_remove(&conn->secondary_list, result->data);
-            packet_destroy(pkt, NULL);
         } else {
-            /*
-             * If one packet arrive late, the secondary_list or
-             * primary_list will be empty, so we can't compare it
-             * until next comparison.
-             */
-            trace_colo_compare_main("packet different");
-            qemu_mutex_lock(&s->timer_check_lock);
-            g_queue_push_tail(&conn->primary_list, pkt);
-            qemu_mutex_unlock(&s->timer_check_lock);
-            /* TODO: colo_notify_checkpoint();*/
-            break;
+            spkt = g_queue_peek_head(&conn->secondary_list);
+            colo_count_mismatch(pkt, spkt->size != pkt->size ?
+                                     &w->mismatch_size : &w->mismatch_payload);
         }
+
+        /*
+         * If one packet arrive late, the secondary_list or
+         * primary_list will be empty, so we can't compare it
+         * until next comparison.
+         */
+        trace_colo_compare_main("packet different");
+        /* TODO: colo_notify_checkpoint();*/
+        break;
     }
 }
 
-static int compare_chr_send(CharBackend *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size)
 {
@@ -412,19 +623,22 @@ static int compare_chr_send(CharBackend *out,
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)&len, sizeof(len));
+    qemu_mutex_lock(&s->out_lock);
+    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
     if (ret != sizeof(len)) {
         goto err;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)buf, size);
+    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
     if (ret != size) {
         goto err;
     }
+    qemu_mutex_unlock(&s->out_lock);
 
     return 0;
 
 err:
+    qemu_mutex_unlock(&s->out_lock);
     return ret < 0 ? ret : -EIO;
 }
 
@@ -467,25 +681,53 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
     }
 }
 
+static void *colo_compare_worker(void *opaque)
+{
+    CompareWorker *w = opaque;
+    GQueue pri, sec;
+    Packet *pkt;
+
+    qemu_mutex_lock(&w->lock);
+    while (!w->quit) {
+        if (g_queue_is_empty(&w->pri_in) && g_queue_is_empty(&w->sec_in)) {
+            qemu_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        /* Take the whole backlog and compare it without holding the lock */
+        pri = w->pri_in;
+        sec = w->sec_in;
+        g_queue_init(&w->pri_in);
+        g_queue_init(&w->sec_in);
+        qemu_mutex_unlock(&w->lock);
+
+        qemu_mutex_lock(&w->conn_lock);
+        while ((pkt = g_queue_pop_head(&pri))) {
+            packet_enqueue_conn(w, pkt, PRIMARY_IN);
+        }
+        while ((pkt = g_queue_pop_head(&sec))) {
+            packet_enqueue_conn(w, pkt, SECONDARY_IN);
+        }
+        qemu_mutex_unlock(&w->conn_lock);
+
+        qemu_mutex_lock(&w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
 static void *colo_compare_thread(void *opaque)
 {
-    GMainContext *worker_context;
-    GMainLoop *compare_loop;
     CompareState *s = opaque;
 
-    worker_context = g_main_context_new();
-
     qemu_chr_fe_set_handlers(&s->chr_pri_in, compare_chr_can_read,
-                             compare_pri_chr_in, NULL, s, worker_context, true);
+                             compare_pri_chr_in, NULL, s, s->worker_context,
+                             true);
     qemu_chr_fe_set_handlers(&s->chr_sec_in, compare_chr_can_read,
-                             compare_sec_chr_in, NULL, s, worker_context, true);
-
-    compare_loop = g_main_loop_new(worker_context, FALSE);
-
-    g_main_loop_run(compare_loop);
+                             compare_sec_chr_in, NULL, s, s->worker_context,
+                             true);
 
-    g_main_loop_unref(compare_loop);
-    g_main_context_unref(worker_context);
+    g_main_loop_run(s->compare_loop);
     return NULL;
 }
 
@@ -534,16 +776,80 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
     s->outdev = g_strdup(value);
 }
 
+static void compare_get_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    if (s->workers) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once the "
+                   "object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value || value > MAX_COMPARE_THREADS) {
+        error_setg(&local_err, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        goto out;
+    }
+    s->threads = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void compare_get_stats(Object *obj, Visitor *v, const char *name,
+                              void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    ColoCompareStats *stats = g_new0(ColoCompareStats, 1);
+    int64_t latency_total = 0;
+    int i;
+
+    for (i = 0; s->workers && i < s->threads; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->conn_lock);
+        stats->packets += w->packets;
+        stats->segmented += w->segmented;
+        latency_total += w->latency_total;
+        stats->max_latency = MAX(stats->max_latency, w->latency_max);
+        stats->mismatch_size += w->mismatch_size;
+        stats->mismatch_payload += w->mismatch_payload;
+        stats->mismatch_header += w->mismatch_header;
+        stats->old_packets += w->old_packets;
+        stats->dropped += w->dropped;
+        qemu_mutex_unlock(&w->conn_lock);
+    }
+    if (stats->packets) {
+        stats->average_latency = latency_total / stats->packets;
+    }
+
+    visit_type_ColoCompareStats(v, name, &stats, errp);
+    qapi_free_ColoCompareStats(stats);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
 
     if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(&s->chr_out, pri_rs->buf, pri_rs->packet_len);
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        compare_chr_send(s, pri_rs->buf, pri_rs->packet_len);
     }
 }
 
@@ -553,9 +859,6 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 
     if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
     }
 }
 
@@ -599,9 +902,7 @@ static void check_old_packet_regular(void *opaque)
      * TODO: Make timer handler run in compare thread
      * like qemu_chr_add_handlers_full.
      */
-    qemu_mutex_lock(&s->timer_check_lock);
     colo_old_packet_check(s);
-    qemu_mutex_unlock(&s->timer_check_lock);
 }
 
 /*
@@ -614,6 +915,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     Chardev *chr;
     char thread_name[64];
     static int compare_id;
+    int i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -645,14 +947,34 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize);
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize);
 
-    g_queue_init(&s->conn_list);
-    qemu_mutex_init(&s->timer_check_lock);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    qemu_mutex_init(&s->out_lock);
+
+    s->workers = g_new0(CompareWorker, s->threads);
+    for (i = 0; i < s->threads; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        w->s = s;
+        qemu_mutex_init(&w->lock);
+        qemu_cond_init(&w->cond);
+        g_queue_init(&w->pri_in);
+        g_queue_init(&w->sec_in);
+        qemu_mutex_init(&w->conn_lock);
+        g_queue_init(&w->conn_list);
+        w->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                          connection_key_equal,
+                                                          g_free,
+                                                          connection_destroy);
+
+        snprintf(thread_name, sizeof(thread_name), "colo-compare %d.%d",
+                 compare_id, i);
+        qemu_thread_create(&w->thread, thread_name,
+                           colo_compare_worker, w,
+                           QEMU_THREAD_JOINABLE);
+    }
 
+    /* Created here so that finalize can always stop the loop */
+    s->worker_context = g_main_context_new();
+    s->compare_loop = g_main_loop_new(s->worker_context, FALSE);
     sprintf(thread_name, "colo-compare %d", compare_id);
     qemu_thread_create(&s->thread, thread_name,
                        colo_compare_thread, s,
@@ -677,6 +999,14 @@ static void colo_compare_class_init(ObjectClass *oc, void *data)
 
 static void colo_compare_init(Object *obj)
 {
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->threads = 1;
+    object_property_add(obj, "threads", "uint32",
+                        compare_get_threads, compare_set_threads,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "stats", "ColoCompareStats",
+                        compare_get_stats, NULL, NULL, NULL, NULL);
     object_property_add_str(obj, "primary_in",
                             compare_get_pri_indev, compare_set_pri_indev,
                             NULL);
@@ -688,27 +1018,70 @@ static void colo_compare_init(Object *obj)
                             NULL);
 }
 
+static gboolean colo_compare_quit_loop(gpointer opaque)
+{
+    CompareState *s = opaque;
+
+    g_main_loop_quit(s->compare_loop);
+    return FALSE;
+}
+
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
+    int i;
+
+    /*
+     * Stop the compare thread first: it reads from the chardevs and
+     * feeds the workers.
+     */
+    if (s->compare_loop) {
+        GSource *source = g_idle_source_new();
+
+        /* Quit from inside the loop, in case it is not running yet */
+        g_source_set_callback(source, colo_compare_quit_loop, s, NULL);
+        g_source_attach(source, s->worker_context);
+        g_source_unref(source);
+        qemu_thread_join(&s->thread);
+    }
 
     qemu_chr_fe_deinit(&s->chr_pri_in);
     qemu_chr_fe_deinit(&s->chr_sec_in);
-    qemu_chr_fe_deinit(&s->chr_out);
-
-    g_queue_free(&s->conn_list);
 
-    if (qemu_thread_is_self(&s->thread)) {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
-        qemu_thread_join(&s->thread);
+    if (s->compare_loop) {
+        g_main_loop_unref(s->compare_loop);
+        g_main_context_unref(s->worker_context);
     }
 
     if (s->timer) {
         timer_del(s->timer);
     }
 
-    qemu_mutex_destroy(&s->timer_check_lock);
+    for (i = 0; s->workers && i < s->threads; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->lock);
+        w->quit = true;
+        qemu_cond_signal(&w->cond);
+        qemu_mutex_unlock(&w->lock);
+        qemu_thread_join(&w->thread);
+
+        g_queue_foreach(&w->pri_in, packet_destroy, NULL);
+        g_queue_clear(&w->pri_in);
+        g_queue_foreach(&w->sec_in, packet_destroy, NULL);
+        g_queue_clear(&w->sec_in);
+        g_queue_clear(&w->conn_list);
+        g_hash_table_destroy(w->connection_track_table);
+        qemu_cond_destroy(&w->cond);
+        qemu_mutex_destroy(&w->lock);
+        qemu_mutex_destroy(&w->conn_lock);
+    }
+    if (s->workers) {
+        g_free(s->workers);
+        qemu_mutex_destroy(&s->out_lock);
+    }
+
+    qemu_chr_fe_deinit(&s->chr_out);
 
     g_free(s->pri_indev);
     g_free(s->sec_indev);
@@ -159,7 +159,10 @@ Packet *packet_new(const void *data, int size)
 
     pkt->data = g_memdup(data, size);
     pkt->size = size;
-    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->creation_us = qemu_clock_get_us(QEMU_CLOCK_HOST);
+    pkt->creation_ms = pkt->creation_us / 1000;
+    pkt->tcp_matched = 0;
+    pkt->mismatched = false;
 
     return pkt;
 }
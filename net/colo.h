@@ -43,6 +43,12 @@ typedef struct Packet {
     int size;
     /* Time of packet creation, in wall clock ms */
     int64_t creation_ms;
+    /* Same, in wall clock us */
+    int64_t creation_us;
+    /* Bytes of TCP payload colo-compare already matched */
+    int tcp_matched;
+    /* colo-compare already counted this packet as a mismatch */
+    bool mismatched;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -1,6 +1,9 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address.  Each hash bucket is a
+ * small set of CACHE_WAYS entries; when a set is full the victim is the
+ * stale entry that has been hit the least, so pages that keep getting
+ * re-dirtied stay cached in preference to pages that were dirtied once.
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,17 +32,25 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of entries per hash bucket */
+#define CACHE_WAYS 4
+
+/* saturation value for the per-entry hit counter */
+#define CACHE_MAX_HITS 255
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
+    unsigned int num_ways;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
@@ -71,6 +82,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(CACHE_WAYS, num_pages);
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -86,6 +98,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -111,25 +124,80 @@ void cache_fini(PageCache *cache)
 static size_t cache_get_cache_pos(const PageCache *cache,
                                   uint64_t address)
 {
+    size_t num_sets;
+
     g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    num_sets = cache->max_num_items / cache->num_ways;
+    return ((address / cache->page_size) & (num_sets - 1)) * cache->num_ways;
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = &cache->page_cache[cache_get_cache_pos(cache, addr)];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Pick the entry of @addr's set that a new page for @addr should go to:
+ * an empty entry if there is one, otherwise the least frequently hit entry
+ * among those that are not fresh (ties go to the oldest one).  Returns NULL
+ * if every entry in the set is still fresh.  The set is left unchanged.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set, *victim = NULL;
+    unsigned int i;
+
+    set = &cache->page_cache[cache_get_cache_pos(cache, addr)];
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
 
-    return &cache->page_cache[pos];
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        if (!victim || it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Halve the hit counts of @addr's set, so that pages that stopped being
+ * dirtied eventually become candidates for replacement again.
+ */
+static void cache_age_hits(PageCache *cache, uint64_t addr)
+{
+    CacheItem *set;
+    unsigned int i;
+
+    set = &cache->page_cache[cache_get_cache_pos(cache, addr)];
+    for (i = 0; i < cache->num_ways; i++) {
+        set[i].it_hits >>= 1;
+    }
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,9 +207,12 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and the hit count when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
@@ -155,12 +226,18 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            /* all pages in the set are fresh, don't replace them */
+            return -1;
+        }
+        if (it->it_data) {
+            cache_age_hits(cache, addr);
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -209,8 +286,10 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            new_it = cache_get_victim(new_cache, old_it->it_addr,
+                                      old_it->it_age + CACHED_PAGE_LIFETIME);
+            if (!new_it || (new_it->it_data &&
+                            new_it->it_age >= old_it->it_age)) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
             } else {
@@ -220,6 +299,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 g_free(new_it->it_data);
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
+                new_it->it_hits = old_it->it_hits;
                 new_it->it_addr = old_it->it_addr;
             }
         }
@@ -228,6 +308,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 
 #include "libqtest.h"
+#include "qapi/qmp/qint.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
@@ -345,6 +346,32 @@ static void check_guests_ram(void)
     g_assert_false(bad);
 }
 
+/*
+ * The guest kept running on the destination through postcopy, so it must
+ * have faulted on pages, and each timed fault is in one histogram bucket.
+ */
+static void check_fault_latency(void)
+{
+    QDict *rsp, *rsp_return, *latency;
+    const QListEntry *entry;
+    int64_t faults, sum = 0;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert(qdict_haskey(rsp_return, "postcopy-fault-latency"));
+    latency = qdict_get_qdict(rsp_return, "postcopy-fault-latency");
+
+    faults = qdict_get_int(latency, "faults");
+    g_assert_cmpint(faults, >, 0);
+    g_assert_cmpint(qdict_get_int(latency, "average"), <=,
+                    qdict_get_int(latency, "max"));
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(latency, "histogram"), entry) {
+        sum += qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+    }
+    g_assert_cmpint(sum, ==, faults);
+    QDECREF(rsp);
+}
+
 static void cleanup(const char *filename)
 {
     char *path = g_strdup_printf("%s/%s", tmpfs, filename);
@@ -490,6 +517,7 @@ static void test_migrate(void)
     g_assert_cmpint(dest_byte_c, ==, dest_byte_d);
 
     check_guests_ram();
+    check_fault_latency();
 
     qtest_quit(to);
     g_free(uri);
@@ -502,26 +530,962 @@ static void test_migrate(void)
     cleanup("dest_serial");
 }
 
-int main(int argc, char **argv)
+/*
+ * Precopy migration with batch-pages set on both sides: runs of dirty pages
+ * are sent while the guest keeps dirtying them, and the destination must
+ * end up with consistent RAM.
+ */
+static void test_batch_pages(void)
 {
-    char template[] = "/tmp/postcopy-test-XXXXXX";
-    int ret;
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp;
 
-    g_test_init(&argc, &argv, NULL);
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
 
-    if (!ufd_version_check()) {
-        return 0;
+    got_stop = false;
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -incoming %s",
+                              tmpfs, bootpath, uri);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+
+    global_qtest = from;
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'batch-pages',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    global_qtest = to;
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'batch-pages',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* Slow enough that the guest dirties pages behind the first pass */
+    global_qtest = from;
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "'arguments': { 'value': 100000000 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_migration_pass();
+
+    /* Let the remaining passes converge */
+    rsp = return_or_event(qmp("{ 'execute': 'migrate_set_downtime',"
+                              "'arguments': { 'value': 10 } }"));
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    wait_for_migration_complete();
+    qtest_quit(from);
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    wait_for_serial("dest_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+    check_guests_ram();
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("migsocket");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+#define BLOCK_DISK_SIZE (32 * 1024 * 1024)
+
+/*
+ * Create a sparse source disk with a few data ranges: a run of whole
+ * migration chunks that is read in one batch, a single page in an
+ * otherwise zero chunk and the end of the disk.  The destination disk is
+ * filled with garbage, so the zero ranges must be written there as well.
+ */
+static void init_block_disks(const char *srcpath, const char *dstpath)
+{
+    uint8_t *buf = g_malloc(4 * 1024 * 1024);
+    off_t offset;
+    int fd;
+
+    fd = open(srcpath, O_CREAT | O_TRUNC | O_WRONLY, 0660);
+    g_assert(fd >= 0);
+    g_assert_cmpint(ftruncate(fd, BLOCK_DISK_SIZE), ==, 0);
+    memset(buf, 0x5a, 4 * 1024 * 1024);
+    g_assert_cmpint(pwrite(fd, buf, 4 * 1024 * 1024, 4 * 1024 * 1024), ==,
+                    4 * 1024 * 1024);
+    memset(buf, 0x11, 4096);
+    g_assert_cmpint(pwrite(fd, buf, 4096, 17 * 1024 * 1024 + 4096), ==, 4096);
+    memset(buf, 0x22, 512 * 1024);
+    g_assert_cmpint(pwrite(fd, buf, 512 * 1024,
+                           BLOCK_DISK_SIZE - 512 * 1024), ==, 512 * 1024);
+    close(fd);
+
+    fd = open(dstpath, O_CREAT | O_TRUNC | O_WRONLY, 0660);
+    g_assert(fd >= 0);
+    memset(buf, 0xaa, 4 * 1024 * 1024);
+    for (offset = 0; offset < BLOCK_DISK_SIZE; offset += 4 * 1024 * 1024) {
+        g_assert_cmpint(pwrite(fd, buf, 4 * 1024 * 1024, offset), ==,
+                        4 * 1024 * 1024);
     }
+    close(fd);
 
-    tmpfs = mkdtemp(template);
-    if (!tmpfs) {
-        g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
+    g_free(buf);
+}
+
+/*
+ * Migrate a guest with a mostly zero disk using block migration, with and
+ * without encoding the zero blocks, and check that the destination ends up
+ * with the same disk and RAM.
+ */
+static void test_block_common(bool zero_blocks)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    gchar *src_data, *dst_data;
+    gsize src_len, dst_len;
+    QDict *rsp;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+    char *dst_bootpath = g_strdup_printf("%s/bootsect_dst", tmpfs);
+    char *srcpath = g_strdup_printf("%s/srcdisk", tmpfs);
+    char *dstpath = g_strdup_printf("%s/dstdisk", tmpfs);
+
+    got_stop = false;
+    /* Block migration writes the boot disk too, so each side has its own */
+    init_bootfile_x86(bootpath);
+    init_bootfile_x86(dst_bootpath);
+    init_block_disks(srcpath, dstpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw"
+                              " -drive file=%s,format=raw,if=none,id=disk0",
+                              tmpfs, bootpath, srcpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -drive file=%s,format=raw,if=none,id=disk0"
+                              " -incoming %s",
+                              tmpfs, dst_bootpath, dstpath, uri);
+    g_free(bootpath);
+    g_free(dst_bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+
+    global_qtest = from;
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-capabilities',"
+                              "'arguments': { "
+                                  "'capabilities': [ {"
+                                      "'capability': 'zero-blocks',"
+                                      "'state': %s } ] } }",
+                          zero_blocks ? "true" : "false");
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "'arguments': { 'value': 1000000000 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    rsp = qmp("{ 'execute': 'migrate_set_downtime',"
+              "'arguments': { 'value': 10 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s', 'blk': true } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_migration_complete();
+    qtest_quit(from);
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    wait_for_serial("dest_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+    check_guests_ram();
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    g_assert(g_file_get_contents(srcpath, &src_data, &src_len, NULL));
+    g_assert(g_file_get_contents(dstpath, &dst_data, &dst_len, NULL));
+    g_assert_cmpint(src_len, ==, BLOCK_DISK_SIZE);
+    g_assert_cmpint(dst_len, ==, BLOCK_DISK_SIZE);
+    g_assert(memcmp(src_data, dst_data, BLOCK_DISK_SIZE) == 0);
+    g_free(src_data);
+    g_free(dst_data);
+    g_free(srcpath);
+    g_free(dstpath);
+
+    cleanup("bootsect");
+    cleanup("bootsect_dst");
+    cleanup("srcdisk");
+    cleanup("dstdisk");
+    cleanup("migsocket");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+static void test_block(void)
+{
+    test_block_common(false);
+}
+
+static void test_block_zero_blocks(void)
+{
+    test_block_common(true);
+}
+
+/*
+ * Save a guest with fixed-ram and load it into a destination whose RAM has
+ * been scribbled over first: pages that were zero on the source must come
+ * back as zero.
+ */
+static void test_fixed_ram(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp;
+    uint8_t b;
+    unsigned address;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -incoming defer",
+                              tmpfs, bootpath);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'fixed-ram',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = return_or_event(qmp(cmd));
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    wait_for_migration_complete();
+    qtest_quit(from);
+
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+    global_qtest = to;
+
+    /* The guest never touches RAM above end_address */
+    for (address = end_address; address < end_address + 1024 * 1024;
+         address += 4096) {
+        b = 0xff;
+        qtest_memwrite(to, address, &b, 1);
     }
-    g_assert(tmpfs);
 
-    module_call_init(MODULE_INIT_QOM);
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'fixed-ram',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
 
-    qtest_add_func("/postcopy", test_migrate);
+    cmd = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_serial("dest_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+    check_guests_ram();
+
+    for (address = end_address; address < end_address + 1024 * 1024;
+         address += 4096) {
+        qtest_memread(to, address, &b, 1);
+        g_assert_cmpint(b, ==, 0);
+    }
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("migfile");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+/*
+ * Take a background snapshot of a running guest into a file and check that
+ * it restores consistently, and that saving RAM with the guest running did
+ * not count as downtime.
+ */
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp, *rsp_return;
+    QList *caps, *times;
+    const QListEntry *entry;
+    bool enabled = false;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -incoming %s",
+                              tmpfs, bootpath, uri);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'background-snapshot',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* The capability stays off without userfaultfd write protection */
+    rsp = qmp("{ 'execute': 'query-migrate-capabilities' }");
+    caps = qdict_get_qlist(rsp, "return");
+    QLIST_FOREACH_ENTRY(caps, entry) {
+        QDict *cap = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(cap, "capability"),
+                    "background-snapshot")) {
+            enabled = qdict_get_bool(cap, "state");
+        }
+    }
+    QDECREF(rsp);
+    if (!enabled) {
+        g_test_message("Skipping test: no userfaultfd write protection");
+        qtest_quit(from);
+        g_free(cmd_dst);
+        g_free(uri);
+        global_qtest = global;
+        cleanup("bootsect");
+        cleanup("src_serial");
+        return;
+    }
+
+    wait_for_serial("src_serial");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = return_or_event(qmp(cmd));
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    wait_for_migration_complete();
+
+    /* Only what was saved with the guest stopped makes up the downtime */
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert(qdict_haskey(rsp_return, "downtime-save"));
+    times = qdict_get_qlist(rsp_return, "downtime-save");
+    QLIST_FOREACH_ENTRY(times, entry) {
+        QDict *time = qobject_to_qdict(qlist_entry_obj(entry));
+
+        g_assert_cmpstr(qdict_get_str(time, "name"), !=, "ram");
+    }
+    QDECREF(rsp);
+    qtest_quit(from);
+
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+    global_qtest = to;
+
+    wait_for_serial("dest_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+    check_guests_ram();
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("migfile");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+/*
+ * Returns the COLO checkpoint statistics of the primary, or NULL if it is
+ * not in COLO state yet.
+ */
+static QDict *get_colo_checkpoint(void)
+{
+    QDict *rsp, *rsp_return, *stats = NULL;
+
+    rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), !=, "failed");
+    if (qdict_haskey(rsp_return, "colo-checkpoint")) {
+        stats = qdict_get_qdict(rsp_return, "colo-checkpoint");
+        QINCREF(stats);
+    }
+    QDECREF(rsp);
+    return stats;
+}
+
+/*
+ * Run COLO with incremental checkpoints for a few checkpoints while the
+ * guest dirties its RAM, and check what the primary reports about them.
+ */
+static void test_colo(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp, *stats;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -incoming %s",
+                              tmpfs, bootpath, uri);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+
+    global_qtest = from;
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'x-colo',"
+                          "'state': true }, {"
+                          "'capability': 'x-colo-incremental',"
+                          "'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: COLO not supported");
+        QDECREF(rsp);
+        qtest_quit(from);
+        qtest_quit(to);
+        g_free(uri);
+        global_qtest = global;
+        cleanup("bootsect");
+        cleanup("src_serial");
+        cleanup("dest_serial");
+        return;
+    }
+    QDECREF(rsp);
+
+    /* Leave time to send pages ahead between checkpoints */
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'x-checkpoint-delay': 300 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    global_qtest = to;
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'x-colo',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    global_qtest = from;
+    wait_for_serial("src_serial");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = return_or_event(qmp(cmd));
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    do {
+        usleep(1000 * 100);
+        stats = get_colo_checkpoint();
+        if (stats && qdict_get_int(stats, "checkpoints") >= 4) {
+            break;
+        }
+        QDECREF(stats);
+    } while (true);
+
+    /* The guest keeps dirtying RAM, so some was sent ahead */
+    g_assert_cmpint(qdict_get_int(stats, "presend-bytes"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "last-size"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "last-pause"), <=,
+                    qdict_get_int(stats, "max-pause"));
+    g_assert_cmpint(qdict_get_int(stats, "average-pause"), <=,
+                    qdict_get_int(stats, "max-pause"));
+    QDECREF(stats);
+
+    /*
+     * The secondary stays stopped for as long as it loads checkpoints,
+     * deltas included; it would have left COLO and started on an error.
+     */
+    global_qtest = to;
+    rsp = return_or_event(qmp("{ 'execute': 'query-status' }"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(rsp, "return"), "status"),
+                    ==, "inmigrate");
+    QDECREF(rsp);
+
+    qtest_quit(from);
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("migsocket");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+/*
+ * Wait for the incoming side to report @status through a MIGRATION event;
+ * it must not fail on the way.
+ */
+static void wait_for_incoming_status(const char *status)
+{
+    QDict *rsp, *data;
+    bool done = false;
+
+    do {
+        const char *current;
+
+        rsp = qtest_qmp_receive(global_qtest);
+        if (!qdict_haskey(rsp, "event") ||
+            strcmp(qdict_get_str(rsp, "event"), "MIGRATION")) {
+            QDECREF(rsp);
+            continue;
+        }
+        data = qdict_get_qdict(rsp, "data");
+        current = qdict_get_str(data, "status");
+        g_assert_cmpstr(current, !=, "failed");
+        done = strcmp(current, status) == 0;
+        QDECREF(rsp);
+    } while (!done);
+}
+
+/*
+ * Save a running guest to a file, then restore it with lazy-restore: the
+ * guest restarts before its RAM has been read and must see all of it.
+ */
+static void test_lazy_restore(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *global = global_qtest, *from, *to;
+    gchar *cmd, *cmd_src, *cmd_dst;
+    QDict *rsp;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    cmd_dst = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcdest,debug-threads=on"
+                              " -serial file:%s/dest_serial"
+                              " -drive file=%s,format=raw"
+                              " -incoming defer",
+                              tmpfs, bootpath);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    /* Let the guest dirty all of its RAM once, then save it */
+    wait_for_serial("src_serial");
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = return_or_event(qmp(cmd));
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    wait_for_migration_complete();
+    qtest_quit(from);
+
+    to = qtest_init(cmd_dst);
+    g_free(cmd_dst);
+    global_qtest = to;
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'lazy-restore',"
+                          "'state': true }, {"
+                          "'capability': 'events',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                          "'arguments': { 'uri': '%s' } }",
+                          uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* The guest runs on while the rest of RAM is filled in */
+    wait_for_serial("dest_serial");
+    wait_for_incoming_status("completed");
+
+    rsp = return_or_event(qmp("{ 'execute' : 'stop'}"));
+    QDECREF(rsp);
+    check_guests_ram();
+
+    qtest_quit(to);
+    g_free(uri);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("migfile");
+    cleanup("src_serial");
+    cleanup("dest_serial");
+}
+
+/*
+ * Migrate a guest that dirties its RAM faster than it can be sent, with
+ * auto-converge aiming at a dirty rate target, and check that its vcpus get
+ * throttled but never beyond cpu-throttle-max.
+ */
+static void test_auto_converge(void)
+{
+    QTestState *global = global_qtest, *from;
+    gchar *cmd_src;
+    QDict *rsp, *rsp_return, *params;
+    QList *vcpus = NULL;
+    const QListEntry *entry;
+    int64_t percentage;
+    bool throttled = false;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    /* Out of range values are refused */
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'dirty-rate-target': -1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'cpu-throttle-max': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'cpu-throttle-max': 100 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
+                  "'arguments': { "
+                      "'capabilities': [ {"
+                          "'capability': 'auto-converge',"
+                          "'state': true } ] } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* A 1MiB/s target is far below what the guest dirties */
+    rsp = qmp("{ 'execute': 'migrate-set-parameters',"
+              "'arguments': { 'dirty-rate-target': 1,"
+                             "'cpu-throttle-max': 50,"
+                             "'cpu-throttle-increment': 10 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    rsp = qmp("{ 'execute': 'query-migrate-parameters' }");
+    params = qdict_get_qdict(rsp, "return");
+    g_assert_cmpint(qdict_get_int(params, "dirty-rate-target"), ==, 1);
+    g_assert_cmpint(qdict_get_int(params, "cpu-throttle-max"), ==, 50);
+    QDECREF(rsp);
+
+    /* As in test_migrate, precopy must not finish on its own */
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "'arguments': { 'value': 100000000 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    rsp = qmp("{ 'execute': 'migrate_set_downtime',"
+              "'arguments': { 'value': 0.001 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate',"
+                              "'arguments': { 'uri': 'exec:cat > /dev/null' }"
+                              "}"));
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* The throttle is recomputed about once a second, each pass */
+    do {
+        usleep(100 * 1000);
+        rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+        rsp_return = qdict_get_qdict(rsp, "return");
+        g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "active");
+        if (qdict_haskey(rsp_return, "vcpu-throttle")) {
+            vcpus = qdict_get_qlist(rsp_return, "vcpu-throttle");
+            QLIST_FOREACH_ENTRY(vcpus, entry) {
+                QDict *vcpu = qobject_to_qdict(qlist_entry_obj(entry));
+
+                percentage = qdict_get_int(vcpu, "percentage");
+                g_assert_cmpint(percentage, <=, 50);
+                throttled |= percentage > 0;
+            }
+        }
+        QDECREF(rsp);
+    } while (!throttled);
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate_cancel' }"));
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    qtest_quit(from);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("src_serial");
+}
+
+/*
+ * Measure the dirty page rate of a running guest with calc-dirty-rate and
+ * wait for query-dirty-rate to report the result.  TCG is forced so that
+ * the per-vCPU rates are reported too.
+ */
+static void test_dirty_rate(void)
+{
+    QTestState *global = global_qtest, *from;
+    gchar *cmd_src;
+    QDict *rsp, *rsp_return;
+    QList *vcpus;
+    const QListEntry *entry;
+    const char *status;
+    int64_t total = 0;
+
+    char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+
+    init_bootfile_x86(bootpath);
+    cmd_src = g_strdup_printf("-machine accel=tcg -m 150M"
+                              " -name pcsource,debug-threads=on"
+                              " -serial file:%s/src_serial"
+                              " -drive file=%s,format=raw",
+                              tmpfs, bootpath);
+    g_free(bootpath);
+
+    from = qtest_start(cmd_src);
+    g_free(cmd_src);
+
+    rsp = qmp("{ 'execute': 'query-dirty-rate' }");
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "unstarted");
+    QDECREF(rsp);
+
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "'arguments': { 'calc-time': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    wait_for_serial("src_serial");
+
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* The measurement owns the dirty log until it is done */
+    rsp = qmp("{ 'execute': 'calc-dirty-rate',"
+              "'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+    rsp = qmp("{ 'execute': 'migrate',"
+              "'arguments': { 'uri': 'exec:cat > /dev/null' } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    for (;;) {
+        usleep(100 * 1000);
+        rsp = qmp("{ 'execute': 'query-dirty-rate' }");
+        rsp_return = qdict_get_qdict(rsp, "return");
+        status = qdict_get_str(rsp_return, "status");
+        if (!strcmp(status, "measured")) {
+            break;
+        }
+        g_assert_cmpstr(status, ==, "measuring");
+        QDECREF(rsp);
+    }
+
+    /* The guest rewrites its 100MB loop over and over */
+    g_assert_cmpint(qdict_get_int(rsp_return, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-rate"), >, 0);
+    vcpus = qdict_get_qlist(rsp_return, "vcpu-dirty-rate");
+    QLIST_FOREACH_ENTRY(vcpus, entry) {
+        QDict *vcpu = qobject_to_qdict(qlist_entry_obj(entry));
+
+        g_assert_cmpint(qdict_get_int(vcpu, "dirty-rate"), >=, 0);
+        total += qdict_get_int(vcpu, "dirty-rate");
+    }
+    g_assert_cmpint(total, >, 0);
+    QDECREF(rsp);
+
+    qtest_quit(from);
+
+    global_qtest = global;
+
+    cleanup("bootsect");
+    cleanup("src_serial");
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/postcopy-test-XXXXXX";
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!ufd_version_check()) {
+        return 0;
+    }
+
+    tmpfs = mkdtemp(template);
+    if (!tmpfs) {
+        g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
+    }
+    g_assert(tmpfs);
+
+    module_call_init(MODULE_INIT_QOM);
+
+    qtest_add_func("/postcopy", test_migrate);
+    if (strcmp(qtest_get_arch(), "i386") == 0 ||
+        strcmp(qtest_get_arch(), "x86_64") == 0) {
+        qtest_add_func("/postcopy/lazy-restore", test_lazy_restore);
+        qtest_add_func("/postcopy/background-snapshot",
+                       test_background_snapshot);
+        qtest_add_func("/postcopy/fixed-ram", test_fixed_ram);
+        qtest_add_func("/postcopy/batch-pages", test_batch_pages);
+        qtest_add_func("/postcopy/block", test_block);
+        qtest_add_func("/postcopy/block/zero-blocks", test_block_zero_blocks);
+        qtest_add_func("/postcopy/colo", test_colo);
+        qtest_add_func("/postcopy/auto-converge", test_auto_converge);
+        qtest_add_func("/postcopy/dirty-rate", test_dirty_rate);
+    }
 
     ret = g_test_run();
 
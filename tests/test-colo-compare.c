@@ -0,0 +1,196 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The test plays both the primary and the secondary:
+ *
+ * qemu side                    | test side
+ *                              |
+ * +--------------+             |  +----------+
+ * |              <----------------+ pri_sock |
+ * |              |             |  +----------+
+ * | colo-compare <----------------+ sec_sock |
+ * |              |             |  +----------+
+ * |              +----------------> out_sock |
+ * +--------------+             |  +----------+
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+#include "qapi/qmp/qdict.h"
+
+#define PAYLOAD_LEN 8
+#define FRAME_LEN (14 + 20 + 8 + PAYLOAD_LEN)
+
+/* An ethernet frame with a UDP packet from 10.0.0.1:@port to 10.0.0.2:@port */
+static void make_udp_frame(uint8_t *frame, uint16_t port, uint8_t fill)
+{
+    uint8_t *ip = frame + 14;
+    uint8_t *udp = ip + 20;
+
+    memset(frame, 0, FRAME_LEN);
+    frame[12] = 0x08;                   /* ETH_P_IP */
+    ip[0] = 0x45;                       /* IPv4, 20 bytes of header */
+    ip[3] = FRAME_LEN - 14;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    ip[12] = 10;
+    ip[15] = 1;
+    ip[16] = 10;
+    ip[19] = 2;
+    stw_be_p(udp, port);
+    stw_be_p(udp + 2, port);
+    stw_be_p(udp + 4, 8 + PAYLOAD_LEN);
+    memset(udp + 8, fill, PAYLOAD_LEN);
+}
+
+static void send_frame(int sock, uint8_t *frame)
+{
+    uint32_t size = htonl(FRAME_LEN);
+    struct iovec iov[] = {
+        {
+            .iov_base = &size,
+            .iov_len = sizeof(size),
+        }, {
+            .iov_base = frame,
+            .iov_len = FRAME_LEN,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(sock, iov, 2, 0, sizeof(size) + FRAME_LEN);
+    g_assert_cmpint(ret, ==, sizeof(size) + FRAME_LEN);
+}
+
+static void recv_frame(int sock, uint8_t *expected)
+{
+    uint8_t frame[FRAME_LEN];
+    uint32_t len;
+    ssize_t ret;
+
+    ret = qemu_recv(sock, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    g_assert_cmpint(ntohl(len), ==, FRAME_LEN);
+    ret = qemu_recv(sock, frame, FRAME_LEN, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, FRAME_LEN);
+    g_assert(memcmp(frame, expected, FRAME_LEN) == 0);
+}
+
+static int64_t get_stat(const char *name)
+{
+    QDict *rsp, *stats;
+    int64_t value;
+
+    rsp = qmp("{ 'execute': 'qom-get', 'arguments': {"
+              " 'path': '/objects/cmp0', 'property': 'stats' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    stats = qdict_get_qdict(rsp, "return");
+    value = qdict_get_int(stats, name);
+    QDECREF(rsp);
+    return value;
+}
+
+static void test_compare(gconstpointer opaque)
+{
+#ifndef _WIN32
+    unsigned threads = GPOINTER_TO_UINT(opaque);
+    char pri_path[] = "colo-compare-pri.XXXXXX";
+    char sec_path[] = "colo-compare-sec.XXXXXX";
+    char out_path[] = "colo-compare-out.XXXXXX";
+    uint8_t same[FRAME_LEN], pri[FRAME_LEN], sec[FRAME_LEN];
+    int pri_sock, sec_sock, out_sock;
+    char *cmdline;
+    QDict *rsp;
+    int ret, i;
+
+    ret = mkstemp(pri_path);
+    g_assert_cmpint(ret, !=, -1);
+    ret = mkstemp(sec_path);
+    g_assert_cmpint(ret, !=, -1);
+    ret = mkstemp(out_path);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf(
+                "-chardev socket,id=pri0,path=%s,server,nowait "
+                "-chardev socket,id=sec0,path=%s,server,nowait "
+                "-chardev socket,id=out0,path=%s,server,nowait "
+                "-object colo-compare,id=cmp0,primary_in=pri0,"
+                "secondary_in=sec0,outdev=out0,threads=%u ",
+                pri_path, sec_path, out_path, threads);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    pri_sock = unix_connect(pri_path, NULL);
+    g_assert_cmpint(pri_sock, !=, -1);
+    sec_sock = unix_connect(sec_path, NULL);
+    g_assert_cmpint(sec_sock, !=, -1);
+    out_sock = unix_connect(out_path, NULL);
+    g_assert_cmpint(out_sock, !=, -1);
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qmp("{ 'execute' : 'query-status'}");
+
+    /* Matching packets are released */
+    for (i = 0; i < 16; i++) {
+        make_udp_frame(same, 1000 + i, i);
+        send_frame(pri_sock, same);
+        send_frame(sec_sock, same);
+        recv_frame(out_sock, same);
+    }
+    g_assert_cmpint(get_stat("packets"), ==, 16);
+
+    /*
+     * A primary packet that no secondary packet matches stays at the head
+     * of its connection and is compared again for every secondary packet,
+     * but is only counted once.
+     */
+    make_udp_frame(pri, 2000, 0x11);
+    send_frame(pri_sock, pri);
+    for (i = 0; i < 4; i++) {
+        make_udp_frame(sec, 2000, 0x22 + i);
+        send_frame(sec_sock, sec);
+    }
+
+    /* Once a later packet is out, the ones above have been compared */
+    make_udp_frame(same, 2000 + threads, 0x33);
+    send_frame(pri_sock, same);
+    send_frame(sec_sock, same);
+    recv_frame(out_sock, same);
+    if (threads == 1) {
+        g_assert_cmpint(get_stat("mismatch-payload"), ==, 1);
+    } else {
+        g_assert_cmpint(get_stat("mismatch-payload"), <=, 1);
+    }
+    g_assert_cmpint(get_stat("mismatch-size"), ==, 0);
+
+    /* Deleting the object stops the compare thread and the workers */
+    rsp = qmp("{ 'execute': 'object-del', 'arguments': { 'id': 'cmp0' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    close(pri_sock);
+    close(sec_sock);
+    close(out_sock);
+    unlink(pri_path);
+    unlink(sec_path);
+    unlink(out_path);
+    qtest_end();
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_data_func("/colo-compare/single-thread", GUINT_TO_POINTER(1),
+                        test_compare);
+    qtest_add_data_func("/colo-compare/workers", GUINT_TO_POINTER(4),
+                        test_compare);
+
+    return g_test_run();
+}
@@ -902,6 +902,46 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void test_hbitmap_next_zero_check(TestHBitmapData *data,
+                                         uint64_t start, uint64_t count)
+{
+    int64_t ret = hbitmap_next_zero(data->hb, start, count);
+    int64_t expected = -1;
+    uint64_t i;
+
+    for (i = start; i < start + count && i < data->size; i++) {
+        if (!hbitmap_get(data->hb, i)) {
+            expected = i;
+            break;
+        }
+    }
+    g_assert_cmpint(ret, ==, expected);
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    test_hbitmap_next_zero_check(data, 0, L3);
+    test_hbitmap_next_zero_check(data, L2 + 5, 1);
+
+    hbitmap_test_set(data, 0, L2 + 7);
+    test_hbitmap_next_zero_check(data, 0, L3);
+    test_hbitmap_next_zero_check(data, 3, L2);
+    test_hbitmap_next_zero_check(data, L2 + 6, 1);
+    test_hbitmap_next_zero_check(data, L2 + 6, 2);
+    test_hbitmap_next_zero_check(data, L2 + 7, L1);
+
+    hbitmap_test_set(data, L2 + 7, L3 - L2 - 7);
+    test_hbitmap_next_zero_check(data, 0, L3);
+    test_hbitmap_next_zero_check(data, L2, UINT64_MAX - L2);
+
+    hbitmap_test_reset(data, L3 - 1, 1);
+    test_hbitmap_next_zero_check(data, L1 + 1, UINT64_MAX - L1 - 1);
+    test_hbitmap_next_zero_check(data, L3 - 1, 1);
+    test_hbitmap_next_zero_check(data, L3 - 2, 1);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -929,6 +969,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/next-zero", test_hbitmap_next_zero);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -544,6 +544,65 @@ static void test_arr_ptr_str_no0_load(void)
     }
 }
 
+/* Integer arrays go through the bulk path of vmstate_save/load_state */
+typedef struct TestArrayInt {
+    uint16_t u16[3];
+    uint32_t u32[2];
+    int64_t  i64[2];
+} TestArrayInt;
+
+static const VMStateDescription vmsd_array_int = {
+    .name = "test/array/int",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(u16, TestArrayInt, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArrayInt, 2),
+        VMSTATE_INT64_ARRAY(i64, TestArrayInt, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static TestArrayInt obj_array_int = {
+    .u16 = { 0x0102, 0x0304, 0x0506 },
+    .u32 = { 0x0708090a, 0x0b0c0d0e },
+    .i64 = { 0x1011121314151617LL, -2 },
+};
+
+static uint8_t wire_array_int[] = {
+    /* u16 */ 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    /* u32 */ 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    /* i64 */ 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+              0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_array_int_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArrayInt));
+}
+
+static void test_array_int_save(void)
+{
+    TestArrayInt obj = obj_array_int;
+
+    save_vmstate(&vmsd_array_int, &obj);
+    compare_vmstate(wire_array_int, sizeof(wire_array_int));
+    /* the save path must not leave the source byte swapped */
+    g_assert(!memcmp(&obj, &obj_array_int, sizeof(obj)));
+}
+
+static void test_array_int_load(void)
+{
+    TestArrayInt obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    SUCCESS(load_vmstate(&vmsd_array_int, &obj, &obj_clone,
+                         obj_array_int_copy, 1, wire_array_int,
+                         sizeof(wire_array_int)));
+    g_assert(!memcmp(&obj, &obj_array_int, sizeof(obj)));
+}
+
 /* test QTAILQ migration */
 typedef struct TestQtailqElement TestQtailqElement;
 
@@ -688,6 +747,116 @@ static void test_load_q(void)
     qemu_fclose(fload);
 }
 
+/* Hooks that count how often they ran */
+typedef struct TestHooks {
+    uint32_t u32;
+    TestArrayInt inner;
+} TestHooks;
+
+static int hooks_post_load_calls, hooks_inner_post_load_calls;
+
+static int hooks_post_load(void *opaque, int version_id)
+{
+    hooks_post_load_calls++;
+    return 0;
+}
+
+static int hooks_inner_post_load(void *opaque, int version_id)
+{
+    hooks_inner_post_load_calls++;
+    return 0;
+}
+
+static int hooks_load_old(QEMUFile *f, void *opaque, int version_id)
+{
+    return 0;
+}
+
+static const VMStateDescription vmstate_hooks_inner = {
+    .name = "test/hooks/inner",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = hooks_inner_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(u16, TestArrayInt, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArrayInt, 2),
+        VMSTATE_INT64_ARRAY(i64, TestArrayInt, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_hooks = {
+    .name = "test/hooks",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = hooks_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(u32, TestHooks),
+        VMSTATE_STRUCT(inner, TestHooks, 1, vmstate_hooks_inner,
+                       TestArrayInt),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_load_old = {
+    .name = "test/load_old",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .minimum_version_id_old = 1,
+    .load_state_old = hooks_load_old,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(u32, TestArrayInt, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nested_load_old = {
+    .name = "test/nested_load_old",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(inner, TestHooks, 2, vmstate_load_old, TestArrayInt),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_independent(void)
+{
+    g_assert(vmstate_is_independent(&vmsd_array_int));
+    g_assert(vmstate_is_independent(&vmstate_simple_primitive));
+    /* Neither hooks nor other VMStateInfos make a device dependent */
+    g_assert(vmstate_is_independent(&vmstate_q));
+    g_assert(vmstate_is_independent(&vmstate_hooks));
+    g_assert(!vmstate_is_independent(&vmstate_load_old));
+    g_assert(!vmstate_is_independent(&vmstate_nested_load_old));
+}
+
+/* The _fields variant leaves the top-level hooks to the caller */
+static void test_load_fields(void)
+{
+    TestHooks obj = { .u32 = 0x01020304, .inner = obj_array_int };
+    TestHooks tgt;
+    QEMUFile *f;
+
+    save_vmstate(&vmstate_hooks, &obj);
+
+    hooks_post_load_calls = hooks_inner_post_load_calls = 0;
+    memset(&tgt, 0, sizeof(tgt));
+    f = open_test_file(false);
+    SUCCESS(vmstate_load_state_fields(f, &vmstate_hooks, &tgt, 1));
+    qemu_fclose(f);
+    g_assert_cmpint(tgt.u32, ==, obj.u32);
+    g_assert(!memcmp(&tgt.inner, &obj_array_int, sizeof(tgt.inner)));
+    g_assert_cmpint(hooks_post_load_calls, ==, 0);
+    g_assert_cmpint(hooks_inner_post_load_calls, ==, 1);
+
+    f = open_test_file(false);
+    SUCCESS(vmstate_load_state(f, &vmstate_hooks, &tgt, 1));
+    qemu_fclose(f);
+    g_assert_cmpint(hooks_post_load_calls, ==, 1);
+    g_assert_cmpint(hooks_inner_post_load_calls, ==, 2);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -706,6 +875,10 @@ int main(int argc, char **argv)
                     test_arr_ptr_str_no0_save);
     g_test_add_func("/vmstate/array/ptr/str/no0/load",
                     test_arr_ptr_str_no0_load);
+    g_test_add_func("/vmstate/array/int/save", test_array_int_save);
+    g_test_add_func("/vmstate/array/int/load", test_array_int_load);
+    g_test_add_func("/vmstate/independent", test_independent);
+    g_test_add_func("/vmstate/independent/load-fields", test_load_fields);
     g_test_add_func("/vmstate/qtailq/save/saveq", test_save_q);
     g_test_add_func("/vmstate/qtailq/load/loadq", test_load_q);
 
@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
+#include "migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +175,149 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_runs(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc0(PAGE_SIZE);
+    int i, start, len, dlen, rc;
+
+    /* place short runs at every offset around the vector boundaries */
+    for (start = 0; start < 80; start++) {
+        for (len = 1; len < 40; len++) {
+            memset(test, 0, PAGE_SIZE);
+            memset(buffer, 0, PAGE_SIZE);
+            for (i = start; i < start + len; i++) {
+                buffer[i] = i | 1;
+                buffer[PAGE_SIZE - 1 - i] = i | 1;
+            }
+
+            dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            g_assert(dlen > 0);
+
+            rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+            g_assert(rc <= PAGE_SIZE);
+            g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+static void cache_insert_page(PageCache *cache, uint64_t addr, uint8_t fill,
+                              uint64_t age)
+{
+    uint8_t *page = g_malloc(PAGE_SIZE);
+
+    memset(page, fill, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, addr, page, age), ==, 0);
+    g_free(page);
+}
+
+static void cache_hit_page(PageCache *cache, uint64_t addr, uint64_t age,
+                           int hits)
+{
+    while (hits--) {
+        g_assert(cache_is_cached(cache, addr, age));
+    }
+}
+
+static void test_cache_set_associative(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint8_t *data;
+    int i;
+
+    /* 4 sets of 4 ways; these pages all go to the first set */
+    for (i = 0; i < 4; i++) {
+        cache_insert_page(cache, i * 4 * PAGE_SIZE, i + 1, 0);
+    }
+    /* a page of another set does not disturb them */
+    cache_insert_page(cache, PAGE_SIZE, 0xff, 0);
+
+    for (i = 0; i < 4; i++) {
+        data = get_cached_data(cache, i * 4 * PAGE_SIZE);
+        g_assert(data);
+        g_assert_cmpint(data[0], ==, i + 1);
+        g_assert_cmpint(data[PAGE_SIZE - 1], ==, i + 1);
+    }
+    g_assert(get_cached_data(cache, PAGE_SIZE));
+
+    /* the set is full of fresh pages, so nothing is replaced */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 1), ==, -1);
+    g_assert(!get_cached_data(cache, 16 * PAGE_SIZE));
+
+    g_free(page);
+    cache_fini(cache);
+}
+
+static void test_cache_frequency(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        cache_insert_page(cache, i * PAGE_SIZE, i + 1, 0);
+    }
+    /* every page but the last one is dirtied again */
+    for (i = 0; i < 3; i++) {
+        cache_hit_page(cache, i * PAGE_SIZE, 0, 2);
+    }
+
+    /* all pages are stale now, the least hit one goes although it is not
+     * older than the others */
+    cache_insert_page(cache, 4 * PAGE_SIZE, 5, 2);
+    g_assert(!get_cached_data(cache, 3 * PAGE_SIZE));
+    for (i = 0; i < 3; i++) {
+        g_assert(get_cached_data(cache, i * PAGE_SIZE));
+    }
+    g_assert(get_cached_data(cache, 4 * PAGE_SIZE));
+
+    /* among equally hit pages, the oldest one goes */
+    cache_hit_page(cache, 4 * PAGE_SIZE, 3, 1);
+    cache_hit_page(cache, 0, 3, 1);
+    cache_hit_page(cache, 2 * PAGE_SIZE, 3, 1);
+    cache_insert_page(cache, 5 * PAGE_SIZE, 6, 5);
+    g_assert(!get_cached_data(cache, PAGE_SIZE));
+
+    cache_fini(cache);
+}
+
+static void test_cache_resize(void)
+{
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    int i;
+
+    /* 2 sets of 4 ways: A, B, C and D go to the first one, E to the other */
+    for (i = 0; i < 4; i++) {
+        cache_insert_page(cache, i * 2 * PAGE_SIZE, i + 1, 0);
+    }
+    cache_insert_page(cache, PAGE_SIZE, 0xff, 0);
+    cache_hit_page(cache, 0, 0, 3);
+    cache_hit_page(cache, 2 * PAGE_SIZE, 1, 4);
+    cache_hit_page(cache, 4 * PAGE_SIZE, 1, 4);
+    cache_hit_page(cache, 6 * PAGE_SIZE, 1, 2);
+
+    /* a single set is left; E does not fit and is dropped in favour of A */
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    g_assert(!get_cached_data(cache, PAGE_SIZE));
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpint(get_cached_data(cache, i * 2 * PAGE_SIZE)[0], ==,
+                        i + 1);
+    }
+
+    /* resizing kept the hit counts, so D goes rather than the older A */
+    cache_insert_page(cache, 8 * PAGE_SIZE, 9, 3);
+    g_assert(get_cached_data(cache, 0));
+    g_assert(!get_cached_data(cache, 6 * PAGE_SIZE));
+
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +330,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
+    g_test_add_func("/xbzrle/cache/set_associative",
+                    test_cache_set_associative);
+    g_test_add_func("/xbzrle/cache/frequency", test_cache_frequency);
+    g_test_add_func("/xbzrle/cache/resize", test_cache_resize);
 
     return g_test_run();
 }
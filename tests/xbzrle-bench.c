@@ -0,0 +1,154 @@
+/*
+ * XBZRLE encode/decode throughput benchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+
+static unsigned int duration = 1;
+static unsigned int n_pages = 1024;
+static unsigned int dirty_pct = 10;
+static unsigned int run_len = 64;
+
+static const char commands_string[] =
+    " -d = duration in seconds\n"
+    " -n = number of pages in the working set\n"
+    " -p = percentage of each page that is rewritten\n"
+    " -r = length in bytes of each rewritten run";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:p:r:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_pages = MAX(atoi(optarg), 1);
+            break;
+        case 'p':
+            dirty_pct = MIN(atoi(optarg), 100);
+            break;
+        case 'r':
+            run_len = MAX(MIN(atoi(optarg), PAGE_SIZE), 1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *old_pages, *new_pages, *encoded, *decoded;
+    uint64_t r = time(NULL) | 1;
+    uint64_t enc_bytes = 0, enc_pages = 0, dec_pages = 0;
+    int64_t start, end, deadline;
+    int *lens;
+    unsigned int i, j;
+
+    parse_args(argc, argv);
+
+    old_pages = qemu_memalign(64, (size_t)n_pages * PAGE_SIZE);
+    new_pages = qemu_memalign(64, (size_t)n_pages * PAGE_SIZE);
+    encoded = g_malloc((size_t)n_pages * PAGE_SIZE);
+    decoded = qemu_memalign(64, PAGE_SIZE);
+    lens = g_new(int, n_pages);
+
+    for (i = 0; i < n_pages * PAGE_SIZE; i += 8) {
+        r = xorshift64star(r);
+        memcpy(old_pages + i, &r, 8);
+    }
+    memcpy(new_pages, old_pages, (size_t)n_pages * PAGE_SIZE);
+    for (i = 0; i < n_pages; i++) {
+        unsigned int dirty = PAGE_SIZE * dirty_pct / 100;
+
+        for (j = 0; j < dirty; j += run_len) {
+            unsigned int off;
+
+            r = xorshift64star(r);
+            off = r % (PAGE_SIZE - run_len + 1);
+            memset(new_pages + (size_t)i * PAGE_SIZE + off, (r >> 32) | 1,
+                   run_len);
+        }
+    }
+
+    printf("Parameters:\n");
+    printf(" duration:          %u\n", duration);
+    printf(" # of pages:        %u\n", n_pages);
+    printf(" dirty percentage:  %u\n", dirty_pct);
+    printf(" run length:        %u\n", run_len);
+
+    start = get_clock();
+    deadline = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        for (i = 0; i < n_pages; i++) {
+            size_t off = (size_t)i * PAGE_SIZE;
+
+            lens[i] = xbzrle_encode_buffer(old_pages + off, new_pages + off,
+                                           PAGE_SIZE, encoded + off,
+                                           PAGE_SIZE);
+            enc_bytes += MAX(lens[i], 0);
+        }
+        enc_pages += n_pages;
+        end = get_clock();
+    } while (end < deadline);
+    printf("Results:\n");
+    printf(" Encode throughput:  %.2f MB/s\n",
+           (double)enc_pages * PAGE_SIZE / ((end - start) / 1e9) / 1e6);
+    printf(" Encoded size:       %.2f%% of input\n",
+           100.0 * enc_bytes / ((double)enc_pages * PAGE_SIZE));
+
+    start = get_clock();
+    deadline = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        for (i = 0; i < n_pages; i++) {
+            size_t off = (size_t)i * PAGE_SIZE;
+
+            if (lens[i] < 0) {
+                continue;
+            }
+            memcpy(decoded, old_pages + off, PAGE_SIZE);
+            xbzrle_decode_buffer(encoded + off, lens[i], decoded, PAGE_SIZE);
+        }
+        dec_pages += n_pages;
+        end = get_clock();
+    } while (end < deadline);
+    printf(" Decode throughput:  %.2f MB/s\n",
+           (double)dec_pages * PAGE_SIZE / ((end - start) / 1e9) / 1e6);
+
+    qemu_vfree(old_pages);
+    qemu_vfree(new_pages);
+    qemu_vfree(decoded);
+    g_free(encoded);
+    g_free(lens);
+    return 0;
+}
@@ -415,6 +415,42 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t first = start >> hb->granularity;
+    uint64_t last;
+    uint64_t pos;
+    unsigned long cur;
+    int64_t res;
+
+    if (count == 0 || first >= hb->size) {
+        return -1;
+    }
+    last = (start + count - 1) >> hb->granularity;
+    if (last >= hb->size || start + count - 1 < start) {
+        last = hb->size - 1;
+    }
+
+    /* Scan the last level one word at a time; bits before @start in the
+     * first word are treated as set.
+     */
+    pos = first >> BITS_PER_LEVEL;
+    cur = ~last_lev[pos] & (~0UL << (first & (BITS_PER_LONG - 1)));
+    while (cur == 0) {
+        if (++pos > (last >> BITS_PER_LEVEL)) {
+            return -1;
+        }
+        cur = ~last_lev[pos];
+    }
+
+    res = (pos << BITS_PER_LEVEL) + ctzl(cur);
+    if (res > last) {
+        return -1;
+    }
+    return MAX(res << hb->granularity, start);
+}
+
 uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
 {
     assert(hbitmap_is_serializable(hb));
@@ -1414,6 +1414,12 @@ void xen_modified_memory(ram_addr_t start, ram_addr_t length)
 
 void qmp_xen_set_global_dirty_log(bool enable, Error **errp)
 {
+    static bool enabled;
+
+    if (enable == enabled) {
+        return;
+    }
+    enabled = enable;
     if (enable) {
         memory_global_dirty_log_start();
     } else {